@@ -0,0 +1,520 @@
+/******************************************************************************
+DoGoBoy - Nintendo GameBoy Emulator
+*******************************************************************************
+Copyright (c) 2009-2013, Douglas Gore (doug@ssonic.co.uk)
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the Douglas Gore nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL DOUGLAS GORE BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*******************************************************************************
+Purpose:
+
+Micro benchmarks for the hot paths of the emulator core, so work on one
+subsystem can be judged on its own. Memory reads and writes are timed for
+each region of the memory map, executeOpcode for each class of instruction,
+the tile and sprite drawing for a scanline under different LCDC and scroll
+settings, and OAM DMA and interrupt dispatch. Every case is run once to warm
+the caches and then repeated, and the median and best are reported.
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "SDL.h"
+
+#include "gameboy.h"
+
+#define BENCH_REPEATS		9
+
+// A generated 64KB MBC1 cartridge with 8KB of RAM, removed when done
+#define BENCH_ROM_FILE		"core_bench.gb"
+#define BENCH_ROM_SIZE		0x10000
+
+// Each class of instruction loops around its own block of bank 0
+#define CODE_BLOCK_START	0x0200
+#define CODE_BLOCK_SIZE		0x0800
+
+// Work area for instructions that touch memory, and the stack
+#define DATA_ADDRESS		0xD000
+#define STACK_ADDRESS		0xDFF0
+
+typedef void (*benchFunction)(int iterations);
+
+typedef struct
+{
+    const char* name;
+    uint16_t base;
+    uint16_t mask;
+} memoryRegion;
+
+typedef struct
+{
+    const char* name;
+    uint8_t lcdc;
+    uint8_t scx;
+    uint8_t scy;
+    uint8_t wx;
+    uint8_t wy;
+    int layers;
+} lineSetting;
+
+static const memoryRegion readRegions[] =
+{
+    { "ROM bank 0",     0x0000, 0x3FFF },
+    { "ROM bank n",     0x4000, 0x3FFF },
+    { "VRAM",           0x8000, 0x1FFF },
+    { "cart RAM",       0xA000, 0x1FFF },
+    { "WRAM bank 0",    0xC000, 0x0FFF },
+    { "WRAM bank 1",    0xD000, 0x0FFF },
+    { "echo RAM",       0xE000, 0x0FFF },
+    { "OAM",            0xFE00, 0x007F },
+    { "I/O LCD",        0xFF40, 0x0007 },
+    { "I/O sound",      0xFF24, 0x0001 },
+    { "HRAM",           0xFF80, 0x003F },
+    { "IE",             0xFFFF, 0x0000 }
+};
+
+// Writes to ROM are MBC bank switches, and I/O avoids LY and DMA
+static const memoryRegion writeRegions[] =
+{
+    { "MBC ROM bank",   0x2000, 0x1FFF },
+    { "VRAM",           0x8000, 0x1FFF },
+    { "cart RAM",       0xA000, 0x1FFF },
+    { "WRAM bank 0",    0xC000, 0x0FFF },
+    { "WRAM bank 1",    0xD000, 0x0FFF },
+    { "echo RAM",       0xE000, 0x0FFF },
+    { "OAM",            0xFE00, 0x007F },
+    { "I/O scroll",     0xFF42, 0x0001 },
+    { "I/O sound",      0xFF24, 0x0001 },
+    { "HRAM",           0xFF80, 0x003F },
+    { "IE",             0xFFFF, 0x0000 }
+};
+
+static const char* opcodeClasses[] =
+{
+    "ALU",
+    "loads",
+    "branches",
+    "CB ops",
+    "stack"
+};
+
+#define NUM_OPCODE_CLASSES (sizeof(opcodeClasses) / sizeof(opcodeClasses[0]))
+
+static const lineSetting lineSettings[] =
+{
+    { "tiles",                  0x91, 0, 0,  0,   0,   DRAW_LAYER_TILES },
+    { "tiles fine scroll",      0x91, 3, 5,  0,   0,   DRAW_LAYER_TILES },
+    { "tiles 9C00/8800",        0x89, 3, 5,  0,   0,   DRAW_LAYER_TILES },
+    { "tiles half window",      0xF1, 3, 5,  87,  0,   DRAW_LAYER_TILES },
+    { "tiles full window",      0xF1, 3, 5,  7,   0,   DRAW_LAYER_TILES },
+    { "sprites 8x8",            0x93, 0, 0,  0,   0,   DRAW_LAYER_SPRITES },
+    { "sprites 8x16",           0x97, 0, 0,  0,   0,   DRAW_LAYER_SPRITES },
+    { "sprites off",            0x91, 0, 0,  0,   0,   DRAW_LAYER_SPRITES },
+    { "tiles + sprites",        0xF3, 3, 5,  87,  0,   DRAW_LAYER_TILES | DRAW_LAYER_SPRITES }
+};
+
+// Parameters of the case being run, the bench functions take only a count
+static const memoryRegion* currentRegion;
+static const lineSetting* currentLine;
+static volatile unsigned int sink;
+
+void writeLog(char* log_message, ...)
+{
+}
+
+void exit_with_debug(void)
+{
+    printf("Emulator stopped at PC 0x%04X\n", REGS.w.PC);
+    exit(1);
+}
+
+static double nowSeconds(void)
+{
+    return (double)SDL_GetPerformanceCounter() / SDL_GetPerformanceFrequency();
+}
+
+static int compareDoubles(const void* a, const void* b)
+{
+    double da = *(const double*)a;
+    double db = *(const double*)b;
+
+    return (da > db) - (da < db);
+}
+
+// Warm up with one untimed run then report the median and best time per
+// operation over the repeats
+static void timeCase(const char* group, const char* name, benchFunction func, int iterations)
+{
+    double times[BENCH_REPEATS];
+    double start;
+    int ii;
+
+    func(iterations);
+
+    for (ii = 0; ii < BENCH_REPEATS; ii++)
+    {
+        start = nowSeconds();
+        func(iterations);
+        times[ii] = ((nowSeconds() - start) * 1e9) / iterations;
+    }
+
+    qsort(times, BENCH_REPEATS, sizeof(double), compareDoubles);
+
+    printf("%-10s %-20s %8.2f ns  best %8.2f ns  %8.1f M/s\n",
+           group, name, times[BENCH_REPEATS / 2], times[0], 1000.0 / times[BENCH_REPEATS / 2]);
+}
+
+// Lay out one unit of a class of instructions at the address, returning its
+// length. Every unit leaves the stack as it found it.
+static int emitUnit(int opClass, uint8_t* rom, uint16_t address, uint16_t blockStart)
+{
+    static const uint8_t alu[] = { 0x80, 0x91, 0xA2, 0xB3, 0xA9, 0xBC, 0x3C, 0x0D, 0xC6, 0x01, 0x09 };
+    static const uint8_t loads[] = { 0x41, 0x7E, 0x77, 0x3E, 0x12, 0x01, 0x34, 0x12, 0xF0, 0x80, 0xE0, 0x81, 0xFA, 0x00, 0xD0 };
+    static const uint8_t cb[] = { 0xCB, 0x37, 0xCB, 0x11, 0xCB, 0x7F, 0xCB, 0xC6, 0xCB, 0x3F, 0xCB, 0x00 };
+    uint8_t* out = &rom[address];
+    uint16_t next;
+
+    switch (opClass)
+    {
+    case 0:
+        memcpy(out, alu, sizeof(alu));
+        return sizeof(alu);
+
+    case 1:
+        memcpy(out, loads, sizeof(loads));
+        return sizeof(loads);
+
+    case 2:
+        // JR, JR NZ, JR Z, JP and JP NZ, each to the next instruction
+        next = address + 13;
+        out[0] = 0x18; out[1] = 0x00;
+        out[2] = 0x20; out[3] = 0x00;
+        out[4] = 0x28; out[5] = 0x00;
+        out[6] = 0xC3; out[7] = (uint8_t)(address + 10); out[8] = (uint8_t)((address + 10) >> 8);
+        out[9] = 0x00;
+        out[10] = 0xC2; out[11] = (uint8_t)next; out[12] = (uint8_t)(next >> 8);
+        return 13;
+
+    case 3:
+        memcpy(out, cb, sizeof(cb));
+        return sizeof(cb);
+
+    default:
+        // PUSH/POP pairs and a CALL to the RET at the start of the block
+        out[0] = 0xC5; out[1] = 0xD1;
+        out[2] = 0xF5; out[3] = 0xF1;
+        out[4] = 0xCD; out[5] = (uint8_t)blockStart; out[6] = (uint8_t)(blockStart >> 8);
+        out[7] = 0xE8; out[8] = 0x00;
+        return 9;
+    }
+}
+
+// Write the benchmark cartridge, bank 0 holds a looping block of code for
+// each class of instruction and the other banks are filled with noise
+static void writeBenchRom(void)
+{
+    static uint8_t rom[BENCH_ROM_SIZE];
+    uint8_t checksum = 0;
+    unsigned int opClass;
+    FILE* file;
+    int ii;
+
+    srand(1);
+
+    for (ii = 0x4000; ii < BENCH_ROM_SIZE; ii++)
+    {
+        rom[ii] = (uint8_t)rand();
+    }
+
+    for (opClass = 0; opClass < NUM_OPCODE_CLASSES; opClass++)
+    {
+        uint16_t blockStart = CODE_BLOCK_START + (opClass * CODE_BLOCK_SIZE);
+        uint16_t address = blockStart + 1;
+
+        rom[blockStart] = 0xC9;
+
+        while ((address + 16) < (blockStart + CODE_BLOCK_SIZE - 3))
+        {
+            address += emitUnit(opClass, rom, address, blockStart);
+        }
+
+        rom[address] = 0xC3;
+        rom[address + 1] = (uint8_t)(blockStart + 1);
+        rom[address + 2] = (uint8_t)((blockStart + 1) >> 8);
+    }
+
+    memcpy(&rom[0x134], "COREBENCH", 9);
+    rom[0x147] = 0x02;      // MBC1+RAM
+    rom[0x148] = 0x01;      // 64KB
+    rom[0x149] = 0x02;      // 8KB
+
+    for (ii = 0x134; ii <= 0x14C; ii++)
+    {
+        checksum = checksum - rom[ii] - 1;
+    }
+
+    rom[0x14D] = checksum;
+
+    file = fopen(BENCH_ROM_FILE, "wb");
+
+    if ((NULL == file) || (fwrite(rom, 1, sizeof(rom), file) != sizeof(rom)))
+    {
+        printf("Failed to write '%s'\n", BENCH_ROM_FILE);
+        exit(1);
+    }
+
+    fclose(file);
+}
+
+// Power on with the benchmark cartridge, then fill video memory with tiles,
+// maps and sprites so the drawing code has real work to do
+static void setupMachine(void)
+{
+    int ii;
+
+    writeBenchRom();
+
+    initGbMemory();
+    loadRom(BENCH_ROM_FILE);
+    initCPU();
+    setInterruptMaster(0);
+    gbState.cycles = 0;
+    initTimers();
+    initGraphics();
+    resetSound();
+    setTimedDma(0);
+
+    REGS.w.SP = STACK_ADDRESS;
+
+    writeByteToMemory(0x0000, 0x0A);    // Enable cart RAM
+    writeByteToMemory(0xFF26, 0x80);    // Sound on
+    writeByteToMemory(0xFF40, 0x91);
+    writeByteToMemory(0xFF47, 0xE4);
+    writeByteToMemory(0xFF48, 0xE4);
+    writeByteToMemory(0xFF49, 0x1B);
+
+    for (ii = 0; ii < 0x2000; ii++)
+    {
+        VRAMbank[ii] = (uint8_t)rand();
+    }
+
+    // Ten sprites on each of the lines 16 to 31 and the rest spread out
+    for (ii = 0; ii < 40; ii++)
+    {
+        OAMbank[(ii * 4) + 0] = (ii < 10) ? 32 : (uint8_t)(48 + (ii * 3));
+        OAMbank[(ii * 4) + 1] = (uint8_t)(8 + (ii * 15));
+        OAMbank[(ii * 4) + 2] = (uint8_t)rand();
+        OAMbank[(ii * 4) + 3] = (uint8_t)(rand() & 0xF0);
+    }
+
+    for (ii = 0xC000; ii < 0xE000; ii++)
+    {
+        writeByteToMemory(ii, (uint8_t)ii);
+    }
+}
+
+static void benchRead(int iterations)
+{
+    unsigned int sum = 0;
+    int ii;
+
+    for (ii = 0; ii < iterations; ii++)
+    {
+        sum += readByteFromMemory(currentRegion->base + (ii & currentRegion->mask));
+    }
+
+    sink = sum;
+}
+
+static void benchWrite(int iterations)
+{
+    int ii;
+
+    for (ii = 0; ii < iterations; ii++)
+    {
+        writeByteToMemory(currentRegion->base + (ii & currentRegion->mask), (uint8_t)(ii | 1));
+    }
+}
+
+static int currentOpClass;
+
+static void benchExecute(int iterations)
+{
+    int ii;
+
+    REGS.w.PC = CODE_BLOCK_START + (currentOpClass * CODE_BLOCK_SIZE) + 1;
+    REGS.w.SP = STACK_ADDRESS;
+    REGS.w.HL = DATA_ADDRESS;
+    REGS.w.BC = 0x0013;
+
+    for (ii = 0; ii < iterations; ii++)
+    {
+        executeOpcode();
+    }
+}
+
+static void benchLine(int iterations)
+{
+    int ii;
+
+    writeByteToMemory(0xFF40, currentLine->lcdc);
+    writeByteToMemory(0xFF43, currentLine->scx);
+    writeByteToMemory(0xFF42, currentLine->scy);
+    writeByteToMemory(0xFF4B, currentLine->wx);
+    writeByteToMemory(0xFF4A, currentLine->wy);
+
+    for (ii = 0; ii < iterations; ii++)
+    {
+        drawScanlineLayers((uint8_t)(16 + (ii & 15)), currentLine->layers);
+    }
+}
+
+static void benchDma(int iterations)
+{
+    int ii;
+
+    for (ii = 0; ii < iterations; ii++)
+    {
+        writeByteToMemory(0xFF46, 0xC0 + (ii & 0x1F));
+    }
+}
+
+static void benchInterruptIdle(int iterations)
+{
+    int ii;
+
+    writeByteToMemory(0xFFFF, 0x00);
+    enableInterruptsDelayed();
+
+    for (ii = 0; ii < iterations; ii++)
+    {
+        doInterrupts();
+    }
+}
+
+// Raise V-blank and take it every time, undoing the push to the stack
+static void benchInterruptDispatch(int iterations)
+{
+    int ii;
+
+    writeByteToMemory(0xFFFF, INT_VBLANK);
+
+    for (ii = 0; ii < iterations; ii++)
+    {
+        requestInterrupt(INT_VBLANK);
+        setInterruptMaster(1);
+        doInterrupts();
+        REGS.w.SP = STACK_ADDRESS;
+    }
+
+    setInterruptMaster(0);
+}
+
+// Only run the cases in groups named on the command line
+static int wanted(int argc, char* argv[], const char* group)
+{
+    int ii;
+
+    if (argc < 2)
+    {
+        return 1;
+    }
+
+    for (ii = 1; ii < argc; ii++)
+    {
+        if (0 == strcmp(argv[ii], group))
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+#undef main
+
+int main(int argc, char *argv[])
+{
+    unsigned int ii;
+
+    setupMachine();
+
+    printf("\n%-10s %-20s %11s  %16s  %10s\n", "group", "case", "median", "best", "rate");
+
+    if (wanted(argc, argv, "read"))
+    {
+        for (ii = 0; ii < sizeof(readRegions) / sizeof(readRegions[0]); ii++)
+        {
+            currentRegion = &readRegions[ii];
+            timeCase("read", currentRegion->name, benchRead, 1 << 20);
+        }
+    }
+
+    if (wanted(argc, argv, "write"))
+    {
+        for (ii = 0; ii < sizeof(writeRegions) / sizeof(writeRegions[0]); ii++)
+        {
+            currentRegion = &writeRegions[ii];
+            timeCase("write", currentRegion->name, benchWrite, 1 << 20);
+        }
+
+        // Leave bank 1 mapped for the code below
+        writeByteToMemory(0x2000, 0x01);
+    }
+
+    if (wanted(argc, argv, "execute"))
+    {
+        for (ii = 0; ii < NUM_OPCODE_CLASSES; ii++)
+        {
+            currentOpClass = ii;
+            timeCase("execute", opcodeClasses[ii], benchExecute, 1 << 20);
+        }
+    }
+
+    if (wanted(argc, argv, "scanline"))
+    {
+        for (ii = 0; ii < sizeof(lineSettings) / sizeof(lineSettings[0]); ii++)
+        {
+            currentLine = &lineSettings[ii];
+            timeCase("scanline", currentLine->name, benchLine, 1 << 14);
+        }
+    }
+
+    if (wanted(argc, argv, "dma"))
+    {
+        timeCase("dma", "OAM DMA from WRAM", benchDma, 1 << 14);
+    }
+
+    if (wanted(argc, argv, "interrupt"))
+    {
+        timeCase("interrupt", "nothing pending", benchInterruptIdle, 1 << 20);
+        timeCase("interrupt", "V-blank dispatch", benchInterruptDispatch, 1 << 20);
+    }
+
+    freeGbMemory();
+    remove(BENCH_ROM_FILE);
+
+    return 0;
+}
@@ -0,0 +1,707 @@
+/******************************************************************************
+DoGoBoy - Nintendo GameBoy Emulator
+*******************************************************************************
+Copyright (c) 2009-2013, Douglas Gore (doug@ssonic.co.uk)
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the Douglas Gore nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL DOUGLAS GORE BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*******************************************************************************
+Purpose:
+
+Generates small cartridge images for benchmarking, each one stressing one
+part of the emulator so results can be compared between machines without
+shipping commercial ROMs. The images have a complete header, with the logo
+and both checksums, and can use ROM only, MBC1, MBC3 or MBC5 banking.
+
+Usage: mkrom <workload> <output.gb> [-m none|mbc1|mbc3|mbc5] [-b banks]
+       mkrom all <directory>
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+
+#define BANK_SIZE			0x4000
+#define MAX_BANKS			256
+
+// Where the interrupt handlers and subroutines go, clear of the header
+#define ROUTINE_AREA		0x1000
+#define CODE_START			0x0150
+
+// Scratch bytes in HRAM used by the handlers
+#define HRAM_FRAME_COUNT	0x81
+
+typedef enum
+{
+    CART_ROM_ONLY,
+    CART_MBC1,
+    CART_MBC3,
+    CART_MBC5
+} cartKind;
+
+typedef struct
+{
+    const char* name;
+    uint8_t type;
+    int maxBanks;
+} cartInfo;
+
+// ROM only must be 32KB, MBC1 stops at 32 banks as only the low bank
+// register is written, MBC5 at 256 as only its low byte is
+static const cartInfo carts[] =
+{
+    { "none",   0x00, 2 },
+    { "mbc1",   0x01, 32 },
+    { "mbc3",   0x11, 128 },
+    { "mbc5",   0x19, 256 }
+};
+
+static const uint8_t nintendoLogo[48] =
+{
+    0xCE, 0xED, 0x66, 0x66, 0xCC, 0x0D, 0x00, 0x0B, 0x03, 0x73, 0x00, 0x83, 0x00, 0x0C, 0x00, 0x0D,
+    0x00, 0x08, 0x11, 0x1F, 0x88, 0x89, 0x00, 0x0E, 0xDC, 0xCC, 0x6E, 0xE6, 0xDD, 0xDD, 0xD9, 0x99,
+    0xBB, 0xBB, 0x67, 0x63, 0x6E, 0x0E, 0xEC, 0xCC, 0xDD, 0xDC, 0x99, 0x9F, 0xBB, 0xB9, 0x33, 0x3E
+};
+
+// The image being built and where the next instruction goes
+static uint8_t rom[MAX_BANKS * BANK_SIZE];
+static uint32_t here;
+
+typedef void (*workloadFunction)(int banks);
+
+typedef struct
+{
+    const char* name;
+    const char* description;
+    workloadFunction build;
+    int defaultBanks;
+} workload;
+
+// Assemble a list of bytes at the current address
+static void emit(int count, ...)
+{
+    va_list args;
+    int ii;
+
+    va_start(args, count);
+
+    for (ii = 0; ii < count; ii++)
+    {
+        rom[here++] = (uint8_t)va_arg(args, int);
+    }
+
+    va_end(args);
+}
+
+static void emitWord(uint8_t opcode, uint16_t value)
+{
+    emit(3, opcode, value & 0xFF, value >> 8);
+}
+
+// Relative jump back to an earlier label
+static void emitJr(uint8_t opcode, uint32_t target)
+{
+    int offset = (int)target - (int)(here + 2);
+
+    if ((offset < -128) || (offset > 127))
+    {
+        printf("Relative jump out of range at 0x%04X\n", here);
+        exit(1);
+    }
+
+    emit(2, opcode, offset & 0xFF);
+}
+
+// Relative jump forward, returns where to patch once the target is known
+static uint32_t emitJrForward(uint8_t opcode)
+{
+    emit(2, opcode, 0);
+
+    return here - 1;
+}
+
+static void patchJr(uint32_t at)
+{
+    rom[at] = (uint8_t)(here - (at + 1));
+}
+
+static void putBytes(uint32_t address, const uint8_t* bytes, int count)
+{
+    memcpy(&rom[address], bytes, count);
+}
+
+// Fill memory with zeros, noise made from the address, or the low byte of
+// the address, which gives varied tile data and tile maps
+enum { FILL_ZERO, FILL_NOISE, FILL_INDEX };
+
+static void emitFill(uint16_t dest, uint16_t count, int pattern)
+{
+    uint32_t loop;
+
+    emitWord(0x21, dest);                       // LD HL,dest
+    emitWord(0x01, count);                      // LD BC,count
+
+    loop = here;
+
+    switch (pattern)
+    {
+    case FILL_ZERO:
+        emit(1, 0xAF);                          // XOR A
+        break;
+
+    case FILL_NOISE:
+        emit(3, 0x7D, 0x0F, 0xAC);              // LD A,L; RRCA; XOR H
+        break;
+
+    default:
+        emit(1, 0x7D);                          // LD A,L
+        break;
+    }
+
+    emit(4, 0x22, 0x0B, 0x78, 0xB1);            // LD (HL+),A; DEC BC; LD A,B; OR C
+    emitJr(0x20, loop);                         // JR NZ,loop
+}
+
+// Copy up to 256 bytes from ROM
+static void emitCopy(uint16_t src, uint16_t dest, int count)
+{
+    uint32_t loop;
+
+    emitWord(0x21, src);                        // LD HL,src
+    emitWord(0x11, dest);                       // LD DE,dest
+    emit(2, 0x06, count & 0xFF);                // LD B,count
+
+    loop = here;
+
+    emit(4, 0x2A, 0x12, 0x13, 0x05);            // LD A,(HL+); LD (DE),A; INC DE; DEC B
+    emitJr(0x20, loop);                         // JR NZ,loop
+}
+
+static void emitLdh(uint8_t port, uint8_t value)
+{
+    emit(4, 0x3E, value, 0xE0, port);           // LD A,value; LDH (port),A
+}
+
+// Interrupt vectors jump to handlers, or return straight away
+static void setVector(int source, uint16_t handler)
+{
+    uint32_t vector = 0x40 + (source * 8);
+
+    if (handler)
+    {
+        rom[vector] = 0xC3;
+        rom[vector + 1] = handler & 0xFF;
+        rom[vector + 2] = handler >> 8;
+    }
+    else
+    {
+        rom[vector] = 0xD9;                     // RETI
+    }
+}
+
+// Increment the frame counter in HRAM on V-blank
+static uint16_t emitFrameCounter(void)
+{
+    uint16_t handler = (uint16_t)here;
+
+    emit(7, 0xF5, 0xF0, HRAM_FRAME_COUNT, 0x3C, 0xE0, HRAM_FRAME_COUNT, 0xF1);
+    emit(1, 0xD9);                              // RETI
+
+    return handler;
+}
+
+// A sprite table with four bands of ten sprites sharing a Y position, so in
+// 8x16 mode 64 lines each have the full ten sprites
+static uint16_t putSpriteTable(uint16_t address)
+{
+    int ii;
+
+    for (ii = 0; ii < 40; ii++)
+    {
+        rom[address + (ii * 4) + 0] = (uint8_t)(16 + ((ii / 10) * 36));
+        rom[address + (ii * 4) + 1] = (uint8_t)(8 + ((ii % 10) * 16));
+        rom[address + (ii * 4) + 2] = (uint8_t)(ii * 2);
+        rom[address + (ii * 4) + 3] = (uint8_t)(((ii & 1) ? 0x10 : 0) | ((ii & 2) ? 0x20 : 0));
+    }
+
+    return address;
+}
+
+// Common start up: wait for V-blank to turn the LCD off, then fill in tile
+// data, both tile maps and the palettes, and clear OAM
+static void emitStartup(void)
+{
+    uint32_t wait;
+
+    here = CODE_START;
+
+    emit(1, 0xF3);                              // DI
+    emitWord(0x31, 0xFFFE);                     // LD SP,FFFE
+
+    wait = here;
+    emit(4, 0xF0, 0x44, 0xFE, 0x90);            // LDH A,(LY); CP 144
+    emitJr(0x38, wait);                         // JR C,wait
+    emit(3, 0xAF, 0xE0, 0x40);                  // XOR A; LDH (LCDC),A
+
+    emitFill(0x8000, 0x1800, FILL_NOISE);
+    emitFill(0x9800, 0x0800, FILL_INDEX);
+    emitFill(0xFE00, 0x00A0, FILL_ZERO);
+
+    emitLdh(0x47, 0xE4);                        // BGP
+    emitLdh(0x48, 0xE4);                        // OBP0
+    emitLdh(0x49, 0x1B);                        // OBP1
+    emitLdh(0x0F, 0x00);                        // IF
+}
+
+// Turn the LCD on, enable the interrupts and idle in HALT forever
+static void emitHaltLoop(uint8_t lcdc, uint8_t interrupts)
+{
+    uint32_t loop;
+
+    emitLdh(0xFF, interrupts);
+    emitLdh(0x40, lcdc);
+    emit(1, 0xFB);                              // EI
+
+    loop = here;
+    emit(2, 0x76, 0x00);                        // HALT; NOP
+    emitJr(0x18, loop);
+}
+
+// Straight line arithmetic and logic with interrupts off
+static void buildAlu(int banks)
+{
+    uint32_t loop;
+
+    emitStartup();
+    emitLdh(0xFF, 0x00);
+    emitLdh(0x40, 0x91);
+
+    emitWord(0x01, 0x1234);                     // LD BC,1234
+    emitWord(0x11, 0x5678);                     // LD DE,5678
+    emitWord(0x21, 0x9ABC);                     // LD HL,9ABC
+
+    loop = here;
+    emit(8, 0x80, 0x89, 0x92, 0x9B, 0xA4, 0xAD, 0xB0, 0xB9);   // ADD ADC SUB SBC AND XOR OR CP
+    emit(4, 0x04, 0x0D, 0x13, 0x19);                           // INC B; DEC C; INC DE; ADD HL,DE
+    emit(5, 0xCB, 0x37, 0x07, 0x27, 0x2F);                     // SWAP A; RLCA; DAA; CPL
+    emit(4, 0xC6, 0x5A, 0xEE, 0x33);                           // ADD A,5A; XOR 33
+    emit(6, 0xCB, 0x19, 0xCB, 0x23, 0x3D, 0x1C);               // RR C; SLA E; DEC A; INC E
+    emitJr(0x18, loop);
+}
+
+// Nested subroutine calls, each pass of the loop makes 20 calls
+static void buildCalls(int banks)
+{
+    uint16_t leaf, middle, outer;
+    uint32_t loop;
+
+    here = ROUTINE_AREA;
+
+    leaf = (uint16_t)here;
+    emit(2, 0x3C, 0xC9);                        // INC A; RET
+
+    middle = (uint16_t)here;
+    emit(1, 0xC5);                              // PUSH BC
+    emitWord(0xCD, leaf);
+    emitWord(0xCD, leaf);
+    emit(2, 0xC1, 0xC9);                        // POP BC; RET
+
+    outer = (uint16_t)here;
+    emitWord(0xCD, middle);
+    emitWord(0xCD, middle);
+    emitWord(0xCD, middle);
+    emit(1, 0xC9);
+
+    emitStartup();
+    emitLdh(0xFF, 0x00);
+    emitLdh(0x40, 0x91);
+
+    loop = here;
+    emitWord(0xCD, outer);
+    emitWord(0xCD, outer);
+    emitJr(0x18, loop);
+}
+
+// Switch to every bank in turn and call a routine in it, which reads from
+// the bank and writes to WRAM
+static void buildBanks(int banks)
+{
+    uint32_t loop, skip;
+    int bank;
+
+    for (bank = 1; bank < banks; bank++)
+    {
+        here = bank * BANK_SIZE;
+
+        emitWord(0xFA, 0x4100);                 // LD A,(4100)
+        emit(2, 0xC6, bank & 0xFF);             // ADD A,bank
+        emitWord(0xEA, 0xC000);                 // LD (C000),A
+        emit(1, 0xC9);
+
+        rom[(bank * BANK_SIZE) + 0x100] = (uint8_t)bank;
+    }
+
+    emitStartup();
+    emitLdh(0xFF, 0x00);
+    emitLdh(0x40, 0x91);
+
+    emit(2, 0x06, 0x01);                        // LD B,1
+
+    loop = here;
+    emit(1, 0x78);                              // LD A,B
+    emitWord(0xEA, 0x2000);                     // LD (2000),A
+    emitWord(0xCD, 0x4000);                     // CALL 4000
+    emit(4, 0x78, 0x3C, 0xE6, (banks - 1) & 0xFF); // LD A,B; INC A; AND mask
+    skip = emitJrForward(0x20);                 // JR NZ,skip
+    emit(1, 0x3C);                              // INC A, bank 0 isn't switchable
+    patchJr(skip);
+    emit(1, 0x47);                              // LD B,A
+    emitJr(0x18, loop);
+}
+
+// Sleep in HALT between V-blanks, there is almost nothing to run
+static void buildHalt(int banks)
+{
+    here = ROUTINE_AREA;
+    setVector(0, emitFrameCounter());
+
+    emitStartup();
+    emitHaltLoop(0x91, 0x01);
+}
+
+// 8x16 sprites with ten on each of 64 lines, moved down a line each frame
+static void buildSprites(int banks)
+{
+    uint16_t table, handler;
+    uint32_t loop;
+
+    table = putSpriteTable(0x2000);
+
+    here = ROUTINE_AREA;
+    handler = (uint16_t)here;
+    emit(3, 0xF5, 0xE5, 0xC5);                  // PUSH AF; PUSH HL; PUSH BC
+    emitWord(0x21, 0xFE00);                     // LD HL,FE00
+    emit(2, 0x06, 40);                          // LD B,40
+
+    loop = here;
+    emit(6, 0x34, 0x2C, 0x2C, 0x2C, 0x2C, 0x05);  // INC (HL); INC L x4; DEC B
+    emitJr(0x20, loop);
+    emit(4, 0xC1, 0xE1, 0xF1, 0xD9);            // POP BC; POP HL; POP AF; RETI
+
+    setVector(0, handler);
+
+    emitStartup();
+    emitCopy(table, 0xFE00, 160);
+    emitHaltLoop(0x87, 0x01);
+}
+
+// Change SCX in every H-blank, scrolling each line by its number plus the
+// frame count
+static void buildRaster(int banks)
+{
+    uint16_t handler;
+
+    here = ROUTINE_AREA;
+    setVector(0, emitFrameCounter());
+
+    handler = (uint16_t)here;
+    emit(2, 0xF5, 0xC5);                        // PUSH AF; PUSH BC
+    emit(3, 0xF0, HRAM_FRAME_COUNT, 0x47);      // LDH A,(frames); LD B,A
+    emit(5, 0xF0, 0x44, 0x80, 0xE0, 0x43);      // LDH A,(LY); ADD A,B; LDH (SCX),A
+    emit(3, 0xC1, 0xF1, 0xD9);                  // POP BC; POP AF; RETI
+
+    setVector(1, handler);
+
+    emitStartup();
+    emitLdh(0x41, 0x08);                        // STAT H-blank interrupt
+    emitHaltLoop(0x91, 0x03);
+}
+
+// OAM DMA from a shadow copy in WRAM every V-blank, through the usual
+// routine in HRAM, while the main loop moves the sprites in the shadow
+static void buildDma(int banks)
+{
+    static const uint8_t dmaRoutine[] =
+    {
+        0xE0, 0x46,                             // LDH (DMA),A
+        0x3E, 0x28,                             // LD A,40
+        0x3D,                                   // wait: DEC A
+        0x20, 0xFD,                             // JR NZ,wait
+        0xC9                                    // RET
+    };
+    uint16_t table, routine, handler;
+    uint32_t loop, move;
+
+    table = putSpriteTable(0x2000);
+    routine = 0x2100;
+    putBytes(routine, dmaRoutine, sizeof(dmaRoutine));
+
+    here = ROUTINE_AREA;
+    handler = (uint16_t)here;
+    emit(3, 0xF5, 0x3E, 0xC0);                  // PUSH AF; LD A,C0
+    emitWord(0xCD, 0xFF80);                     // CALL FF80
+    emit(2, 0xF1, 0xD9);                        // POP AF; RETI
+
+    setVector(0, handler);
+
+    emitStartup();
+    emitCopy(routine, 0xFF80, sizeof(dmaRoutine));
+    emitCopy(table, 0xC000, 160);
+    emitLdh(0xFF, 0x01);
+    emitLdh(0x40, 0x83);
+    emit(1, 0xFB);
+
+    loop = here;
+    emit(2, 0x76, 0x00);                        // HALT; NOP
+    emitWord(0x21, 0xC001);                     // LD HL,C001
+    emit(2, 0x06, 40);                          // LD B,40
+
+    move = here;
+    emit(6, 0x34, 0x2C, 0x2C, 0x2C, 0x2C, 0x05);  // INC (HL); INC L x4; DEC B
+    emitJr(0x20, move);
+    emitJr(0x18, loop);
+}
+
+static const workload workloads[] =
+{
+    { "alu",     "ALU dense straight line loop",            buildAlu,     2 },
+    { "calls",   "nested CALL/RET",                         buildCalls,   2 },
+    { "banks",   "ROM bank switch and call every bank",     buildBanks,   32 },
+    { "halt",    "HALT between V-blank interrupts",         buildHalt,    2 },
+    { "sprites", "ten 8x16 sprites on 64 lines",            buildSprites, 2 },
+    { "raster",  "SCX rewritten in every H-blank",          buildRaster,  2 },
+    { "dma",     "OAM DMA every frame from HRAM",           buildDma,     2 }
+};
+
+#define NUM_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+// Fill in the header and checksums, then write the image out
+static int writeRom(const char* filename, const workload* work, const cartInfo* cart, int banks)
+{
+    static const uint8_t entry[4] = { 0x00, 0xC3, CODE_START & 0xFF, CODE_START >> 8 };
+    uint32_t size = banks * BANK_SIZE;
+    uint16_t globalSum = 0;
+    uint8_t headerSum = 0;
+    char title[16];
+    uint32_t ii;
+    int romSizeCode = 0;
+    FILE* file;
+
+    putBytes(0x100, entry, sizeof(entry));
+    putBytes(0x104, nintendoLogo, sizeof(nintendoLogo));
+
+    // Title in capitals, padded with zeros, and 0x143 left as DMG only
+    memset(title, 0, sizeof(title));
+    snprintf(title, 16, "DGB %s", work->name);
+
+    for (ii = 0; ii < 15; ii++)
+    {
+        rom[0x134 + ii] = ((title[ii] >= 'a') && (title[ii] <= 'z')) ? (title[ii] - 'a' + 'A') : title[ii];
+    }
+
+    while ((2 << romSizeCode) < banks)
+    {
+        romSizeCode++;
+    }
+
+    rom[0x147] = cart->type;
+    rom[0x148] = (uint8_t)romSizeCode;
+    rom[0x149] = 0x00;                          // No RAM
+    rom[0x14A] = 0x01;                          // Non-Japanese
+    rom[0x14B] = 0x00;
+
+    for (ii = 0x134; ii <= 0x14C; ii++)
+    {
+        headerSum = headerSum - rom[ii] - 1;
+    }
+
+    rom[0x14D] = headerSum;
+
+    for (ii = 0; ii < size; ii++)
+    {
+        if ((ii != 0x14E) && (ii != 0x14F))
+        {
+            globalSum += rom[ii];
+        }
+    }
+
+    rom[0x14E] = globalSum >> 8;
+    rom[0x14F] = globalSum & 0xFF;
+
+    file = fopen(filename, "wb");
+
+    if ((NULL == file) || (fwrite(rom, 1, size, file) != size))
+    {
+        printf("Failed to write '%s'\n", filename);
+
+        if (file)
+        {
+            fclose(file);
+        }
+
+        return 0;
+    }
+
+    fclose(file);
+
+    printf("%-8s %-40s %s, %dKB -> %s\n", work->name, work->description, cart->name, size / 1024, filename);
+
+    return 1;
+}
+
+// Build one workload into a cleared image. Unused space is 0xFF, as on a
+// blank ROM, and unused vectors return straight away.
+static int makeRom(const workload* work, const cartInfo* cart, int banks, const char* filename)
+{
+    int ii;
+
+    if (banks < 0)
+    {
+        banks = work->defaultBanks;
+
+        if (banks > cart->maxBanks)
+        {
+            banks = cart->maxBanks;
+        }
+    }
+
+    if ((banks < 2) || (banks > cart->maxBanks) || (banks & (banks - 1)))
+    {
+        printf("%s carts take a power of two from 2 to %d banks\n", cart->name, cart->maxBanks);
+        return 0;
+    }
+
+    if ((work->build == buildBanks) && (banks < 4))
+    {
+        printf("The banks workload needs a cart with at least 4 banks\n");
+        return 0;
+    }
+
+    memset(rom, 0xFF, banks * BANK_SIZE);
+    memset(rom, 0x00, 0x150);
+
+    for (ii = 0; ii < 5; ii++)
+    {
+        setVector(ii, 0);
+    }
+
+    work->build(banks);
+
+    return writeRom(filename, work, cart, banks);
+}
+
+static void usage(void)
+{
+    unsigned int ii;
+
+    printf("Usage: mkrom <workload> <output.gb> [-m none|mbc1|mbc3|mbc5] [-b banks]\n");
+    printf("       mkrom all <directory>\n\nWorkloads:\n");
+
+    for (ii = 0; ii < NUM_WORKLOADS; ii++)
+    {
+        printf("  %-8s %s\n", workloads[ii].name, workloads[ii].description);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    const cartInfo* cart = &carts[CART_MBC1];
+    const workload* work = NULL;
+    char filename[1024];
+    int banks = -1;
+    unsigned int ii;
+    int arg_pos;
+
+    if (argc < 3)
+    {
+        usage();
+        return 1;
+    }
+
+    for (arg_pos = 3; arg_pos < argc; arg_pos++)
+    {
+        if ((strcmp(argv[arg_pos], "-m") == 0) && (arg_pos + 1 < argc))
+        {
+            arg_pos++;
+            cart = NULL;
+
+            for (ii = 0; ii < sizeof(carts) / sizeof(carts[0]); ii++)
+            {
+                if (strcmp(argv[arg_pos], carts[ii].name) == 0)
+                {
+                    cart = &carts[ii];
+                }
+            }
+
+            if (NULL == cart)
+            {
+                usage();
+                return 1;
+            }
+        }
+        else if ((strcmp(argv[arg_pos], "-b") == 0) && (arg_pos + 1 < argc))
+        {
+            banks = atoi(argv[++arg_pos]);
+        }
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+
+    // Every workload with its default cart, into a directory
+    if (strcmp(argv[1], "all") == 0)
+    {
+        for (ii = 0; ii < NUM_WORKLOADS; ii++)
+        {
+            snprintf(filename, sizeof(filename), "%s/%s.gb", argv[2], workloads[ii].name);
+
+            if (!makeRom(&workloads[ii], cart, banks, filename))
+            {
+                return 1;
+            }
+        }
+
+        return 0;
+    }
+
+    for (ii = 0; ii < NUM_WORKLOADS; ii++)
+    {
+        if (strcmp(argv[1], workloads[ii].name) == 0)
+        {
+            work = &workloads[ii];
+        }
+    }
+
+    if (NULL == work)
+    {
+        usage();
+        return 1;
+    }
+
+    return makeRom(work, cart, banks, argv[2]) ? 0 : 1;
+}
@@ -0,0 +1,331 @@
+/******************************************************************************
+DoGoBoy - Nintendo GameBoy Emulator
+*******************************************************************************
+Copyright (c) 2009-2013, Douglas Gore (doug@ssonic.co.uk)
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the Douglas Gore nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL DOUGLAS GORE BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*******************************************************************************
+Purpose:
+
+Benchmark and quality check for the sound mixer and resampler. Sine waves
+are pushed through both resampling qualities and the output is compared
+with the exact waveform at each output time, which gives the signal to
+noise ratio and how well tones above the output band are rejected. The
+vector sinc filter must also match the plain C one sample for sample. Then
+the mixer and resamplers are timed over a long run of input.
+
+With --check only the quality checks are run, and the exit code is non-zero
+if the sinc filter misses any of its limits.
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "SDL.h"
+
+#include "gameboy.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define INPUT_RATE			65536
+#define OUTPUT_RATE			48000
+
+// Kept below 65536 so the 16.16 position doesn't wrap
+#define TEST_SAMPLES		60000
+#define TEST_AMPLITUDE		10000.0
+
+#define BENCH_BLOCK			1024
+#define BENCH_SECONDS		60
+
+#define COMPARE_BLOCK		1000
+
+typedef struct
+{
+    double frequency;
+    double limit;			// Lowest passing dB, 0 if only reported
+    int rejected;
+} toneTest;
+
+static float inLeft[TEST_SAMPLES];
+static float inRight[TEST_SAMPLES];
+static int16_t outFrames[TEST_SAMPLES * 2];
+static int16_t scalarFrames[TEST_SAMPLES * 2];
+
+static double nowSeconds(void)
+{
+    return (double)SDL_GetPerformanceCounter() / SDL_GetPerformanceFrequency();
+}
+
+// Resample a sine of the given frequency and return the ratio of the
+// reference power to the error power in dB, or the output level relative to
+// the input for tones that should have been filtered out
+static double measureTone(double frequency, int rejected)
+{
+    uint32_t step = (uint32_t)(((uint64_t)INPUT_RATE << 16) / OUTPUT_RATE);
+    uint32_t position = (RESAMPLE_TAPS / 2) << 16;
+    double signal = 0;
+    double error = 0;
+    int frames;
+    int ii;
+
+    for (ii = 0; ii < TEST_SAMPLES; ii++)
+    {
+        inLeft[ii] = (float)(TEST_AMPLITUDE * sin((2.0 * M_PI * frequency * ii) / INPUT_RATE));
+        inRight[ii] = inLeft[ii];
+    }
+
+    frames = resampleSound(inLeft, inRight, TEST_SAMPLES, &position, step, outFrames);
+
+    // Skip the filter's start up
+    for (ii = 64; ii < frames; ii++)
+    {
+        double time = ((RESAMPLE_TAPS / 2) << 16) + ((double)ii * step);
+        double reference = TEST_AMPLITUDE * sin((2.0 * M_PI * frequency * time) / (INPUT_RATE * 65536.0));
+        double out = outFrames[ii * 2];
+
+        signal += reference * reference;
+        error += rejected ? (out * out) : ((out - reference) * (out - reference));
+    }
+
+    if (0 == error)
+    {
+        return 200.0;
+    }
+
+    return 10.0 * log10(signal / error);
+}
+
+// Print the SNR and rejection of each tone, returning how many missed their
+// limits
+static int reportQuality(const char* name, resampleQuality quality, const toneTest* tones, int count)
+{
+    int failed = 0;
+    int ii;
+
+    setResampleQuality(quality);
+
+    printf("%s\n", name);
+
+    for (ii = 0; ii < count; ii++)
+    {
+        double result = measureTone(tones[ii].frequency, tones[ii].rejected);
+        int pass = (result >= tones[ii].limit);
+
+        printf("  %-9s %6.0fHz: %6.1fdB", tones[ii].rejected ? "Rejection" : "SNR", tones[ii].frequency, result);
+
+        if (tones[ii].limit > 0)
+        {
+            printf("  (>= %.0fdB) %s", tones[ii].limit, pass ? "ok" : "FAIL");
+        }
+
+        printf("\n");
+
+        failed += !pass;
+    }
+
+    return failed;
+}
+
+// Resample the same noise and full scale tones with the vector and plain C
+// sinc filters, in blocks as the sound module does, and count the samples
+// that differ
+static int compareScalar(void)
+{
+    uint32_t step = (uint32_t)(((uint64_t)INPUT_RATE << 16) / OUTPUT_RATE);
+    uint32_t vectorPosition = (RESAMPLE_TAPS / 2) << 16;
+    uint32_t scalarPosition = vectorPosition;
+    int block = 0;
+    int mismatches = 0;
+    long compared = 0;
+    int ii;
+
+    for (ii = 0; ii < TEST_SAMPLES; ii++)
+    {
+        inLeft[ii] = (float)(rand() % 65536) - 32768.0f;
+        inRight[ii] = (float)(40000.0 * sin((2.0 * M_PI * 3000.0 * ii) / INPUT_RATE));
+    }
+
+    while (block + RESAMPLE_HISTORY + COMPARE_BLOCK <= TEST_SAMPLES)
+    {
+        int available = RESAMPLE_HISTORY + COMPARE_BLOCK;
+        int frames, scalarFramesOut;
+
+        setResampleQuality(RESAMPLE_SINC);
+        frames = resampleSound(&inLeft[block], &inRight[block], available, &vectorPosition, step, outFrames);
+
+        setResampleQuality(RESAMPLE_SINC_SCALAR);
+        scalarFramesOut = resampleSound(&inLeft[block], &inRight[block], available, &scalarPosition, step, scalarFrames);
+
+        if ((frames != scalarFramesOut) || (vectorPosition != scalarPosition))
+        {
+            printf("Vector and scalar sinc filters disagree on the frame count\n");
+            return 1;
+        }
+
+        for (ii = 0; ii < (frames * 2); ii++)
+        {
+            mismatches += (outFrames[ii] != scalarFrames[ii]);
+        }
+
+        compared += frames * 2;
+        block += COMPARE_BLOCK;
+        vectorPosition -= COMPARE_BLOCK << 16;
+        scalarPosition -= COMPARE_BLOCK << 16;
+    }
+
+    printf("Vector against scalar sinc: %d of %ld samples differ %s\n", mismatches, compared, mismatches ? "FAIL" : "ok");
+
+    return mismatches ? 1 : 0;
+}
+
+// The sinc filter has to stay flat through most of the band and keep tones
+// that would alias back into it well down, the linear one is only reported
+static int checkQuality(void)
+{
+    static const toneTest sincTones[] =
+    {
+        { 100, 80, 0 }, { 1000, 80, 0 }, { 5000, 80, 0 }, { 10000, 60, 0 }, { 15000, 60, 0 }, { 18000, 0, 0 },
+        { 26000, 80, 1 }, { 30000, 80, 1 }
+    };
+    static const toneTest linearTones[] =
+    {
+        { 100, 0, 0 }, { 1000, 0, 0 }, { 5000, 0, 0 }, { 10000, 0, 0 }, { 15000, 0, 0 }, { 18000, 0, 0 },
+        { 26000, 0, 1 }, { 30000, 0, 1 }
+    };
+    int failed = 0;
+
+    failed += reportQuality("Windowed sinc", RESAMPLE_SINC, sincTones, sizeof(sincTones) / sizeof(sincTones[0]));
+    failed += reportQuality("Linear", RESAMPLE_LINEAR, linearTones, sizeof(linearTones) / sizeof(linearTones[0]));
+
+    printf("\n");
+
+    failed += compareScalar();
+
+    return failed;
+}
+
+// Time BENCH_SECONDS of emulated sound through the resampler in the same
+// sized blocks the sound module uses
+static void benchResample(const char* name, resampleQuality quality)
+{
+    uint32_t step = (uint32_t)(((uint64_t)INPUT_RATE << 16) / OUTPUT_RATE);
+    uint32_t position = (RESAMPLE_TAPS / 2) << 16;
+    int blocks = (BENCH_SECONDS * INPUT_RATE) / BENCH_BLOCK;
+    long totalFrames = 0;
+    double start, elapsed;
+    int ii;
+
+    setResampleQuality(quality);
+
+    for (ii = 0; ii < (RESAMPLE_HISTORY + BENCH_BLOCK); ii++)
+    {
+        inLeft[ii] = (float)(rand() % 20000) - 10000.0f;
+        inRight[ii] = (float)(rand() % 20000) - 10000.0f;
+    }
+
+    // Warm up the caches and build the tables before timing
+    resampleSound(inLeft, inRight, RESAMPLE_HISTORY + BENCH_BLOCK, &position, step, outFrames);
+    position = (RESAMPLE_TAPS / 2) << 16;
+
+    start = nowSeconds();
+
+    for (ii = 0; ii < blocks; ii++)
+    {
+        totalFrames += resampleSound(inLeft, inRight, RESAMPLE_HISTORY + BENCH_BLOCK, &position, step, outFrames);
+        position -= BENCH_BLOCK << 16;
+    }
+
+    elapsed = nowSeconds() - start;
+
+    printf("%-20s %8.1f Mframes/s  %8.0fx real time\n", name, (totalFrames / elapsed) / 1e6, BENCH_SECONDS / elapsed);
+}
+
+static void benchMix(void)
+{
+    static float deltas[BENCH_BLOCK * 4];
+    float integrators[4] = { 0, 0, 0, 0 };
+    const float leftGains[4] = { 512, 512, 0, 512 };
+    const float rightGains[4] = { 512, 0, 512, 512 };
+    int blocks = (BENCH_SECONDS * INPUT_RATE) / BENCH_BLOCK;
+    double start, elapsed;
+    int ii;
+
+    for (ii = 0; ii < (BENCH_BLOCK * 4); ii++)
+    {
+        deltas[ii] = (float)((rand() % 31) - 15);
+    }
+
+    mixSoundChannels(deltas, BENCH_BLOCK, integrators, leftGains, rightGains, inLeft, inRight);
+
+    start = nowSeconds();
+
+    for (ii = 0; ii < blocks; ii++)
+    {
+        mixSoundChannels(deltas, BENCH_BLOCK, integrators, leftGains, rightGains, inLeft, inRight);
+    }
+
+    elapsed = nowSeconds() - start;
+
+    printf("%-20s %8.1f Msamples/s %8.0fx real time\n", "mix", ((double)blocks * BENCH_BLOCK / elapsed) / 1e6, BENCH_SECONDS / elapsed);
+}
+
+#undef main
+
+int main(int argc, char *argv[])
+{
+    int check = (argc > 1) && (strcmp(argv[1], "--check") == 0);
+    int failed;
+
+#if defined(__AVX2__)
+    printf("Resampler build: AVX2\n\n");
+#elif defined(__SSE2__)
+    printf("Resampler build: SSE2\n\n");
+#else
+    printf("Resampler build: scalar\n\n");
+#endif
+
+    failed = checkQuality();
+
+    if (failed)
+    {
+        printf("%d quality checks failed\n", failed);
+    }
+
+    if (!check)
+    {
+        printf("\n");
+
+        benchMix();
+        benchResample("resample sinc", RESAMPLE_SINC);
+        benchResample("resample scalar sinc", RESAMPLE_SINC_SCALAR);
+        benchResample("resample linear", RESAMPLE_LINEAR);
+    }
+
+    return failed ? 1 : 0;
+}
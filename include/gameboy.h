@@ -35,6 +35,7 @@ Header file for defining important values/structures and sharing functions.
 #ifndef GAMEBOY_H
 #define GAMEBOY_H
 
+#include <stdio.h>
 #include <SDL.h>
 
 //#define DEBUG_OPCODE_COVERAGE
@@ -43,6 +44,9 @@ Header file for defining important values/structures and sharing functions.
 #define ADDR_INT_ENABLE				0xFFFF
 #define ADDR_MINI_INTERNAL_RAM		0xFF80
 #define ADDR_RESERVED2				0xFF4C
+#define ADDR_SOUND_END				0xFF40
+#define ADDR_WAVE_RAM				0xFF30
+#define ADDR_SOUND_REGS				0xFF10
 #define ADDR_IO_PORTS				0xFF00
 #define ADDR_RESERVED1				0xFEA0
 #define ADDR_OAM_MEMORY				0xFE00
@@ -56,6 +60,19 @@ Header file for defining important values/structures and sharing functions.
 #define GB_DISPLAY_WIDTH			160
 #define GB_DISPLAY_HEIGHT			144
 
+// Layout of a pixel in the colour index frame buffer. The shade is the final
+// DMG grey level (palette already applied), the rest records where it came from
+#define PIXEL_SHADE_MASK			0x03
+#define PIXEL_BG_OPAQUE				(1 << 2)	// Background colour index was 1-3
+#define PIXEL_SOURCE_BG				(0 << 3)
+#define PIXEL_SOURCE_OBJ0			(1 << 3)
+#define PIXEL_SOURCE_OBJ1			(2 << 3)
+#define PIXEL_SOURCE_MASK			(3 << 3)
+
+// Layers for drawScanlineLayers()
+#define DRAW_LAYER_TILES			(1 << 0)
+#define DRAW_LAYER_SPRITES			(1 << 1)
+
 #define HBLANK_PERIOD 456
 
 #define LCD_MODE0_PERIOD	204		// 48.6uS x 4.2 ticks per microsecond
@@ -63,7 +80,10 @@ Header file for defining important values/structures and sharing functions.
 #define LCD_MODE2_PERIOD	 80		// 19uS x 4.2
 #define LCD_MODE3_PERIOD	172		// 41uS x 4.2
 
-#define CYCLES_PER_FRAME 69905
+#define CYCLES_PER_FRAME 70224		// 154 lines of 456 cycles, ~59.73Hz
+#define CPU_CLOCK_HZ 4194304
+
+#define CYCLE_NEVER		0xFFFFFFFFFFFFFFFFULL	// Event that is not scheduled
 
 #define DOGO_LITTLE_ENDIAN
 
@@ -114,51 +134,68 @@ union _REGS
 	} w;
 } REGS;
 
+// The I/O ports at 0xFF00-0xFF7F, laid out in address order so they can be
+// accessed either by name or as a flat register file
 typedef struct
 {
-	uint8_t JOYPAD;
-	uint8_t SIODATA;
-	uint8_t SIOCONT;
-	uint8_t DIVIDER;
-	uint8_t TIMECNT;
-	uint8_t TIMEMOD;
-	uint8_t TIMECONT;
-	uint8_t IFLAGS;
-	uint8_t SNDREG10;
-	uint8_t SNDREG11;
-	uint8_t SNDREG12;
-	uint8_t SNDREG13;
-	uint8_t SNDREG14;
-	uint8_t SNDREG21;
-	uint8_t SNDREG22;
-	uint8_t SNDREG23;
-	uint8_t SNDREG24;
-	uint8_t SNDREG30;
-	uint8_t SNDREG31;
-	uint8_t SNDREG32;
-	uint8_t SNDREG33;
-	uint8_t SNDREG34;
-	uint8_t SNDREG41;
-	uint8_t SNDREG42;
-	uint8_t SNDREG43;
-	uint8_t SNDREG44;
-	uint8_t SNDREG50;
-	uint8_t SNDREG51;
-	uint8_t SNDREG52;
-	uint8_t LCDCONT;
-	uint8_t LCDSTAT;
-	uint8_t SCROLLX;
-	uint8_t SCROLLY;
-	uint8_t CURLINE;
-	uint8_t CMPLINE;
-	uint8_t BGRDPAL;
-	uint8_t OBJ0PAL;
-	uint8_t OBJ1PAL;
-	uint8_t WNDPOSY;
-	uint8_t WNDPOSX;
-	uint8_t KEY1;					// Prepare speed switch (CGB)
-	uint8_t DMACONT;
-	uint8_t ISWITCH;
+	union
+	{
+		uint8_t regs[0x80];
+		struct
+		{
+			uint8_t JOYPAD;				// FF00
+			uint8_t SIODATA;
+			uint8_t SIOCONT;
+			uint8_t unusedFF03;
+			uint8_t DIVIDER;			// FF04
+			uint8_t TIMECNT;
+			uint8_t TIMEMOD;
+			uint8_t TIMECONT;
+			uint8_t unusedFF08[7];
+			uint8_t IFLAGS;				// FF0F
+			uint8_t SNDREG10;			// FF10
+			uint8_t SNDREG11;
+			uint8_t SNDREG12;
+			uint8_t SNDREG13;
+			uint8_t SNDREG14;
+			uint8_t unusedFF15;
+			uint8_t SNDREG21;			// FF16
+			uint8_t SNDREG22;
+			uint8_t SNDREG23;
+			uint8_t SNDREG24;
+			uint8_t SNDREG30;			// FF1A
+			uint8_t SNDREG31;
+			uint8_t SNDREG32;
+			uint8_t SNDREG33;
+			uint8_t SNDREG34;
+			uint8_t unusedFF1F;
+			uint8_t SNDREG41;			// FF20
+			uint8_t SNDREG42;
+			uint8_t SNDREG43;
+			uint8_t SNDREG44;
+			uint8_t SNDREG50;			// FF24
+			uint8_t SNDREG51;
+			uint8_t SNDREG52;
+			uint8_t unusedFF27[9];
+			uint8_t WAVERAM[0x10];		// FF30
+			uint8_t LCDCONT;			// FF40
+			uint8_t LCDSTAT;
+			uint8_t SCROLLY;
+			uint8_t SCROLLX;
+			uint8_t CURLINE;
+			uint8_t CMPLINE;
+			uint8_t DMACONT;			// FF46
+			uint8_t BGRDPAL;
+			uint8_t OBJ0PAL;
+			uint8_t OBJ1PAL;
+			uint8_t WNDPOSY;			// FF4A
+			uint8_t WNDPOSX;
+			uint8_t unusedFF4C;
+			uint8_t KEY1;				// Prepare speed switch (CGB)
+			uint8_t unusedFF4E[0x32];
+		};
+	};
+	uint8_t ISWITCH;					// FFFF
 } gbIOstruct;
 
 typedef struct
@@ -173,7 +210,8 @@ typedef enum
     MBC1,
     MBC2,
     MBC3,
-    MBC4
+    MBC4,
+    MBC5
 } mbcType;
 
 enum
@@ -188,21 +226,34 @@ enum
 typedef struct
 {
 	uint8_t IME;
+	uint8_t imeDelay;				// Instructions left until EI takes effect
     uint8_t cpuHalted;
+	uint8_t interruptCheck;			// Set when doInterrupts() has work to do
+	uint64_t cycles;				// Total cycles emulated
 	int lcdMode;
-	signed int lcdModePeriod;
-	signed int timerPeriod;
-	int divideRegister;
+	uint8_t lcdStatLine;			// Level of the STAT interrupt line
+	uint64_t lcdEventCycle;			// Cycle of the next LCD mode edge
+	uint64_t divBase;				// Cycle on which DIV was last reset
+	uint64_t timaBase;				// Cycle TIMECNT was last brought up to date
+	uint64_t timerEventCycle;		// Cycle of the next TIMA overflow
+	uint8_t dmaActive;				// Timed OAM DMA in progress
+	uint64_t dmaEventCycle;			// Cycle the timed OAM DMA finishes
     uint8_t bgPal[4];
     uint8_t obj0Pal[4];
     uint8_t obj1Pal[4];
     mbcType mbc;
-    uint8_t romBanks;
-    uint8_t currentRomBank;
+    uint16_t romBanks;
+    uint16_t currentRomBank;		// Bank mapped at 4000-7FFF
+    uint16_t currentRomBank0;		// Bank mapped at 0000-3FFF (MBC1 mode 1)
     unsigned int ramSize;
-    uint8_t ramMode;
+    uint8_t ramBanks;
     uint8_t currentRamBank;
+    uint8_t ramEnabled;
+    uint16_t mbcRomBank;			// ROM bank register as written
+    uint8_t mbcRamBank;				// RAM bank (or MBC1 upper bits) register
+    uint8_t bankingMode;			// MBC1 mode select
     uint8_t batteryBackup;
+    uint8_t rtcPresent;
 	uint8_t keysState;
 } gbStateStruct;
 
@@ -219,21 +270,187 @@ void initCPU(void);
 unsigned int executeOpcode(void);
 void pushWordToStack(uint16_t data);
 
+// Memory banks the graphics module renders from directly
+extern uint8_t VRAMbank[0x2000];
+extern uint8_t OAMbank[0xA0];
+
 // Functions exported from memory module
 uint8_t readByteFromMemory(uint16_t address);
 uint16_t readWordFromMemory(uint16_t address);
 void writeByteToMemory(unsigned int address, uint8_t value);
 void initGbMemory(void);
+void updateDma(void);
+void setTimedDma(int timed);
+void setRtcHostTime(int hostTime);
+void setBatterySaves(int saves);
+void printBankStats(void);
 void freeGbMemory(void);
 void loadRom(char* filename);
 
 // Functions exported from graphics module
-void updateGraphics(SDL_Surface* surface, Uint32 cycles);
-void drawTilemap(SDL_Surface* surface);
+void initGraphics(void);
+void updateGraphics(void);
+void writeLcdControl(uint8_t value);
+void writeLcdStatus(uint8_t value);
+void writeLcdCompare(uint8_t value);
+void writeLcdLine(uint8_t value);
+uint8_t readLcdStatus(void);
+void drawTilemap(uint8_t* buffer);
+const uint8_t* getFrameBuffer(void);
+void syncVideoMemory(uint16_t address);
+int getChangedLineCount(void);
+int collectDirtyLines(int* firstLine, int* lastLine);
+void setRenderThreaded(int threaded);
+void setFrameSkip(int skip);
 void setDrawFrameFunction(drawCallback func);
+void drawScanlineLayers(uint8_t scanline, int layers);
+
+// Functions exported from sound module
+int initSound(int output, const char* captureFile);
+void resetSound(void);
+void updateSound(void);
+double getSoundAhead(void);
+uint8_t readSoundRegister(uint16_t address);
+void writeSoundRegister(uint16_t address, uint8_t value);
+void closeSound(void);
+
+// Functions exported from the mixer
+#define RESAMPLE_TAPS		32
+#define RESAMPLE_HISTORY	RESAMPLE_TAPS	// Input kept between calls
+
+typedef enum
+{
+    RESAMPLE_SINC,
+    RESAMPLE_LINEAR,
+    RESAMPLE_SINC_SCALAR		// Plain C sinc filter for checking the vector ones
+} resampleQuality;
+
+void setResampleQuality(resampleQuality newQuality);
+void mixSoundChannels(const float* deltas, int count, float* integrators, const float* leftGains, const float* rightGains, float* left, float* right);
+int resampleSound(const float* left, const float* right, int available, uint32_t* position, uint32_t step, int16_t* out);
+
+// Functions exported from the audio capture module
+int openCapture(const char* filename, int rate);
+void captureFrames(const int16_t* frames, int count);
+void closeCapture(void);
+
+// Functions exported from the stats module. The counters are only kept when
+// built with GAMEBOY_STATS, otherwise the macros below compile to nothing.
+typedef enum
+{
+    STATS_TIME_PPU,					// updateGraphics, less drawFrame
+    STATS_TIME_DRAW,				// drawFrame
+    STATS_TIME_TIMERS,
+    STATS_TIME_INTERRUPTS,
+    STATS_TIME_DMA,
+    STATS_TIME_SOUND,
+    STATS_TIME_FRAME,				// All of the frame, the CPU has the rest
+    STATS_TIME_COUNT
+} statsTimer;
+
+typedef enum
+{
+    STATS_REGION_ROM0,
+    STATS_REGION_ROMX,
+    STATS_REGION_VRAM,
+    STATS_REGION_CART_RAM,
+    STATS_REGION_WRAM,
+    STATS_REGION_ECHO,
+    STATS_REGION_OAM,
+    STATS_REGION_IO,
+    STATS_REGION_HRAM,
+    STATS_REGION_COUNT
+} statsRegion;
+
+typedef struct
+{
+    uint64_t hostTicks[STATS_TIME_COUNT];	// SDL performance counter ticks
+    uint64_t instructions;
+    uint64_t haltedCycles;
+    uint64_t idleSkippedCycles;			// Halted cycles jumped in one go
+    uint64_t reads[STATS_REGION_COUNT];
+    uint64_t writes[STATS_REGION_COUNT];
+    uint64_t bankSwitches;
+    uint64_t framesEmulated;
+    uint64_t framesRendered;
+    uint64_t framesSkipped;
+} emulatorStats;
+
+int statsAvailable(void);
+void getEmulatorStats(emulatorStats* stats);
+void resetEmulatorStats(void);
+void setStatsInterval(int frames);
+void printEmulatorStats(FILE* out, const emulatorStats* stats);
+void statsMemoryAccess(uint16_t address, int write);
+void statsEndFrame(uint64_t frameTicks);
+
+#ifdef GAMEBOY_STATS
+extern emulatorStats gbStats;
+
+#define STATS_ADD(field, amount)		(gbStats.field += (amount))
+#define STATS_ADD_TIME(timer, ticks)	(gbStats.hostTicks[timer] += (ticks))
+#define STATS_ACCESS(address, write)	statsMemoryAccess((address), (write))
+#else
+#define STATS_ADD(field, amount)
+#define STATS_ADD_TIME(timer, ticks)
+#define STATS_ACCESS(address, write)
+#endif
+
+// Functions exported from the profiler
+typedef enum
+{
+    PROFILE_OFF,
+    PROFILE_SAMPLE,
+    PROFILE_EXACT
+} profileMode;
+
+void initProfiler(profileMode newMode, const char* prefix);
+void profileInstruction(uint16_t pc, int cycles);
+void profileHalted(int cycles);
+void profileInterrupt(void);
+void closeProfiler(void);
+
+// Functions exported from the ROM cache
+typedef enum
+{
+    ROM_ACCESS_RANDOM,
+    ROM_ACCESS_NEEDED
+} romAccess;
+
+const uint8_t* acquireRom(const char* filename, size_t* length);
+void releaseRom(const uint8_t* data);
+void adviseRomAccess(const uint8_t* data, size_t length, romAccess access);
+long residentRomBytes(const uint8_t* data, size_t offset, size_t length);
+
+// Functions exported from the battery save module
+uint8_t* openBatteryFile(const char* filename, size_t size, size_t* existing);
+void markBatteryDirty(void);
+void closeBatteryFile(void);
+
+// Functions exported from the pixel conversion module
+void convertFrameToARGB8888(const uint8_t* src, void* dst, int pitch, int firstLine, int numLines);
+void convertFrameToRGB565(const uint8_t* src, void* dst, int pitch, int firstLine, int numLines);
+void convertFrameToGrey8(const uint8_t* src, void* dst, int pitch, int firstLine, int numLines);
 
+// Functions exported from interrupts module
+void doInterrupts(void);
+void requestInterrupt(uint8_t source);
+void writeInterruptFlags(uint8_t value);
+void writeInterruptEnable(uint8_t value);
+void setInterruptMaster(uint8_t enable);
+void enableInterruptsDelayed(void);
+void haltCpu(uint8_t mode);
+void initTimers(void);
+void updateTimers(void);
+uint8_t readDivider(void);
+uint8_t readTimerCounter(void);
+void writeDivider(uint8_t value);
+void writeTimerCounter(uint8_t value);
+void writeTimerControl(uint8_t value);
 uint8_t getJoypadState(void);
+void gbKeyPress(int down, int key);
 
+// Functions exported from main module
 void writeLog(char* log_message, ...);
 void exit_with_debug(void);
 
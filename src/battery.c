@@ -0,0 +1,253 @@
+/******************************************************************************
+DoGoBoy - Nintendo GameBoy Emulator
+*******************************************************************************
+Copyright (c) 2009-2013, Douglas Gore (doug@ssonic.co.uk)
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the Douglas Gore nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL DOUGLAS GORE BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*******************************************************************************
+Purpose:
+
+Battery backed cartridge RAM. The .sav file is memory mapped so the game's
+writes land straight in the page cache, a background thread syncs it to disk
+once the game has stopped writing for a while and again at exit.
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__WIN32__) || defined(_MSC_VER)
+#define BATTERY_NO_MMAP
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "SDL.h"
+
+#include "gameboy.h"
+
+// How long the save has to be left alone before it's synced to disk
+#define BATTERY_IDLE_MS		1000
+
+static uint8_t* batteryData = NULL;
+static size_t batterySize = 0;
+
+// Set by the emulation thread on every write, the flush thread clears it
+static SDL_atomic_t batteryDirty;
+
+// Writes seen by the flush thread that haven't been synced yet
+static int flushPending = 0;
+
+static SDL_Thread* flushThread = NULL;
+static SDL_sem* flushWake = NULL;
+static SDL_atomic_t flushQuit;
+
+#ifdef BATTERY_NO_MMAP
+
+static char batteryFile[FILENAME_MAX];
+
+// No mmap here, so the save is read into the heap and written back whole
+static uint8_t* mapBatteryFile(const char* filename, size_t size, size_t* existing)
+{
+    uint8_t* data = calloc(1, size);
+    FILE* fp;
+
+    *existing = 0;
+
+    if (NULL == data)
+    {
+        return NULL;
+    }
+
+    snprintf(batteryFile, sizeof(batteryFile), "%s", filename);
+
+    fp = fopen(filename, "rb");
+
+    if (fp)
+    {
+        *existing = fread(data, 1, size, fp);
+        fclose(fp);
+    }
+
+    return data;
+}
+
+static void syncBatteryFile(void)
+{
+    FILE* fp = fopen(batteryFile, "wb");
+
+    if (NULL == fp)
+    {
+        printf("Failed to write save file '%s'\n", batteryFile);
+        return;
+    }
+
+    fwrite(batteryData, 1, batterySize, fp);
+    fclose(fp);
+}
+
+static void unmapBatteryFile(void)
+{
+    free(batteryData);
+}
+
+#else
+
+static uint8_t* mapBatteryFile(const char* filename, size_t size, size_t* existing)
+{
+    struct stat info;
+    uint8_t* data;
+    int fd;
+
+    *existing = 0;
+
+    fd = open(filename, O_RDWR | O_CREAT, 0644);
+
+    if (fd < 0)
+    {
+        return NULL;
+    }
+
+    if (fstat(fd, &info) == 0)
+    {
+        *existing = ((size_t)info.st_size < size) ? (size_t)info.st_size : size;
+    }
+
+    // Grow a new or short file to the full size, the new part reads as zero
+    if ((*existing < size) && (ftruncate(fd, size) != 0))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    return (MAP_FAILED == data) ? NULL : data;
+}
+
+static void syncBatteryFile(void)
+{
+    msync(batteryData, batterySize, MS_SYNC);
+}
+
+static void unmapBatteryFile(void)
+{
+    munmap(batteryData, batterySize);
+}
+
+#endif
+
+// Sync the save once a whole idle period has passed without any writes.
+// A run of writes keeps pushing the sync back, so a game saving a block of
+// data doesn't cause one sync per byte.
+static int batteryFlushWorker(void* data)
+{
+    while (!SDL_AtomicGet(&flushQuit))
+    {
+        SDL_SemWaitTimeout(flushWake, BATTERY_IDLE_MS);
+
+        if (SDL_AtomicSet(&batteryDirty, 0))
+        {
+            flushPending = 1;
+        }
+        else if (flushPending)
+        {
+            syncBatteryFile();
+            flushPending = 0;
+        }
+    }
+
+    return 0;
+}
+
+// Map the save file, creating it if need be. Returns the memory backing the
+// cartridge RAM and how many bytes of it came from an existing file.
+uint8_t* openBatteryFile(const char* filename, size_t size, size_t* existing)
+{
+    batteryData = mapBatteryFile(filename, size, existing);
+
+    if (NULL == batteryData)
+    {
+        printf("Failed to open save file '%s'\n", filename);
+        return NULL;
+    }
+
+    batterySize = size;
+    flushPending = 0;
+
+    SDL_AtomicSet(&batteryDirty, 0);
+    SDL_AtomicSet(&flushQuit, 0);
+
+    flushWake = SDL_CreateSemaphore(0);
+    flushThread = SDL_CreateThread(batteryFlushWorker, "DoGoBoy save", NULL);
+
+    if (NULL == flushThread)
+    {
+        printf("Failed to start save thread, the save is only written at exit\n");
+    }
+
+    return batteryData;
+}
+
+// Called by the memory module on every write to battery backed RAM
+void markBatteryDirty(void)
+{
+    SDL_AtomicSet(&batteryDirty, 1);
+}
+
+// Stop the flush thread, then write out anything it hasn't. A save that
+// wasn't touched isn't written at all.
+void closeBatteryFile(void)
+{
+    if (NULL == batteryData)
+    {
+        return;
+    }
+
+    if (flushThread)
+    {
+        SDL_AtomicSet(&flushQuit, 1);
+        SDL_SemPost(flushWake);
+        SDL_WaitThread(flushThread, NULL);
+        flushThread = NULL;
+    }
+
+    SDL_DestroySemaphore(flushWake);
+    flushWake = NULL;
+
+    if (flushPending || SDL_AtomicGet(&batteryDirty))
+    {
+        syncBatteryFile();
+    }
+
+    unmapBatteryFile();
+
+    batteryData = NULL;
+    batterySize = 0;
+}
@@ -0,0 +1,259 @@
+/******************************************************************************
+DoGoBoy - Nintendo GameBoy Emulator
+*******************************************************************************
+Copyright (c) 2009-2013, Douglas Gore (doug@ssonic.co.uk)
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the Douglas Gore nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL DOUGLAS GORE BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*******************************************************************************
+Purpose:
+
+Streaming capture of the sound output to a WAV or raw PCM file. The sound
+module fills one buffer while a background thread writes out the other, so
+the emulation only ever hands over full buffers and never waits on the disk
+unless it gets a whole buffer ahead. The writer keeps a running hash of the
+samples for comparing runs against a known good one.
+******************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "SDL.h"
+
+#include "gameboy.h"
+
+// About 1.4 seconds of 48kHz stereo per buffer
+#define CAPTURE_BUFFER_FRAMES	65536
+
+#define WAV_HEADER_SIZE			44
+
+#define FNV_OFFSET_BASIS		0xCBF29CE484222325ULL
+#define FNV_PRIME				0x100000001B3ULL
+
+static FILE* captureFile = NULL;
+static int captureWav = 0;
+static int captureRate = 0;
+
+static int16_t captureBuffers[2][CAPTURE_BUFFER_FRAMES * 2];
+static int handedFrames[2];
+static int handedLast[2];			// Set on the final buffer of the capture
+static int fillBuffer = 0;			// Buffer the emulation is filling
+static int fillFrames = 0;
+
+// Full buffers waiting for the writer, and buffers free for the emulation
+static SDL_sem* buffersFull = NULL;
+static SDL_sem* buffersFree = NULL;
+static SDL_Thread* writerThread = NULL;
+
+// Only touched by the writer until it has been stopped
+static uint64_t captureHash;
+static uint64_t capturedFrames;
+
+static void putLittle16(uint8_t* out, uint16_t value)
+{
+    out[0] = value & 0xFF;
+    out[1] = value >> 8;
+}
+
+static void putLittle32(uint8_t* out, uint32_t value)
+{
+    putLittle16(out, value & 0xFFFF);
+    putLittle16(out + 2, value >> 16);
+}
+
+// 16-bit stereo PCM, the sizes are filled in once the capture is closed
+static void writeWavHeader(uint32_t dataBytes)
+{
+    uint8_t header[WAV_HEADER_SIZE];
+
+    memcpy(&header[0], "RIFF", 4);
+    putLittle32(&header[4], dataBytes + WAV_HEADER_SIZE - 8);
+    memcpy(&header[8], "WAVE", 4);
+    memcpy(&header[12], "fmt ", 4);
+    putLittle32(&header[16], 16);
+    putLittle16(&header[20], 1);						// PCM
+    putLittle16(&header[22], 2);						// Channels
+    putLittle32(&header[24], captureRate);
+    putLittle32(&header[28], captureRate * 4);		// Bytes per second
+    putLittle16(&header[32], 4);						// Bytes per frame
+    putLittle16(&header[34], 16);						// Bits per sample
+    memcpy(&header[36], "data", 4);
+    putLittle32(&header[40], dataBytes);
+
+    fwrite(header, 1, sizeof(header), captureFile);
+}
+
+static int captureWriter(void* data)
+{
+    int writeBuffer = 0;
+
+    int last = 0;
+
+    while (!last)
+    {
+        const uint8_t* bytes;
+        size_t length;
+        size_t ii;
+
+        SDL_SemWait(buffersFull);
+
+        // Read before the buffer is given back and can be reused
+        last = handedLast[writeBuffer];
+        bytes = (const uint8_t*)captureBuffers[writeBuffer];
+        length = handedFrames[writeBuffer] * 2 * sizeof(int16_t);
+
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+        // Samples are stored little endian, which also keeps the hash the
+        // same whatever the host
+        for (ii = 0; ii < (size_t)handedFrames[writeBuffer] * 2; ii++)
+        {
+            captureBuffers[writeBuffer][ii] = (int16_t)SDL_Swap16((uint16_t)captureBuffers[writeBuffer][ii]);
+        }
+#endif
+
+        for (ii = 0; ii < length; ii++)
+        {
+            captureHash = (captureHash ^ bytes[ii]) * FNV_PRIME;
+        }
+
+        if (length && (fwrite(bytes, 1, length, captureFile) != length))
+        {
+            printf("Failed writing the audio capture\n");
+        }
+
+        capturedFrames += handedFrames[writeBuffer];
+
+        SDL_SemPost(buffersFree);
+        writeBuffer ^= 1;
+    }
+
+    return 0;
+}
+
+// Hand the buffer being filled to the writer and move on to the other one,
+// which only means waiting if the writer is still busy with it
+static void handOverBuffer(int last)
+{
+    handedFrames[fillBuffer] = fillFrames;
+    handedLast[fillBuffer] = last;
+
+    SDL_SemPost(buffersFull);
+    SDL_SemWait(buffersFree);
+
+    fillBuffer ^= 1;
+    fillFrames = 0;
+}
+
+// Start capturing, a .wav name gets a WAV header and anything else is raw
+// little endian 16-bit stereo
+int openCapture(const char* filename, int rate)
+{
+    const char* extension = strrchr(filename, '.');
+
+    captureFile = fopen(filename, "wb");
+
+    if (NULL == captureFile)
+    {
+        printf("Failed to open audio capture file '%s'\n", filename);
+        return 0;
+    }
+
+    captureWav = (NULL != extension) && (0 == SDL_strcasecmp(extension, ".wav"));
+    captureRate = rate;
+    captureHash = FNV_OFFSET_BASIS;
+    capturedFrames = 0;
+    fillBuffer = 0;
+    fillFrames = 0;
+
+    if (captureWav)
+    {
+        writeWavHeader(0);
+    }
+
+    // One buffer is being filled, the other starts off free
+    buffersFull = SDL_CreateSemaphore(0);
+    buffersFree = SDL_CreateSemaphore(1);
+
+    writerThread = SDL_CreateThread(captureWriter, "DoGoBoy capture", NULL);
+
+    if (NULL == writerThread)
+    {
+        printf("Failed to start the audio capture thread\n");
+        fclose(captureFile);
+        captureFile = NULL;
+        return 0;
+    }
+
+    return 1;
+}
+
+// Called by the sound module with every block of output frames
+void captureFrames(const int16_t* frames, int count)
+{
+    while (count > 0)
+    {
+        int space = CAPTURE_BUFFER_FRAMES - fillFrames;
+        int copy = (count < space) ? count : space;
+
+        memcpy(&captureBuffers[fillBuffer][fillFrames * 2], frames, copy * 2 * sizeof(int16_t));
+
+        fillFrames += copy;
+        frames += copy * 2;
+        count -= copy;
+
+        if (CAPTURE_BUFFER_FRAMES == fillFrames)
+        {
+            handOverBuffer(0);
+        }
+    }
+}
+
+// Write out what's left, finish the header and report the hash
+void closeCapture(void)
+{
+    if (NULL == captureFile)
+    {
+        return;
+    }
+
+    handOverBuffer(1);
+    SDL_WaitThread(writerThread, NULL);
+    writerThread = NULL;
+
+    if (captureWav)
+    {
+        fseek(captureFile, 0, SEEK_SET);
+        writeWavHeader((uint32_t)(capturedFrames * 4));
+    }
+
+    fclose(captureFile);
+    captureFile = NULL;
+
+    SDL_DestroySemaphore(buffersFull);
+    SDL_DestroySemaphore(buffersFree);
+    buffersFull = NULL;
+    buffersFree = NULL;
+
+    printf("Audio capture: %llu frames, hash %016llx\n", (unsigned long long)capturedFrames, (unsigned long long)captureHash);
+}
@@ -0,0 +1,236 @@
+/******************************************************************************
+DoGoBoy - Nintendo GameBoy Emulator
+*******************************************************************************
+Copyright (c) 2009-2013, Douglas Gore (doug@ssonic.co.uk)
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the Douglas Gore nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL DOUGLAS GORE BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*******************************************************************************
+Purpose:
+
+Conversion of the colour index frame buffer produced by the graphics module
+into host pixel formats. This only runs when a frame is actually consumed so
+headless or skipped frames never pay for it.
+******************************************************************************/
+
+#include "SDL.h"
+
+#include "gameboy.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// The four DMG shades, lightest first
+static const uint32_t gb_colour_map[4] =
+{
+    0xFFFFFFFF,
+    0xFFCCCCCC,
+    0xFF777777,
+    0xFF000000
+};
+
+static const uint16_t gb_colour_map_565[4] =
+{
+    0xFFFF,
+    0xCE79,
+    0x7BCF,
+    0x0000
+};
+
+static const uint8_t gb_colour_map_grey[4] =
+{
+    0xFF,
+    0xCC,
+    0x77,
+    0x00
+};
+
+#ifdef __SSE2__
+// Pick one of four constant vectors per lane depending on the shade in that lane
+static __inline __m128i selectShade(__m128i shade, const __m128i* match, const __m128i* colour)
+{
+    __m128i result;
+
+    result = _mm_and_si128(_mm_cmpeq_epi32(shade, match[0]), colour[0]);
+    result = _mm_or_si128(result, _mm_and_si128(_mm_cmpeq_epi32(shade, match[1]), colour[1]));
+    result = _mm_or_si128(result, _mm_and_si128(_mm_cmpeq_epi32(shade, match[2]), colour[2]));
+    result = _mm_or_si128(result, _mm_and_si128(_mm_cmpeq_epi32(shade, match[3]), colour[3]));
+
+    return result;
+}
+#endif
+
+// All of the conversions take dst pointing at the first line to be converted,
+// so a locked sub-rectangle of a texture can be written to directly
+
+// Convert lines of the index buffer to 32-bit ARGB pixels
+void convertFrameToARGB8888(const uint8_t* src, void* dst, int pitch, int firstLine, int numLines)
+{
+    int yy, xx;
+
+    for (yy = firstLine; yy < (firstLine + numLines); yy++)
+    {
+        const uint8_t* in = &src[yy * GB_DISPLAY_WIDTH];
+        uint32_t* out = (uint32_t*)((uint8_t*)dst + ((yy - firstLine) * pitch));
+
+        xx = 0;
+
+#ifdef __SSE2__
+        {
+            const __m128i shadeMask = _mm_set1_epi8(PIXEL_SHADE_MASK);
+            const __m128i zero = _mm_setzero_si128();
+            __m128i match[4];
+            __m128i colour[4];
+            int ii;
+
+            for (ii = 0; ii < 4; ii++)
+            {
+                match[ii] = _mm_set1_epi32(ii);
+                colour[ii] = _mm_set1_epi32((int)gb_colour_map[ii]);
+            }
+
+            // 16 pixels per iteration, 160 is a multiple of 16 so there is no tail
+            for (; xx < GB_DISPLAY_WIDTH; xx += 16)
+            {
+                __m128i shades = _mm_and_si128(_mm_loadu_si128((const __m128i*)&in[xx]), shadeMask);
+                __m128i lo = _mm_unpacklo_epi8(shades, zero);
+                __m128i hi = _mm_unpackhi_epi8(shades, zero);
+
+                _mm_storeu_si128((__m128i*)&out[xx +  0], selectShade(_mm_unpacklo_epi16(lo, zero), match, colour));
+                _mm_storeu_si128((__m128i*)&out[xx +  4], selectShade(_mm_unpackhi_epi16(lo, zero), match, colour));
+                _mm_storeu_si128((__m128i*)&out[xx +  8], selectShade(_mm_unpacklo_epi16(hi, zero), match, colour));
+                _mm_storeu_si128((__m128i*)&out[xx + 12], selectShade(_mm_unpackhi_epi16(hi, zero), match, colour));
+            }
+        }
+#endif
+
+        for (; xx < GB_DISPLAY_WIDTH; xx++)
+        {
+            out[xx] = gb_colour_map[in[xx] & PIXEL_SHADE_MASK];
+        }
+    }
+}
+
+// Convert lines of the index buffer to 16-bit RGB565 pixels
+void convertFrameToRGB565(const uint8_t* src, void* dst, int pitch, int firstLine, int numLines)
+{
+    int yy, xx;
+
+    for (yy = firstLine; yy < (firstLine + numLines); yy++)
+    {
+        const uint8_t* in = &src[yy * GB_DISPLAY_WIDTH];
+        uint16_t* out = (uint16_t*)((uint8_t*)dst + ((yy - firstLine) * pitch));
+
+        xx = 0;
+
+#ifdef __SSE2__
+        {
+            const __m128i shadeMask = _mm_set1_epi8(PIXEL_SHADE_MASK);
+            const __m128i zero = _mm_setzero_si128();
+            __m128i match[4];
+            __m128i colour[4];
+            int ii;
+
+            for (ii = 0; ii < 4; ii++)
+            {
+                match[ii] = _mm_set1_epi16(ii);
+                colour[ii] = _mm_set1_epi16((short)gb_colour_map_565[ii]);
+            }
+
+            for (; xx < GB_DISPLAY_WIDTH; xx += 16)
+            {
+                __m128i shades = _mm_and_si128(_mm_loadu_si128((const __m128i*)&in[xx]), shadeMask);
+                __m128i half;
+                __m128i result;
+                int jj;
+
+                for (jj = 0; jj < 2; jj++)
+                {
+                    half = (0 == jj) ? _mm_unpacklo_epi8(shades, zero) : _mm_unpackhi_epi8(shades, zero);
+
+                    result = _mm_and_si128(_mm_cmpeq_epi16(half, match[0]), colour[0]);
+                    result = _mm_or_si128(result, _mm_and_si128(_mm_cmpeq_epi16(half, match[1]), colour[1]));
+                    result = _mm_or_si128(result, _mm_and_si128(_mm_cmpeq_epi16(half, match[2]), colour[2]));
+                    result = _mm_or_si128(result, _mm_and_si128(_mm_cmpeq_epi16(half, match[3]), colour[3]));
+
+                    _mm_storeu_si128((__m128i*)&out[xx + (jj * 8)], result);
+                }
+            }
+        }
+#endif
+
+        for (; xx < GB_DISPLAY_WIDTH; xx++)
+        {
+            out[xx] = gb_colour_map_565[in[xx] & PIXEL_SHADE_MASK];
+        }
+    }
+}
+
+// Convert lines of the index buffer to 8-bit greyscale pixels
+void convertFrameToGrey8(const uint8_t* src, void* dst, int pitch, int firstLine, int numLines)
+{
+    int yy, xx;
+
+    for (yy = firstLine; yy < (firstLine + numLines); yy++)
+    {
+        const uint8_t* in = &src[yy * GB_DISPLAY_WIDTH];
+        uint8_t* out = (uint8_t*)dst + ((yy - firstLine) * pitch);
+
+        xx = 0;
+
+#ifdef __SSE2__
+        {
+            const __m128i shadeMask = _mm_set1_epi8(PIXEL_SHADE_MASK);
+            __m128i match[4];
+            __m128i colour[4];
+            int ii;
+
+            for (ii = 0; ii < 4; ii++)
+            {
+                match[ii] = _mm_set1_epi8(ii);
+                colour[ii] = _mm_set1_epi8((char)gb_colour_map_grey[ii]);
+            }
+
+            for (; xx < GB_DISPLAY_WIDTH; xx += 16)
+            {
+                __m128i shades = _mm_and_si128(_mm_loadu_si128((const __m128i*)&in[xx]), shadeMask);
+                __m128i result;
+
+                result = _mm_and_si128(_mm_cmpeq_epi8(shades, match[0]), colour[0]);
+                result = _mm_or_si128(result, _mm_and_si128(_mm_cmpeq_epi8(shades, match[1]), colour[1]));
+                result = _mm_or_si128(result, _mm_and_si128(_mm_cmpeq_epi8(shades, match[2]), colour[2]));
+                result = _mm_or_si128(result, _mm_and_si128(_mm_cmpeq_epi8(shades, match[3]), colour[3]));
+
+                _mm_storeu_si128((__m128i*)&out[xx], result);
+            }
+        }
+#endif
+
+        for (; xx < GB_DISPLAY_WIDTH; xx++)
+        {
+            out[xx] = gb_colour_map_grey[in[xx] & PIXEL_SHADE_MASK];
+        }
+    }
+}
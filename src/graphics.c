@@ -32,6 +32,9 @@ Purpose:
 Graphics related emulation functions
 ******************************************************************************/
 
+#include <stdio.h>
+#include <string.h>
+
 #include "SDL.h"
 
 #include "gameboy.h"
@@ -45,6 +48,12 @@ Graphics related emulation functions
 #define LCDC_SPRITES_ON					(1 << 1)
 #define LCDC_BG_WINDOW_ON				(1 << 0)
 
+#define STAT_LYC_INT					(1 << 6)
+#define STAT_OAM_INT					(1 << 5)
+#define STAT_VBLANK_INT					(1 << 4)
+#define STAT_HBLANK_INT					(1 << 3)
+#define STAT_COINCIDENCE				(1 << 2)
+
 #define OAM_ATTR_SPRITE_PRIORITY		(1 << 7)
 #define OAM_ATTR_Y_FLIP					(1 << 6)
 #define OAM_ATTR_X_FLIP					(1 << 5)
@@ -52,125 +61,80 @@ Graphics related emulation functions
 
 static drawCallback drawFrame = NULL;
 
-static gb_colour_map[] = {
-    0x00FFFFFF,
-    0x00CCCCCC,
-    0x00777777,
-    0x00000000  
-};
+// Colour index frame buffer, see PIXEL_* in gameboy.h for the layout
+static uint8_t frameBuffer[GB_DISPLAY_WIDTH * GB_DISPLAY_HEIGHT];
 
-// Caclulate which shade of grey we need
-uint32_t getColour(uint8_t colourIndex, uint8_t palette)
+// Register state latched at the start of each visible scanline. Rendering is
+// deferred until V-blank (or until VRAM/OAM is about to change) and works
+// from this log, so mid-frame raster effects still come out right.
+typedef struct
 {
-    uint8_t colour = (palette >> (colourIndex * 2)) & 0x03;
-
-    return gb_colour_map[colour];
-}
-
-void setLcdStatus(void)
+    uint8_t lcdc;
+    uint8_t scx;
+    uint8_t scy;
+    uint8_t wx;
+    uint8_t wy;
+    uint8_t bgp;
+    uint8_t obp0;
+    uint8_t obp1;
+    uint32_t videoVersion;
+} lineRegisters;
+
+static lineRegisters lineLog[GB_DISPLAY_HEIGHT];
+
+// What was last drawn into each line of the frame buffer. A line is only
+// redrawn if its registers differ or a VRAM/OAM write stamped after it was
+// drawn touched the tile map row, tiles or sprites it uses.
+typedef struct
 {
-    uint8_t requestInterrupt = 0;
-    uint8_t currentMode;
-
-    // If LCD is not enabled
-    if ((gbIO.LCDCONT & LCDC_LCD_ON) == 0)
-    {
-        gbState.lcdModePeriod = HBLANK_PERIOD;
-        gbIO.CURLINE = 0;
-
-        // Clear lower two bits then set V-Blank mode
-        gbIO.LCDSTAT &= 0xFC;
-        gbIO.LCDSTAT |= 0x01;
-    }
-    else
-    {
-        currentMode = gbIO.LCDSTAT & 0x03;
-
-        // We're in V-blank mode
-        if (gbIO.CURLINE >= GB_DISPLAY_HEIGHT)
-        {
-            gbState.lcdMode = 1;
-
-            // Clear lower two bits then set V-Blank mode
-            gbIO.LCDSTAT &= 0xFC;
-            gbIO.LCDSTAT |= 0x01;
-
-            // Trigger an interrupt if enabled
-            if (gbIO.LCDSTAT & 0x10)
-            {
-                requestInterrupt = 1;
-            }
-        }
-        else
-        {
-            // Mode 2
-            if (gbState.lcdModePeriod >= (HBLANK_PERIOD - 80))
-            {
-                gbState.lcdMode = 2;
-
-                // Clear lower two bits then set V-Blank mode
-                gbIO.LCDSTAT &= 0xFC;
-                gbIO.LCDSTAT |= 0x02;
-
-                // Trigger an interrupt if enabled
-                if (gbIO.LCDSTAT & 0x20)
-                {
-                    requestInterrupt = 1;
-                }
-            }
-            // Mode 3
-            if (gbState.lcdModePeriod >= (HBLANK_PERIOD - 80 - 172))
-            {
-                gbState.lcdMode = 3;
-
-                // Clear lower two bits then set V-Blank mode
-                gbIO.LCDSTAT &= 0xFC;
-                gbIO.LCDSTAT |= 0x03;
-            }
-            // Mode 0
-            else
-            {
-                gbState.lcdMode = 0;
-
-                // Clear lower two bits then set V-Blank mode
-                gbIO.LCDSTAT &= 0xFC;
-
-                // Trigger an interrupt if enabled
-                if (gbIO.LCDSTAT & 0x08)
-                {
-                    requestInterrupt = 1;
-                }
-            }
-        }
-
-        if (requestInterrupt && (gbState.lcdMode != currentMode))
-        {
-            gbIO.IFLAGS |= 0x02;
-        }
-
-        // Set the coincidence flag if lines match
-        if (gbIO.CURLINE == gbIO.CMPLINE)
-        {
-            // If coincidence interrupt enabled then trigger LCDSTAT interrupt
-            if (gbIO.LCDSTAT & 0x40)
-            {
-                // Request interrupt
-                gbIO.IFLAGS |= 0x2;
-            }
+    lineRegisters regs;
+    uint32_t drawnVersion;
+    uint64_t sprites;                   // OAM entries that covered the line
+    int valid;
+} lineMemo;
+
+static lineMemo lineCache[GB_DISPLAY_HEIGHT];
+static uint8_t lineDirty[GB_DISPLAY_HEIGHT];
+static uint32_t tileStamp[384];         // Version of the last write to each tile
+static uint32_t mapRowStamp[64];        // ... to each row of the two tile maps
+static uint32_t oamStamp[40];           // ... to each sprite attribute entry
+static int linesChanged = 0;
+static int lastLinesChanged = 0;
+static int dirtyFirst = 0;              // Band of lines redrawn since the frame
+static int dirtyLast = GB_DISPLAY_HEIGHT; // buffer was last collected for display
+static int loggedLines = 0;             // Lines of the current frame recorded so far
+static int renderedLines = 0;           // Lines of the current frame drawn so far
+static uint32_t videoVersion = 0;       // Bumped on every VRAM/OAM write
+
+// Frame skipping, timing and interrupts still run but nothing is drawn
+static int frameSkip = 0;               // Frames skipped for every one drawn
+static int framesSkipped = 0;           // Skipped since the last drawn frame
+static int skipThisFrame = 0;
+
+// Optional worker thread that draws the frame while the CPU runs V-blank
+static int renderThreaded = 0;
+static int renderBusy = 0;
+static volatile int renderQuit = 0;
+static SDL_Thread* renderThread = NULL;
+static SDL_sem* renderStart = NULL;
+static SDL_sem* renderDone = NULL;
+
+static struct
+{
+    int firstLine;
+    int lastLine;
+    uint8_t vram[0x2000];
+    uint8_t oam[0xA0];
+} renderJob;
 
-            // Set coincidence flag
-            gbIO.LCDSTAT |= 0x4;
-        }
-        // Clear the flag otherwise
-        else
-        {
-            gbIO.LCDSTAT &= 0xFB;
-        }
-    }
+// Caclulate which shade of grey we need
+static __inline uint8_t getShade(uint8_t colourIndex, uint8_t palette)
+{
+    return (palette >> (colourIndex * 2)) & 0x03;
 }
 
-// Draw a scanline of the tile layer to the output bitmap
-void drawTiles(SDL_Surface* surface, uint8_t scanline)
+// Draw a scanline of the tile layer to the frame buffer
+static void drawTiles(uint8_t scanline, const lineRegisters* regs, const uint8_t* vram)
 {
     const uint32_t tileSizeInBytes = 16;
 
@@ -188,18 +152,18 @@ void drawTiles(SDL_Surface* surface, uint8_t scanline)
 
 	uint8_t xPos, yPos, line;
 
-    uint32_t* video_plane;
+    uint8_t* video_plane;
 
     uint8_t unsignedNum = 1;
 	uint8_t usingWindow = 0;
 
-	uint8_t windowX = gbIO.WNDPOSX - 7;
-	uint8_t windowY = gbIO.WNDPOSY;
+	uint8_t windowX = regs->wx - 7;
+	uint8_t windowY = regs->wy;
 
-    video_plane = &((Uint32*)surface->pixels)[scanline * surface->w];
+    video_plane = &frameBuffer[scanline * GB_DISPLAY_WIDTH];
 
 	// Is the window enabled
-    if (gbIO.LCDCONT & LCDC_WINDOW_ON)
+    if (regs->lcdc & LCDC_WINDOW_ON)
     {
 		if (windowY <= scanline)
 		{
@@ -208,44 +172,44 @@ void drawTiles(SDL_Surface* surface, uint8_t scanline)
     }
 
     // Check bit 4 for the tile data selection
-    if (gbIO.LCDCONT & LCDC_LOWER_TILE_DATA)
+    if (regs->lcdc & LCDC_LOWER_TILE_DATA)
     {
-        tileDataTable = ADDR_VIDEO_RAM;
+        tileDataTable = 0;
     }
     else
     {
-        tileDataTable = ADDR_VIDEO_RAM + 0x800;
+        tileDataTable = 0x800;
         unsignedNum = 0;
     }
 
 	if (0 == usingWindow)
 	{
 		// Which backgroud memory are we using (bit 3)
-		if (gbIO.LCDCONT & LCDC_UPPER_TILE_MAP)
+		if (regs->lcdc & LCDC_UPPER_TILE_MAP)
 		{
-			tileMapTable = ADDR_VIDEO_RAM + 0x1C00;
+			tileMapTable = 0x1C00;
 		}
 		else
 		{
-			tileMapTable = ADDR_VIDEO_RAM + 0x1800;
+			tileMapTable = 0x1800;
 		}
 	}
 	else
 	{
 		// Which window memory are we using (bit 6)
-		if (gbIO.LCDCONT & LCDC_WINDOW_UPPER_TILE_SET)
+		if (regs->lcdc & LCDC_WINDOW_UPPER_TILE_SET)
 		{
-			tileMapTable = ADDR_VIDEO_RAM + 0x1C00;
+			tileMapTable = 0x1C00;
 		}
 		else
 		{
-			tileMapTable = ADDR_VIDEO_RAM + 0x1800;
+			tileMapTable = 0x1800;
 		}
 	}
 
 	if (0 == usingWindow)
 	{
-		yPos = gbIO.SCROLLY + scanline;
+		yPos = regs->scy + scanline;
 	}
 	else
 	{
@@ -256,7 +220,7 @@ void drawTiles(SDL_Surface* surface, uint8_t scanline)
 
 	for (xx = 0; xx < GB_DISPLAY_WIDTH; xx++)
     {
-        xPos = xx + gbIO.SCROLLX;
+        xPos = xx + regs->scx;
 
         if (1 == usingWindow)
         {
@@ -272,19 +236,19 @@ void drawTiles(SDL_Surface* surface, uint8_t scanline)
 
 		if (1 == unsignedNum)
         {
-			tileNumber = readByteFromMemory(tileMapTable + tileRow + tileCol);
+			tileNumber = vram[tileMapTable + tileRow + tileCol];
 			tileLocation += tileNumber * tileSizeInBytes;
         }
         else
         {
-            tileNumber = (int8_t)readByteFromMemory(tileMapTable + tileRow + tileCol);
+            tileNumber = (int8_t)vram[tileMapTable + tileRow + tileCol];
 			tileLocation += (tileNumber + 128) * tileSizeInBytes;
         }
 
 		line = (yPos % 8) * 2;
 
-        b1 = readByteFromMemory(tileLocation + line);
-        b2 = readByteFromMemory(tileLocation + line + 1);
+        b1 = vram[tileLocation + line];
+        b2 = vram[tileLocation + line + 1];
 
         //printf("Tile col %i, row: %i, number: %i\n", tileCol, tileRow, tileNumber);
         //printf("Reading from loc 0x%X, offset: 0x%X\n", tileLocation, line);
@@ -293,12 +257,18 @@ void drawTiles(SDL_Surface* surface, uint8_t scanline)
 
         colourIndex = (((b2 >> (7 - tx)) & 0x1) << 1) | ((b1 >> (7 - tx)) & 0x1);
 
-        video_plane[xx] = getColour(colourIndex, gbIO.BGRDPAL);
+        video_plane[xx] = getShade(colourIndex, regs->bgp) | PIXEL_SOURCE_BG;
+
+        // Sprites with the priority flag only show through colour 0
+        if (colourIndex)
+        {
+            video_plane[xx] |= PIXEL_BG_OPAQUE;
+        }
     }
 }
 
-// Draw a scanline of the sprites layer to the output bitmap
-void drawSprites(SDL_Surface* surface, uint8_t scanline)
+// Draw a scanline of the sprites layer to the frame buffer
+static void drawSprites(uint8_t scanline, const lineRegisters* regs, const uint8_t* vram, const uint8_t* oam)
 {
 	int use8x16 = 0;
 	uint8_t sprite;
@@ -326,22 +296,21 @@ void drawSprites(SDL_Surface* surface, uint8_t scanline)
 	int xPix;
 
 	uint8_t colourNum;
-	uint32_t colourValue;
-
-	uint16_t colourAddress;
+	uint8_t palette;
+	uint8_t source;
 
-    uint32_t* video_plane;
+    uint8_t* video_plane;
 
-	video_plane = &((unsigned int*)surface->pixels)[scanline * surface->w];
+	video_plane = &frameBuffer[scanline * GB_DISPLAY_WIDTH];
 
     // If sprites aren't enabled then get out of here
-    if (0x00 == (gbIO.LCDCONT & LCDC_SPRITES_ON))
+    if (0x00 == (regs->lcdc & LCDC_SPRITES_ON))
     {
         return;
     }
 
     // Determine sprite size, 8x8 or 8x16
-	if (gbIO.LCDCONT & LCDC_8_X_16_SPRITES)
+	if (regs->lcdc & LCDC_8_X_16_SPRITES)
 	{
 		use8x16 = 1;
 	}
@@ -352,10 +321,10 @@ void drawSprites(SDL_Surface* surface, uint8_t scanline)
 		// Sprite occupies 4 bytes in the sprite attributes table
 		index        = sprite * 4;
 		
-		yPos		 = readByteFromMemory(ADDR_OAM_MEMORY + index);
-		xPos		 = readByteFromMemory(ADDR_OAM_MEMORY + index + 1);
-		tileLocation = readByteFromMemory(ADDR_OAM_MEMORY + index + 2);
-		attributes	 = readByteFromMemory(ADDR_OAM_MEMORY + index + 3);
+		yPos		 = oam[index];
+		xPos		 = oam[index + 1];
+		tileLocation = oam[index + 2];
+		attributes	 = oam[index + 3];
 
 		yFlip = attributes & OAM_ATTR_Y_FLIP;
 		xFlip = attributes & OAM_ATTR_X_FLIP;
@@ -401,9 +370,9 @@ void drawSprites(SDL_Surface* surface, uint8_t scanline)
 			}
 
 			line *= 2; // same as for tiles
-			dataAddress = (ADDR_VIDEO_RAM + (tileLocation * 16)) + (uint16_t)line;
-			data1 = readByteFromMemory(dataAddress);
-			data2 = readByteFromMemory(dataAddress + 1);
+			dataAddress = (tileLocation * 16) + (uint16_t)line;
+			data1 = vram[dataAddress];
+			data2 = vram[dataAddress + 1];
 
 			// Its easier to read in from right to left as pixel 0 is
 			// bit 7 in the colour data, pixel 1 is bit 6 etc...
@@ -425,11 +394,13 @@ void drawSprites(SDL_Surface* surface, uint8_t scanline)
 
                 if (attributes & OAM_ATTR_USE_OBJ1_PALETTE)
 				{
-					colourAddress = 0xFF49;
+					palette = regs->obp1;
+					source = PIXEL_SOURCE_OBJ1;
 				}
 				else
 				{
-					colourAddress = 0xFF48;
+					palette = regs->obp0;
+					source = PIXEL_SOURCE_OBJ0;
 				}
 
                 // Skip transparent colours
@@ -438,141 +409,707 @@ void drawSprites(SDL_Surface* surface, uint8_t scanline)
                     continue;
                 }
 
-                switch((readByteFromMemory(colourAddress) >> (colourNum * 2)) & 0x03)
-                {
-                case 1: colourValue = 0x00CCCCCC; break;
-                case 2: colourValue = 0x00777777; break;
-                case 3: colourValue = 0x00000000; break;
-                case 0:
-                default: colourValue = 0x00FFFFFF; break;
-                }
-
-                //colourValue = getColour(colourNum, readByteFromMemory(colourAddress));
-
 				xPix = 0 - tilePixel;
 				xPix += 7;
 
 				pixel = xPos + xPix;
 
-                // If the background priority is greater than sprite, we need an extra check
+                if (pixel >= GB_DISPLAY_WIDTH)
+                {
+                    continue;
+                }
+
+                // If the background priority is greater than sprite then it
+                // only shows through background colour 0
                 if (attributes & OAM_ATTR_SPRITE_PRIORITY)
                 {
-                    if (video_plane[pixel] != 0x00FFFFFF)
+                    if (video_plane[pixel] & PIXEL_BG_OPAQUE)
                     {
                         continue;
                     }
                 }
 
-                if (pixel < GB_DISPLAY_WIDTH)
-				{
-                    video_plane[pixel] = colourValue;
-				}
+                video_plane[pixel] = getShade(colourNum, palette) | source;
 
 			}
 		}
 	}
 }
-void drawTilemap(SDL_Surface* surface)
+// Draw the tile data in VRAM as a grid for debugging, 20 tiles to a row so
+// 360 of the 384 tiles fit on the 160x144 display
+void drawTilemap(uint8_t* buffer)
 {
     int xx, yy, tx, ty;
-    unsigned int colour;
+    uint8_t colour;
     uint8_t b1, b2;
 
     unsigned int tile_table;
-    unsigned int bg_offset;
-
-    unsigned int rmask, gmask, bmask, amask;
-
-    unsigned int* video_plane;
-
-    rmask = 0x000000ff;
-    gmask = 0x0000ff00;
-    bmask = 0x00ff0000;
-    amask = 0xff000000;
-
-    SDL_LockSurface(surface);
-
-    video_plane = surface->pixels;
 
     tile_table = ADDR_VIDEO_RAM;
-    bg_offset = 0;
 
-    for (yy = 0; yy < 12; yy++)
+    for (yy = 0; yy < (GB_DISPLAY_HEIGHT / 8); yy++)
     {
-        for (xx = 0; xx < 32; xx++)
+        for (xx = 0; xx < (GB_DISPLAY_WIDTH / 8); xx++)
         {
             for (ty = 0; ty < 8; ty++)
             {
                 b1 = readByteFromMemory(tile_table++);
                 b2 = readByteFromMemory(tile_table++);
 
-                /*
-                if (b1 || b2)
-                {
-                    printf("b1: 0x%X, b2: 0x%X\n", b1, b2);
-                    exit(0);
-                }
-                */
-
                 for (tx = 0; tx < 8; tx++)
                 {
                     colour = (((b2 >> (7 - tx)) & 0x1) << 1) | ((b1 >> (7 - tx)) & 0x1);
-                    //colour *= 64;
 
-                    video_plane[(((yy * 8) + ty) * 256) + (xx * 8) + tx] = getColour(colour, gbIO.BGRDPAL); //(colour << 16) | (colour << 8) | (colour);
+                    buffer[(((yy * 8) + ty) * GB_DISPLAY_WIDTH) + (xx * 8) + tx] = getShade(colour, gbIO.BGRDPAL);
                 }
             }
         }
     }
+}
 
-    SDL_UnlockSurface(surface);
+static __inline int sameRegisters(const lineRegisters* a, const lineRegisters* b)
+{
+    return (a->lcdc == b->lcdc) && (a->scx == b->scx) && (a->scy == b->scy) &&
+           (a->wx == b->wx) && (a->wy == b->wy) && (a->bgp == b->bgp) &&
+           (a->obp0 == b->obp0) && (a->obp1 == b->obp1);
 }
 
-void updateGraphics(SDL_Surface* surface, Uint32 cycles)
+// Work out which sprites cover a scanline, using the same tests as drawSprites
+static uint64_t spritesOnLine(uint8_t scanline, const lineRegisters* regs, const uint8_t* oam)
 {
-    setLcdStatus();
+    uint64_t sprites = 0;
+    uint8_t yPos, xPos;
+    int ysize = (regs->lcdc & LCDC_8_X_16_SPRITES) ? 16 : 8;
+    int sprite;
 
-    // If LCD is enabled
-    if (gbIO.LCDCONT & LCDC_LCD_ON)
+    if (0x00 == (regs->lcdc & LCDC_SPRITES_ON))
     {
-        gbState.lcdModePeriod -= cycles;
-     
-		// Have we reached the horizontal blanking period?
-        if (gbState.lcdModePeriod <= 0)
+        return 0;
+    }
+
+    for (sprite = 0; sprite < 40; sprite++)
+    {
+        yPos = oam[sprite * 4];
+        xPos = oam[(sprite * 4) + 1];
+
+        if ((0 == yPos) || (yPos >= GB_DISPLAY_HEIGHT + 16) || (0 == xPos) || (xPos >= GB_DISPLAY_WIDTH + 8))
         {
-			// Move to the next scanline
-            gbIO.CURLINE++;
+            continue;
+        }
 
-			// Reset the countdown
-            gbState.lcdModePeriod += HBLANK_PERIOD;
+        yPos -= 16;
 
-            // Have we reached the V-blank area, if so trigger an interrupt
-            if (GB_DISPLAY_HEIGHT == gbIO.CURLINE)
+        if ((scanline >= yPos) && (scanline < (yPos + ysize)))
+        {
+            sprites |= ((uint64_t)1 << sprite);
+        }
+    }
+
+    return sprites;
+}
+
+// Check the memo for a line, returns non-zero if the frame buffer already
+// holds exactly what drawing it again would produce
+static int lineUnchanged(uint8_t scanline, const lineRegisters* regs, const uint8_t* vram, const uint8_t* oam, uint64_t sprites)
+{
+    const lineMemo* memo = &lineCache[scanline];
+    uint32_t drawn = memo->drawnVersion;
+    uint8_t yPos;
+    int mapRow;
+    int col;
+    int tile;
+    int sprite;
+
+    if (!memo->valid || !sameRegisters(&memo->regs, regs))
+    {
+        return 0;
+    }
+
+    // Nothing at all has been written since the line was drawn
+    if (drawn == videoVersion)
+    {
+        return 1;
+    }
+
+    // Find the one tile map row this line reads, as drawTiles does
+    if ((regs->lcdc & LCDC_WINDOW_ON) && (regs->wy <= scanline))
+    {
+        mapRow = (regs->lcdc & LCDC_WINDOW_UPPER_TILE_SET) ? 32 : 0;
+        yPos = scanline - regs->wy;
+    }
+    else
+    {
+        mapRow = (regs->lcdc & LCDC_UPPER_TILE_MAP) ? 32 : 0;
+        yPos = regs->scy + scanline;
+    }
+
+    mapRow += yPos / 8;
+
+    if (mapRowStamp[mapRow] > drawn)
+    {
+        return 0;
+    }
+
+    // Then every tile that row refers to
+    for (col = 0; col < 32; col++)
+    {
+        tile = vram[0x1800 + (mapRow * 32) + col];
+
+        if (0 == (regs->lcdc & LCDC_LOWER_TILE_DATA))
+        {
+            tile = 256 + (int8_t)tile;
+        }
+
+        if (tileStamp[tile] > drawn)
+        {
+            return 0;
+        }
+    }
+
+    // Sprites covering the line now or when it was drawn
+    for (sprite = 0; sprite < 40; sprite++)
+    {
+        if (((sprites | memo->sprites) & ((uint64_t)1 << sprite)) == 0)
+        {
+            continue;
+        }
+
+        if ((oamStamp[sprite] > drawn) || (sprites != memo->sprites))
+        {
+            return 0;
+        }
+
+        tile = oam[(sprite * 4) + 2];
+
+        if (regs->lcdc & LCDC_8_X_16_SPRITES)
+        {
+            tile &= 0xFE;
+
+            if (tileStamp[tile + 1] > drawn)
             {
-                gbIO.IFLAGS |= 0x01;
+                return 0;
             }
-            // If gone past scanline 153 reset to 0
-            else if (gbIO.CURLINE > 153)
+        }
+
+        if (tileStamp[tile] > drawn)
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// Decide which logged lines really need drawing and update their memos. This
+// always runs on the emulation thread so the stamps can't change under it.
+static void checkLines(int firstLine, int lastLine)
+{
+    int line;
+    uint64_t sprites;
+    lineMemo* memo;
+
+    for (line = firstLine; line < lastLine; line++)
+    {
+        const lineRegisters* regs = &lineLog[line];
+
+        lineDirty[line] = 0;
+
+        // Lines with the background off are left as they were
+        if (0 == (regs->lcdc & LCDC_BG_WINDOW_ON))
+        {
+            continue;
+        }
+
+        sprites = spritesOnLine(line, regs, OAMbank);
+
+        if (lineUnchanged(line, regs, VRAMbank, OAMbank, sprites))
+        {
+            continue;
+        }
+
+        memo = &lineCache[line];
+        memo->regs = *regs;
+        memo->drawnVersion = videoVersion;
+        memo->sprites = sprites;
+        memo->valid = 1;
+
+        lineDirty[line] = 1;
+        linesChanged++;
+
+        if (line < dirtyFirst)
+        {
+            dirtyFirst = line;
+        }
+
+        if (line >= dirtyLast)
+        {
+            dirtyLast = line + 1;
+        }
+    }
+}
+
+// Draw a range of logged scanlines from the given VRAM/OAM contents
+static void renderLines(int firstLine, int lastLine, const uint8_t* vram, const uint8_t* oam)
+{
+    int line;
+
+    for (line = firstLine; line < lastLine; line++)
+    {
+        const lineRegisters* regs = &lineLog[line];
+
+        // Draw tiles then sprites on top
+        if (lineDirty[line])
+        {
+            drawTiles(line, regs, vram);
+            drawSprites(line, regs, vram, oam);
+        }
+    }
+}
+
+// Draw layers of one scanline straight away from the live registers, VRAM
+// and OAM, skipping the line log. The core benchmarks use this to time the
+// tile and sprite drawing on their own.
+void drawScanlineLayers(uint8_t scanline, int layers)
+{
+    lineRegisters regs;
+
+    regs.lcdc = gbIO.LCDCONT;
+    regs.scx = gbIO.SCROLLX;
+    regs.scy = gbIO.SCROLLY;
+    regs.wx = gbIO.WNDPOSX;
+    regs.wy = gbIO.WNDPOSY;
+    regs.bgp = gbIO.BGRDPAL;
+    regs.obp0 = gbIO.OBJ0PAL;
+    regs.obp1 = gbIO.OBJ1PAL;
+    regs.videoVersion = videoVersion;
+
+    if (layers & DRAW_LAYER_TILES)
+    {
+        drawTiles(scanline, &regs, VRAMbank);
+    }
+
+    if (layers & DRAW_LAYER_SPRITES)
+    {
+        drawSprites(scanline, &regs, VRAMbank, OAMbank);
+    }
+}
+
+static int renderWorker(void* unused)
+{
+    for (;;)
+    {
+        SDL_SemWait(renderStart);
+
+        if (renderQuit)
+        {
+            break;
+        }
+
+        renderLines(renderJob.firstLine, renderJob.lastLine, renderJob.vram, renderJob.oam);
+
+        SDL_SemPost(renderDone);
+    }
+
+    return 0;
+}
+
+// Block until the worker has finished with the frame buffer
+static void waitForRender(void)
+{
+    if (renderBusy)
+    {
+        SDL_SemWait(renderDone);
+        renderBusy = 0;
+    }
+}
+
+// Draw every line logged so far using the live VRAM/OAM
+static void flushLines(void)
+{
+    waitForRender();
+
+    checkLines(renderedLines, loggedLines);
+    renderLines(renderedLines, loggedLines, VRAMbank, OAMbank);
+    renderedLines = loggedLines;
+}
+
+// Hand the rest of the frame to the worker thread, or draw it now
+static void submitFrame(void)
+{
+    if (renderedLines >= loggedLines)
+    {
+        return;
+    }
+
+    if (renderThreaded)
+    {
+        waitForRender();
+
+        checkLines(renderedLines, loggedLines);
+
+        renderJob.firstLine = renderedLines;
+        renderJob.lastLine = loggedLines;
+        memcpy(renderJob.vram, VRAMbank, sizeof(renderJob.vram));
+        memcpy(renderJob.oam, OAMbank, sizeof(renderJob.oam));
+
+        renderBusy = 1;
+        SDL_SemPost(renderStart);
+
+        renderedLines = loggedLines;
+    }
+    else
+    {
+        flushLines();
+    }
+}
+
+// Latch the registers the renderer needs for the current scanline
+static void logScanline(void)
+{
+    lineRegisters* regs = &lineLog[gbIO.CURLINE];
+
+    if (skipThisFrame)
+    {
+        return;
+    }
+
+    regs->lcdc = gbIO.LCDCONT;
+    regs->scx = gbIO.SCROLLX;
+    regs->scy = gbIO.SCROLLY;
+    regs->wx = gbIO.WNDPOSX;
+    regs->wy = gbIO.WNDPOSY;
+    regs->bgp = gbIO.BGRDPAL;
+    regs->obp0 = gbIO.OBJ0PAL;
+    regs->obp1 = gbIO.OBJ1PAL;
+    regs->videoVersion = videoVersion;
+
+    loggedLines = gbIO.CURLINE + 1;
+}
+
+// Decide whether the frame that is about to start gets drawn
+static void startFrame(void)
+{
+    loggedLines = 0;
+    renderedLines = 0;
+
+    if (!skipThisFrame)
+    {
+        lastLinesChanged = linesChanged;
+    }
+
+    linesChanged = 0;
+
+    if (framesSkipped < frameSkip)
+    {
+        skipThisFrame = 1;
+        framesSkipped++;
+    }
+    else
+    {
+        skipThisFrame = 0;
+        framesSkipped = 0;
+    }
+}
+
+// Called by the memory module before VRAM or OAM is modified. Any lines
+// already logged must be drawn with the old contents first, then the part of
+// video memory being written is stamped for the line memos.
+void syncVideoMemory(uint16_t address)
+{
+    if (renderedLines < loggedLines)
+    {
+        flushLines();
+    }
+
+    videoVersion++;
+
+    if (address >= ADDR_OAM_MEMORY)
+    {
+        oamStamp[(address - ADDR_OAM_MEMORY) >> 2] = videoVersion;
+    }
+    else if (address >= (ADDR_VIDEO_RAM + 0x1800))
+    {
+        mapRowStamp[(address - (ADDR_VIDEO_RAM + 0x1800)) >> 5] = videoVersion;
+    }
+    else
+    {
+        tileStamp[(address - ADDR_VIDEO_RAM) >> 4] = videoVersion;
+    }
+}
+
+// Get the band of lines that changed since the last call, returns zero if the
+// frame buffer is identical to what was collected last time
+int collectDirtyLines(int* firstLine, int* lastLine)
+{
+    int changed = (dirtyFirst < dirtyLast);
+
+    *firstLine = dirtyFirst;
+    *lastLine = dirtyLast;
+
+    dirtyFirst = GB_DISPLAY_HEIGHT;
+    dirtyLast = 0;
+
+    return changed;
+}
+
+// Number of scanlines that actually had to be drawn in the last shown frame
+int getChangedLineCount(void)
+{
+    return lastLinesChanged;
+}
+
+// Work out the level of the STAT interrupt line. The interrupt is requested
+// when it goes from low to high, so each source fires once per edge.
+static void updateStatInterrupt(void)
+{
+    uint8_t statLine = 0;
+
+    switch (gbState.lcdMode)
+    {
+    case 0: statLine = gbIO.LCDSTAT & STAT_HBLANK_INT; break;
+    case 1: statLine = gbIO.LCDSTAT & STAT_VBLANK_INT; break;
+    case 2: statLine = gbIO.LCDSTAT & STAT_OAM_INT; break;
+    default: break;
+    }
+
+    if ((gbIO.CURLINE == gbIO.CMPLINE) && (gbIO.LCDSTAT & STAT_LYC_INT))
+    {
+        statLine = 1;
+    }
+
+    if (statLine && !gbState.lcdStatLine)
+    {
+        requestInterrupt(INT_LCDC);
+    }
+
+    gbState.lcdStatLine = statLine ? 1 : 0;
+}
+
+// Enter a new LCD mode and schedule the edge that ends it
+static void setLcdMode(int mode, int period)
+{
+    gbState.lcdMode = mode;
+    gbState.lcdEventCycle += period;
+
+    updateStatInterrupt();
+}
+
+// Handle the mode edge that has just been reached
+static void lcdEvent(void)
+{
+    switch (gbState.lcdMode)
+    {
+    // OAM search done, latch the registers as pixel transfer starts
+    case 2:
+        logScanline();
+        setLcdMode(3, LCD_MODE3_PERIOD);
+        break;
+
+    case 3:
+        setLcdMode(0, LCD_MODE0_PERIOD);
+        break;
+
+    // End of a visible line
+    case 0:
+        gbIO.CURLINE++;
+
+        // Have we reached the V-blank area, if so trigger an interrupt
+        // and draw the frame from the scanline log
+        if (GB_DISPLAY_HEIGHT == gbIO.CURLINE)
+        {
+            requestInterrupt(INT_VBLANK);
+            submitFrame();
+
+            setLcdMode(1, HBLANK_PERIOD);
+        }
+        else
+        {
+            setLcdMode(2, LCD_MODE2_PERIOD);
+        }
+        break;
+
+    // End of a V-blank line
+    case 1:
+    default:
+        gbIO.CURLINE++;
+
+        // If gone past scanline 153 reset to 0
+        if (gbIO.CURLINE > 153)
+        {
+            gbIO.CURLINE = 0;
+
+            // Skipped frames are never handed over for display
+            if (!skipThisFrame)
             {
-                gbIO.CURLINE = 0;
-				drawFrame();
+#ifdef GAMEBOY_STATS
+                Uint64 drawTicks = SDL_GetPerformanceCounter();
+#endif
+                waitForRender();
+                drawFrame();
+
+                STATS_ADD_TIME(STATS_TIME_DRAW, SDL_GetPerformanceCounter() - drawTicks);
+                STATS_ADD(framesRendered, 1);
             }
-            // Draw the current scanline
-            else if (gbIO.CURLINE < GB_DISPLAY_HEIGHT)
+            else
             {
-                // Draw tiles then sprites on top
-                if (gbIO.LCDCONT & LCDC_BG_WINDOW_ON)
-                {
-					SDL_LockSurface(surface);
-				    drawTiles(surface, gbIO.CURLINE);
-					drawSprites(surface, gbIO.CURLINE);
-					SDL_UnlockSurface(surface);
-                }
+                STATS_ADD(framesSkipped, 1);
             }
+
+            startFrame();
+
+            setLcdMode(2, LCD_MODE2_PERIOD);
+        }
+        else
+        {
+            setLcdMode(1, HBLANK_PERIOD);
+        }
+        break;
+    }
+}
+
+// Run the LCD up to the current cycle. The main loop only calls this once the
+// next mode edge is due, in between the LCD needs no attention at all.
+void updateGraphics(void)
+{
+    while (gbState.cycles >= gbState.lcdEventCycle)
+    {
+        lcdEvent();
+    }
+}
+
+// Handle a write to LCDC, switching the display on or off restarts the LCD
+void writeLcdControl(uint8_t value)
+{
+    uint8_t wasOn = gbIO.LCDCONT & LCDC_LCD_ON;
+
+    gbIO.LCDCONT = value;
+
+    // Switched on, start a fresh frame from line 0
+    if (!wasOn && (value & LCDC_LCD_ON))
+    {
+        gbIO.CURLINE = 0;
+        gbState.lcdEventCycle = gbState.cycles;
+        gbState.lcdStatLine = 0;
+
+        startFrame();
+        setLcdMode(2, LCD_MODE2_PERIOD);
+    }
+    // Switched off, finish whatever part of the frame was logged
+    else if (wasOn && !(value & LCDC_LCD_ON))
+    {
+        flushLines();
+
+        gbIO.CURLINE = 0;
+        gbState.lcdMode = 0;
+        gbState.lcdEventCycle = CYCLE_NEVER;
+    }
+}
+
+// Only the interrupt enable bits of STAT are writable
+void writeLcdStatus(uint8_t value)
+{
+    gbIO.LCDSTAT = value & 0x78;
+
+    if (gbIO.LCDCONT & LCDC_LCD_ON)
+    {
+        updateStatInterrupt();
+    }
+}
+
+void writeLcdCompare(uint8_t value)
+{
+    gbIO.CMPLINE = value;
+
+    if (gbIO.LCDCONT & LCDC_LCD_ON)
+    {
+        updateStatInterrupt();
+    }
+}
+
+// Writing to LY resets it
+void writeLcdLine(uint8_t value)
+{
+    gbIO.CURLINE = 0;
+
+    if (gbIO.LCDCONT & LCDC_LCD_ON)
+    {
+        updateStatInterrupt();
+    }
+}
+
+// Build the STAT value from the current mode and LY/LYC comparison
+uint8_t readLcdStatus(void)
+{
+    uint8_t status = 0x80 | gbIO.LCDSTAT;
+
+    if (gbIO.LCDCONT & LCDC_LCD_ON)
+    {
+        status |= gbState.lcdMode;
+
+        if (gbIO.CURLINE == gbIO.CMPLINE)
+        {
+            status |= STAT_COINCIDENCE;
+        }
+    }
+
+    return status;
+}
+
+// Put the LCD into its switched off state, ready for the first LCDC write
+void initGraphics(void)
+{
+    gbIO.LCDCONT = 0;
+    gbIO.CURLINE = 0;
+    gbState.lcdMode = 0;
+    gbState.lcdStatLine = 0;
+    gbState.lcdEventCycle = CYCLE_NEVER;
+}
+
+// Draw only one frame in every (skip + 1), LY, STAT and interrupts are unaffected
+void setFrameSkip(int skip)
+{
+    frameSkip = skip;
+}
+
+// Render whole frames on a worker thread rather than the emulation thread
+void setRenderThreaded(int threaded)
+{
+    if (threaded && (NULL == renderThread))
+    {
+        renderStart = SDL_CreateSemaphore(0);
+        renderDone = SDL_CreateSemaphore(0);
+        renderQuit = 0;
+
+        renderThread = SDL_CreateThread(renderWorker, "DoGoBoy render", NULL);
+
+        if (NULL == renderThread)
+        {
+            printf("Failed to start render thread, drawing on the main thread\n");
+
+            SDL_DestroySemaphore(renderStart);
+            SDL_DestroySemaphore(renderDone);
         }
     }
+    else if (!threaded && renderThread)
+    {
+        waitForRender();
+
+        renderQuit = 1;
+        SDL_SemPost(renderStart);
+        SDL_WaitThread(renderThread, NULL);
+        renderThread = NULL;
 
-    //printf("Line: %i, enable: %i\n", gbIO.CURLINE, gbIO.LCDCONT & 0x80);
+        SDL_DestroySemaphore(renderStart);
+        SDL_DestroySemaphore(renderDone);
+    }
+
+    renderThreaded = threaded && (NULL != renderThread);
+}
+
+// The colour index frame buffer, convert it with one of the convertFrameTo functions
+const uint8_t* getFrameBuffer(void)
+{
+    return frameBuffer;
 }
 
 void setDrawFrameFunction(drawCallback func)
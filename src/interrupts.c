@@ -0,0 +1,305 @@
+/******************************************************************************
+DoGoBoy - Nintendo GameBoy Emulator
+*******************************************************************************
+Copyright (c) 2009-2013, Douglas Gore (doug@ssonic.co.uk)
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the Douglas Gore nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL DOUGLAS GORE BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*******************************************************************************
+Purpose:
+
+The interrupt controller, the DIV/TIMA timer and the joypad register. The
+timer is kept as a count from the cycle it was last reset and only brought
+up to date when read, with the overflow scheduled as an event.
+******************************************************************************/
+
+#include "gameboy.h"
+
+#define TAC_TIMER_ON		(1 << 2)
+
+// Index of the lowest set bit for each combination of the five interrupt
+// sources, which gives both the priority and the vector
+static const uint8_t lowestInterrupt[32] =
+{
+    0, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0,
+    4, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0
+};
+
+// Decide whether the main loop needs to call doInterrupts(). This is only
+// recomputed when IF, IE, IME or the halt state change.
+static void updateInterruptCheck(void)
+{
+    uint8_t pending = gbIO.IFLAGS & gbIO.ISWITCH & 0x1F;
+
+    gbState.interruptCheck = (pending && (gbState.IME || gbState.cpuHalted)) || gbState.imeDelay;
+}
+
+void doInterrupts(void)
+{
+    uint8_t pending = gbIO.IFLAGS & gbIO.ISWITCH & 0x1F;
+
+    // EI takes effect after the instruction that follows it
+    if (gbState.imeDelay)
+    {
+        gbState.imeDelay--;
+
+        if (0 == gbState.imeDelay)
+        {
+            gbState.IME = 1;
+        }
+    }
+
+    // A pending interrupt wakes the CPU from HALT even when IME is clear,
+    // STOP is only left by the joypad
+    if (pending && gbState.cpuHalted)
+    {
+        if ((1 == gbState.cpuHalted) || (pending & INT_HI_LO))
+        {
+            gbState.cpuHalted = 0;
+        }
+    }
+
+    if (pending && gbState.IME && !gbState.cpuHalted)
+    {
+        uint8_t source = lowestInterrupt[pending];
+
+        gbState.IME = 0;						// Disable interrupts
+        gbIO.IFLAGS &= ~(1 << source);			// Clear the flag to show we're servicing request
+        pushWordToStack(REGS.w.PC);				// Put PC on the stack
+        REGS.w.PC = 0x40 + (source * 8);		// Jump to the interrupt code
+
+        profileInterrupt();
+    }
+
+    updateInterruptCheck();
+}
+
+// Raise one or more interrupt sources in IF
+void requestInterrupt(uint8_t source)
+{
+    gbIO.IFLAGS |= source;
+
+    updateInterruptCheck();
+}
+
+void writeInterruptFlags(uint8_t value)
+{
+    gbIO.IFLAGS = value;
+
+    updateInterruptCheck();
+}
+
+void writeInterruptEnable(uint8_t value)
+{
+    gbIO.ISWITCH = value;
+
+    updateInterruptCheck();
+}
+
+// Set IME straight away, as DI and RETI do
+void setInterruptMaster(uint8_t enable)
+{
+    gbState.IME = enable;
+    gbState.imeDelay = 0;
+
+    updateInterruptCheck();
+}
+
+// EI enables interrupts once the next instruction has run
+void enableInterruptsDelayed(void)
+{
+    if (!gbState.IME)
+    {
+        gbState.imeDelay = 2;
+    }
+
+    updateInterruptCheck();
+}
+
+// Enter HALT (1) or STOP (2)
+void haltCpu(uint8_t mode)
+{
+    gbState.cpuHalted = mode;
+
+    updateInterruptCheck();
+}
+
+// Shift from DIV's internal cycle count to TIMA ticks for each TAC clock
+// select, i.e. 4096Hz, 262144Hz, 65536Hz and 16384Hz
+static const int timerShift[4] = { 10, 4, 6, 8 };
+
+// The number of TIMA ticks between DIV last being reset and the given cycle
+static uint64_t timerTicks(uint64_t cycle)
+{
+    return (cycle - gbState.divBase) >> timerShift[gbIO.TIMECONT & 0x03];
+}
+
+// Bring TIMECNT up to the current cycle. The overflow is handled as a
+// scheduled event so TIMECNT can't wrap between two syncs.
+static void syncTimer(void)
+{
+    if (gbIO.TIMECONT & TAC_TIMER_ON)
+    {
+        gbIO.TIMECNT += (uint8_t)(timerTicks(gbState.cycles) - timerTicks(gbState.timaBase));
+    }
+
+    gbState.timaBase = gbState.cycles;
+}
+
+// Work out the cycle on which TIMA will next overflow
+static void scheduleTimer(void)
+{
+    if (gbIO.TIMECONT & TAC_TIMER_ON)
+    {
+        uint64_t overflowTick = timerTicks(gbState.timaBase) + (0x100 - gbIO.TIMECNT);
+
+        gbState.timerEventCycle = gbState.divBase + (overflowTick << timerShift[gbIO.TIMECONT & 0x03]);
+    }
+    else
+    {
+        gbState.timerEventCycle = CYCLE_NEVER;
+    }
+}
+
+// Called by the main loop once the TIMA overflow is due, reload it from TMA
+// and request the timer interrupt
+void updateTimers(void)
+{
+    while (gbState.cycles >= gbState.timerEventCycle)
+    {
+        gbState.timaBase = gbState.timerEventCycle;
+        gbIO.TIMECNT = gbIO.TIMEMOD;
+
+        requestInterrupt(INT_TIMER);
+
+        scheduleTimer();
+    }
+}
+
+void initTimers(void)
+{
+    gbState.divBase = gbState.cycles;
+    gbState.timaBase = gbState.cycles;
+    gbState.timerEventCycle = CYCLE_NEVER;
+}
+
+// DIV is the top half of a 16-bit counter clocked every cycle
+uint8_t readDivider(void)
+{
+    return (uint8_t)((gbState.cycles - gbState.divBase) >> 8);
+}
+
+uint8_t readTimerCounter(void)
+{
+    syncTimer();
+
+    return gbIO.TIMECNT;
+}
+
+// Any write to DIV resets it to zero, which also restarts the TIMA prescaler
+void writeDivider(uint8_t value)
+{
+    syncTimer();
+
+    gbState.divBase = gbState.cycles;
+
+    scheduleTimer();
+}
+
+void writeTimerCounter(uint8_t value)
+{
+    syncTimer();
+
+    gbIO.TIMECNT = value;
+
+    scheduleTimer();
+}
+
+void writeTimerControl(uint8_t value)
+{
+    syncTimer();
+
+    gbIO.TIMECONT = value & 0x07;
+
+    scheduleTimer();
+}
+
+uint8_t getJoypadState(void)
+{
+	uint8_t state = 0x0F;
+
+	// Test for direction key check
+	if ((gbIO.JOYPAD & (1 << 4)) == 0x00)
+	{
+		state = (~gbState.keysState & 0x0F);
+	}
+    // Tes for button key
+	else if ((gbIO.JOYPAD & (1 << 5)) == 0x00)
+	{
+		state = (~(gbState.keysState >> 4) & 0x0F);
+	}
+
+	//printf("Key state read, req: 0x%X, pad state: 0x%X, IO value: 0x%X\n", gbIO.JOYPAD, gbState.keysState, state);
+    //exit_with_debug();
+	return state;
+}
+
+void gbKeyPress(int down, int key)
+{
+	int alreadySet;
+	int raiseInterrupt = 0;
+
+	alreadySet = (gbState.keysState >> key) & 0x1;
+
+	//printf("gbKeyPress down: %i, key: %i, set %i\n", down, key, alreadySet);
+
+	if (1 == down)
+	{
+		gbState.keysState |= (1 << key);
+	}
+	else
+	{
+		gbState.keysState &= ~(1 << key);
+	}
+
+	if (key > 3)
+	{
+		if (!(gbIO.JOYPAD & (1 << 5)))
+		{
+			raiseInterrupt = 1;
+		}
+	}
+	else
+	{
+		if (!(gbIO.JOYPAD & (1 << 4)))
+		{
+			raiseInterrupt = 1;
+		}
+	}
+
+	if ((1 == raiseInterrupt) && (0 == alreadySet))
+	{
+		requestInterrupt(INT_HI_LO);
+	}
+}
@@ -34,6 +34,9 @@ graphics handling, program maintainence, etc.
 ******************************************************************************/
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
 
 #ifdef __WIN32__
 #include <Windows.h>
@@ -67,12 +70,40 @@ char window_title[80];
 
 SDL_Window *screen = NULL;
 SDL_Renderer *renderer = NULL;
-SDL_Surface *gbSurface = NULL;
 SDL_Texture *gbTexture = NULL;
 SDL_Joystick *joystick = NULL;
 
 static int showTilemap = FALSE;
+static int forceRedraw = TRUE;
 static int scaleFactor = 2;
+static int bankStats = FALSE;
+
+// Real time taken by one frame's worth of cycles
+#define FRAME_PERIOD_MS		((1000.0 * CYCLES_PER_FRAME) / CPU_CLOCK_HZ)
+#define MAX_FRAME_SKIP		5
+
+static int frameSkip = 0;
+static int autoFrameSkip = FALSE;
+
+// What keeps the emulation running at the right speed
+typedef enum
+{
+    PACE_TIMER,			// High resolution timer at the emulated frame rate
+    PACE_AUDIO,			// Wait for the audio device to drain
+    PACE_VSYNC			// Presenting blocks on vsync, audio follows
+} pacingMode;
+
+static pacingMode pacing = PACE_TIMER;
+
+// One minute of emulated time unless told otherwise
+#define HEADLESS_FRAMES		3584
+
+// Benchmark runs are repeated to see how noisy the host is
+#define BENCH_RUNS			5
+#define BENCH_MAX_RUNS		100
+
+// Colour index buffer for the F1 tile data debug view
+static uint8_t tilemapBuffer[GB_DISPLAY_WIDTH * GB_DISPLAY_HEIGHT];
 
 // Exit and print out the last 100 debug actions
 void exit_with_debug(void)
@@ -109,7 +140,13 @@ void exit_with_debug(void)
 		printf("Stack pointer in a non-standard location: 0x%X\n", REGS.w.SP);
 	}
 	
+	if (bankStats)
+	{
+		printBankStats();
+	}
 
+	closeProfiler();
+	closeSound();
 	freeGbMemory();
 
     exit(0);
@@ -129,263 +166,244 @@ void writeLog(char* log_message, ...)
     if (msg_offset >= 100) msg_offset = 0;
 }
 
-// Blit the output bitmap to the screen and flip the buffer if double buffered
-void drawFrame(void)
+// Host time in milliseconds from the high resolution counter
+static double hostTimeMs(void)
 {
-	SDL_Rect dstRect;
-	
-	dstRect.x = 0;
-	dstRect.y = 0;
-	dstRect.w = GB_DISPLAY_WIDTH * scaleFactor;
-	dstRect.h = GB_DISPLAY_HEIGHT * scaleFactor;
-
-	SDL_RenderClear(renderer);
-
-	if (showTilemap)
-	{
-		drawTilemap(gbSurface);
-	}
-
-	SDL_UpdateTexture(gbTexture, NULL, gbSurface->pixels, gbSurface->pitch);
-	SDL_RenderCopy(renderer, gbTexture, NULL, NULL);
-
-    SDL_RenderPresent(renderer);
-    
-    frames++;
+    return (SDL_GetPerformanceCounter() * 1000.0) / SDL_GetPerformanceFrequency();
 }
 
-void doInterrupts(void)
+// Sleep until the deadline. SDL_Delay only has millisecond granularity and
+// may oversleep, so the last millisecond is spent polling the counter.
+static void waitUntil(double deadline)
 {
-    // If interrupts are enabled then run our interrupt handler
-    if (1 == gbState.IME)
+    double remaining;
+
+    while ((remaining = deadline - hostTimeMs()) > 0)
     {
-        // Quick check to see if there are an interrupts to service
-        if (gbIO.IFLAGS > 0)
+        if (remaining > 2.0)
         {
-			if ((0x2 == gbState.cpuHalted) && ((gbIO.ISWITCH & 0x10) == 0))
-			{
-				return;
-			}
-
-            // Check the V-Blank interrupt
-            if ((gbIO.IFLAGS & INT_VBLANK) && (gbIO.ISWITCH & 0x01))
-            {
-	            //printf(">> V-Blank interrupt <<\n");
-    			
-	            gbState.IME = 0;				// Disable interrupts
-	            gbIO.IFLAGS &= ~INT_VBLANK;		// Clear bit 0 to show we're servicing request
-	            pushWordToStack(REGS.w.PC); 	// Put PC on the stack
-	            REGS.w.PC = 0x40;	            // Jump to video interrupt code
-
-                gbState.cpuHalted = 0;
-            }
-            else if ((gbIO.IFLAGS & INT_LCDC) && (gbIO.ISWITCH & 0x02))
-            {
-	            gbState.IME = 0;				// Disable interrupts
-	            gbIO.IFLAGS &= ~INT_LCDC;		// Clear bit 1 to show we're servicing request
-	            pushWordToStack(REGS.w.PC); 	// Put PC on the stack
-	            REGS.w.PC = 0x48;	            // Jump to LCD status interrupt code
-
-                gbState.cpuHalted = 0;
-            }
-            else if ((gbIO.IFLAGS & INT_TIMER) && (gbIO.ISWITCH & 0x04))
-            {
-	            gbState.IME = 0;				// Disable interrupts
-	            gbIO.IFLAGS &= ~INT_TIMER;		// Clear bit 2 to show we're servicing request
-	            pushWordToStack(REGS.w.PC); 	// Put PC on the stack
-	            REGS.w.PC = 0x50;	            // Jump to timer interrupt code
-
-                gbState.cpuHalted = 0;
-            }
-            else if ((gbIO.IFLAGS & INT_SERIAL) && (gbIO.ISWITCH & 0x08))
-            {
-	            gbState.IME = 0;				// Disable interrupts
-	            gbIO.IFLAGS &= ~INT_SERIAL;		// Clear bit 3 to show we're servicing request
-	            pushWordToStack(REGS.w.PC); 	// Put PC on the stack
-	            REGS.w.PC = 0x58;	            // Jump to serial interrupt code
-
-                gbState.cpuHalted = 0;
-            }
-            else if ((gbIO.IFLAGS & INT_HI_LO) && (gbIO.ISWITCH & 0x10))
-            {
-	            printf(">> Joystick interrupt <<\n");
-    			
-	            gbState.IME = 0;				// Disable interrupts
-	            gbIO.IFLAGS &= ~INT_HI_LO;		// Clear bit 4 to show we're servicing request
-	            pushWordToStack(REGS.w.PC);	    // Put PC on the stack
-	            REGS.w.PC = 0x60;	            // Jump to joypad interrupt code
-
-                gbState.cpuHalted = 0;
-            }
+            SDL_Delay((Uint32)(remaining - 1.0));
         }
     }
 }
 
-void updateTimers(Uint32 cycles)
-{
-	gbState.divideRegister += cycles;
-
-	// Divide register
-	if (gbState.divideRegister >= 0xFF)
-	{
-		gbState.divideRegister = 0;
-		gbIO.DIVIDER++;
-	}
-
-	// Is timer running
-	if (gbIO.TIMECONT & (1 << 2))
-	{
-		gbState.timerPeriod -= cycles;
-
-		// Has the timer reached it's trigger point yet?
-		if (gbState.timerPeriod <= 0)
-		{
-			uint8_t freq = gbIO.TIMECONT & 0x03;
-			
-			// Refresh the timer
-			switch (freq)
-			{
-				case 0: gbState.timerPeriod += 1024 ; break ; // freq 4096
-				case 1: gbState.timerPeriod += 16 ; break ;// freq 262144
-				case 2: gbState.timerPeriod += 64 ; break ;// freq 65536
-				case 3: gbState.timerPeriod += 256 ; break ;// freq 16382
-			}
-
-			if (0xFF == gbIO.TIMECNT)
-			{
-				gbIO.TIMECNT = gbIO.TIMEMOD;
-				
-				// Set timer interrupt
-				gbIO.IFLAGS |= (1 << 2);
-			}
-			else
-			{
-				gbIO.TIMECNT++;
-			}
-		}
-	}
-}
-
-uint8_t getJoypadState(void)
+// Hold the emulation back until the audio device has played enough of what
+// it has been given, or give up after a few frames if it has stalled
+static void waitForAudio(double allowedAhead)
 {
-	uint8_t state = 0x0F;
-
-	// Test for direction key check
-	if ((gbIO.JOYPAD & (1 << 4)) == 0x00)
-	{
-		state = (~gbState.keysState & 0x0F);
-	}
-    // Tes for button key
-	else if ((gbIO.JOYPAD & (1 << 5)) == 0x00)
-	{
-		state = (~(gbState.keysState >> 4) & 0x0F);
-	}
+    double giveUp = hostTimeMs() + (FRAME_PERIOD_MS * 4);
+    double ahead;
 
-	//printf("Key state read, req: 0x%X, pad state: 0x%X, IO value: 0x%X\n", gbIO.JOYPAD, gbState.keysState, state);
-    //exit_with_debug();
-	return state;
+    while (((ahead = getSoundAhead()) > allowedAhead) && (hostTimeMs() < giveUp))
+    {
+        SDL_Delay((ahead > 2.0) ? (Uint32)(ahead - 1.0) : 1);
+    }
 }
 
-void gbKeyPress(int down, int key)
+// Convert the frame into the streaming texture and present it. Only the band
+// of lines that changed since the last present is uploaded, and when the frame
+// is identical nothing is done unless vsync needs the present.
+void drawFrame(void)
 {
-	int alreadySet;
-	int requestInterrupt = 0;
-
-	alreadySet = (gbState.keysState >> key) & 0x1;
+	const uint8_t* frameBuffer;
+	int firstLine = 0;
+	int lastLine = GB_DISPLAY_HEIGHT;
+	int changed = TRUE;
+	SDL_Rect dirtyRect;
+	void* pixels;
+	int pitch;
 
-	//printf("gbKeyPress down: %i, key: %i, set %i\n", down, key, alreadySet);
-
-	if (1 == down)
+	if (showTilemap)
 	{
-		gbState.keysState |= (1 << key);
+		drawTilemap(tilemapBuffer);
+		frameBuffer = tilemapBuffer;
 	}
 	else
 	{
-		gbState.keysState &= ~(1 << key);
+		frameBuffer = getFrameBuffer();
+		changed = collectDirtyLines(&firstLine, &lastLine);
 	}
 
-	if (key > 3)
+	// The window contents may have been lost, or were showing something else
+	if (forceRedraw)
 	{
-		if (!(gbIO.JOYPAD & (1 << 5)))
-		{
-			requestInterrupt = 1;
-		}
+		firstLine = 0;
+		lastLine = GB_DISPLAY_HEIGHT;
+		changed = TRUE;
+		forceRedraw = FALSE;
 	}
-	else
+
+	if (changed)
 	{
-		if (!(gbIO.JOYPAD & (1 << 4)))
+		dirtyRect.x = 0;
+		dirtyRect.y = firstLine;
+		dirtyRect.w = GB_DISPLAY_WIDTH;
+		dirtyRect.h = lastLine - firstLine;
+
+		// The core renders colour indices, turn them into pixels straight in
+		// the texture now that the frame is actually going to be shown
+		if (0 == SDL_LockTexture(gbTexture, &dirtyRect, &pixels, &pitch))
 		{
-			requestInterrupt = 1;
+			convertFrameToARGB8888(frameBuffer, pixels, pitch, firstLine, lastLine - firstLine);
+			SDL_UnlockTexture(gbTexture);
 		}
 	}
 
-	if ((1 == requestInterrupt) && (0 == alreadySet))
+	// With vsync presenting is what paces us, so it happens every frame. The
+	// back buffer is undefined after each present so it is always redrawn,
+	// the texture still holds the last frame when nothing changed.
+	if (changed || (PACE_VSYNC == pacing))
 	{
-		gbIO.IFLAGS |= (1 << 4);
+		SDL_RenderClear(renderer);
+		SDL_RenderCopy(renderer, gbTexture, NULL, NULL);
+
+		SDL_RenderPresent(renderer);
 	}
+    
+    frames++;
 }
 
-// For some reason we need to do this otherwise Cygwin spits out undefined
-// reference to_WinMain@16 errors
-#undef main
+// Cycles left to run in the current frame, instructions overrun the end of
+// a frame so this carries the difference into the next one
+static int cycleBudget = 0;
 
-int main(int argc, char *argv[])
+// Instructions run since power on, for the benchmark
+static uint64_t instructionsExecuted = 0;
+
+static int profiling = FALSE;
+
+// Host time spent in each part of the hardware, only gathered when the
+// benchmark asks for it as reading the counter this often isn't free
+typedef struct
 {
-    int cycle_count = 0;
-    int cyclesExecuted;
-	int arg_pos = 1;
-	char* romFile = NULL;
-	int fullscreen = FALSE;
-	Uint32 videoFlags;
-    
-    Uint32 lastDelayTime;
+    double ppu;
+    double timers;
+    double interrupts;
+    double dma;
+    double sound;
+} hardwareTimes;
+
+static int timeHardware = FALSE;
+static hardwareTimes hwTimes;
+
+#ifdef GAMEBOY_STATS
+#define STATS_TIMING	TRUE
+#else
+#define STATS_TIMING	FALSE
+#endif
 
-    int ii;
+#define TIMED_UPDATE(call, total, timer) \
+    if (timeHardware || STATS_TIMING) \
+    { \
+        Uint64 updateTicks = SDL_GetPerformanceCounter(); \
+        call; \
+        updateTicks = SDL_GetPerformanceCounter() - updateTicks; \
+        total += (updateTicks * 1000.0) / SDL_GetPerformanceFrequency(); \
+        STATS_ADD_TIME(timer, updateTicks); \
+    } \
+    else \
+    { \
+        call; \
+    }
 
-    SDL_Event sdl_event;
+// Run the CPU and the rest of the hardware for one frame's worth of cycles
+static void runFrame(void)
+{
+    int cyclesExecuted;
+#ifdef GAMEBOY_STATS
+    Uint64 frameTicks = SDL_GetPerformanceCounter();
+#endif
 
-	// Force DirectX
-	//SDL_putenv("SDL_VIDEODRIVER=directx");
-	
-    printf("\nDoGoBoy - Portable Game Boy Emulator - (c)2009-2013 Douglas Gore\n\n");
+    cycleBudget += CYCLES_PER_FRAME;
 
-    if (argc < 2)
-    {
-        printf("No ROM image specified, please provide a ROM filename on the command line\n");
-        return 1;
-    }
-	
-	while(arg_pos < argc)
-	{
-		if(strcmp(argv[arg_pos], "-f") == 0)
-		{
-			fullscreen = TRUE;
-		}
-		else if(strncmp(argv[arg_pos], "-s", 2) == 0)
-		{
-			scaleFactor = argv[arg_pos][2] - '0';
-			
-			if (!(scaleFactor > 0) && !(scaleFactor <= 9))
-			{
-				printf("ERROR: scale factor must be between 1 and 9\n");
-				exit(0);
-			}
-		}
-		else
-		{
-			romFile = argv[arg_pos];
-		}
-		
-		arg_pos++;
-	}
-	
-	// Initialise SDL with modules we need
-    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER | SDL_INIT_JOYSTICK) != 0)
+    // Run our CPU for the duration of one frame of video
+    while(cycleBudget > 0)
     {
-        printf("ERROR: Could not initialise SDL\n");
-        return 1;
+        //writeLog("LCDSTAT: 0x%X, LCDCONT: 0x%X, LCDY: %d\n", gbIO.LCDSTAT, gbIO.LCDCONT, gbIO.CURLINE);
+
+        // Only execute CPU commands while the CPU is active
+        if (0x00 == gbState.cpuHalted)
+        {
+            uint16_t pc = REGS.w.PC;
+
+            cyclesExecuted = executeOpcode();
+            instructionsExecuted++;
+            STATS_ADD(instructions, 1);
+
+            if (profiling)
+            {
+                profileInstruction(pc, cyclesExecuted);
+            }
+        }
+        else
+        {
+            // Nothing can wake the CPU before the next timer or LCD
+            // event, so jump straight to it
+            uint64_t nextEvent = (gbState.timerEventCycle < gbState.lcdEventCycle) ? gbState.timerEventCycle : gbState.lcdEventCycle;
+            uint64_t idleCycles;
+
+            if (gbState.dmaEventCycle < nextEvent)
+            {
+                nextEvent = gbState.dmaEventCycle;
+            }
+
+            idleCycles = (nextEvent > gbState.cycles) ? (nextEvent - gbState.cycles) : 0;
+
+            if (idleCycles > (uint64_t)cycleBudget)
+            {
+                idleCycles = cycleBudget;
+            }
+
+            cyclesExecuted = (idleCycles > 4) ? (int)idleCycles : 4;
+
+            STATS_ADD(haltedCycles, cyclesExecuted);
+            STATS_ADD(idleSkippedCycles, (idleCycles > 4) ? idleCycles : 0);
+
+            if (profiling)
+            {
+                profileHalted(cyclesExecuted);
+            }
+        }
+
+        cycleBudget -= cyclesExecuted;
+        gbState.cycles += cyclesExecuted;
+
+        // Run all the hardware functions, the timer, LCD and DMA only
+        // need a look in when their next event is due
+        if (gbState.cycles >= gbState.timerEventCycle)
+        {
+            TIMED_UPDATE(updateTimers(), hwTimes.timers, STATS_TIME_TIMERS);
+        }
+
+        if (gbState.cycles >= gbState.lcdEventCycle)
+        {
+            TIMED_UPDATE(updateGraphics(), hwTimes.ppu, STATS_TIME_PPU);
+        }
+
+        if (gbState.cycles >= gbState.dmaEventCycle)
+        {
+            TIMED_UPDATE(updateDma(), hwTimes.dma, STATS_TIME_DMA);
+        }
+
+        if (gbState.interruptCheck)
+        {
+            TIMED_UPDATE(doInterrupts(), hwTimes.interrupts, STATS_TIME_INTERRUPTS);
+        }
     }
-	
+
+    // Render the rest of the frame's sound in one go
+    TIMED_UPDATE(updateSound(), hwTimes.sound, STATS_TIME_SOUND);
+
+#ifdef GAMEBOY_STATS
+    statsEndFrame(SDL_GetPerformanceCounter() - frameTicks);
+#endif
+}
+
+// Open the window, renderer and joystick
+static int createWindow(int fullscreen, int vsync)
+{
+	Uint32 videoFlags;
+
 	videoFlags = SDL_WINDOW_SHOWN;
 
 	// Set full screen mode flag (no HW acceleration without it)
@@ -395,44 +413,29 @@ int main(int argc, char *argv[])
 	}
 	
 	// Configure video output to 160x144 (GB resolution) at 32bpp
-	SDL_CreateWindowAndRenderer(GB_DISPLAY_WIDTH * scaleFactor,
-								  GB_DISPLAY_HEIGHT * scaleFactor,
-                          		  videoFlags,
-								  &screen,
-								  &renderer);
+	screen = SDL_CreateWindow("DoGoBoy",
+							  SDL_WINDOWPOS_UNDEFINED,
+							  SDL_WINDOWPOS_UNDEFINED,
+							  GB_DISPLAY_WIDTH * scaleFactor,
+							  GB_DISPLAY_HEIGHT * scaleFactor,
+							  videoFlags);
 
 	if (!screen)
 	{
 		printf("ERROR: Failed to create a valid screen buffer\n");
-		return 0;
+		return FALSE;
 	}
 
-	SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
-
-    Uint32 rmask, gmask, bmask, amask;
-
-    /* SDL interprets each pixel as a 32-bit number, so our masks must depend
-       on the endianness (byte order) of the machine */
-#if SDL_BYTEORDER == SDL_BIG_ENDIAN
-    rmask = 0xff000000;
-    gmask = 0x00ff0000;
-    bmask = 0x0000ff00;
-    amask = 0x000000ff;
-#else
-    rmask = 0x000000ff;
-    gmask = 0x0000ff00;
-    bmask = 0x00ff0000;
-    amask = 0xff000000;
-#endif
+	renderer = SDL_CreateRenderer(screen, -1, vsync ? SDL_RENDERER_PRESENTVSYNC : 0);
 
-	gbSurface = SDL_CreateRGBSurface(0, GB_DISPLAY_WIDTH, GB_DISPLAY_HEIGHT, 32, rmask, gmask, bmask, 0 /*amask*/);
-
-	if (!gbSurface)
+	if (!renderer)
 	{
-		printf("ERROR: Failed to create offscreen surface\n");
-		return 0;
+		printf("ERROR: Failed to create a renderer\n");
+		return FALSE;
 	}
 
+	SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+
 	gbTexture = SDL_CreateTexture(renderer,
 								SDL_PIXELFORMAT_ARGB8888,
 								SDL_TEXTUREACCESS_STREAMING,
@@ -441,16 +444,33 @@ int main(int argc, char *argv[])
 	SDL_JoystickEventState(SDL_ENABLE);
 	joystick = SDL_JoystickOpen(0);
 
+	return TRUE;
+}
+
+// Bring the whole machine up as if it had just been switched on with the
+// ROM inserted, the benchmark also uses this to start each run afresh
+static void powerOn(char* romFile)
+{
+    int ii;
+
+    memset(&gbState, 0, sizeof(gbState));
+    memset(&gbIO, 0, sizeof(gbIO));
+
     // Load ROM image from disk
+    initGbMemory();
     loadRom(romFile);
 
 	// Initialise the CPU to a known state
     initCPU();
 
-	gbState.IME = 0;
-    gbState.lcdMode = 0;
-    gbState.lcdModePeriod = LCD_MODE0_PERIOD;
-    gbState.currentRomBank = 1;
+	setInterruptMaster(0);
+    gbState.cycles = 0;
+    cycleBudget = 0;
+    instructionsExecuted = 0;
+    resetEmulatorStats();
+    initTimers();
+    initGraphics();
+    resetSound();
 	gbState.keysState = 0;
 
 	// Below is some initialisation values for the GB I read about somewhere
@@ -500,39 +520,403 @@ int main(int argc, char *argv[])
         opcode_coverage[ii] = 0;
         cb_opcode_coverage[ii] = 0;
     }
-	
-	setDrawFrameFunction(&drawFrame);
+}
 
-    last_time = SDL_GetTicks();
-    lastDelayTime = SDL_GetTicks();
+// Frames aren't shown when running headless, only counted
+static void countFrame(void)
+{
+    frames++;
+}
 
-    // Loop forever (for loops are more efficient than while)
-    for(;;)
-	{
-        cycle_count += CYCLES_PER_FRAME;
+// Run a fixed number of frames as fast as possible without any window
+static void runHeadless(int frameCount)
+{
+    double start = hostTimeMs();
+    double elapsed;
+    int ii;
+
+    for (ii = 0; ii < frameCount; ii++)
+    {
+        runFrame();
+    }
+
+    elapsed = (hostTimeMs() - start) / 1000.0;
+
+    printf("Ran %d frames (%.1fs emulated) in %.2fs, %.1fx real time\n",
+           frameCount, (frameCount * FRAME_PERIOD_MS) / 1000.0, elapsed,
+           ((frameCount * FRAME_PERIOD_MS) / 1000.0) / elapsed);
+}
+
+// Summary of one measurement over all the benchmark runs
+typedef struct
+{
+    double median;
+    double mean;
+    double stddev;
+    double min;
+    double max;
+} benchStats;
+
+static int compareDoubles(const void* a, const void* b)
+{
+    double da = *(const double*)a;
+    double db = *(const double*)b;
+
+    return (da > db) - (da < db);
+}
+
+// Sorts the samples in place
+static benchStats summarise(double* samples, int count)
+{
+    benchStats stats;
+    double sum = 0.0;
+    double squares = 0.0;
+    int ii;
+
+    qsort(samples, count, sizeof(double), compareDoubles);
+
+    for (ii = 0; ii < count; ii++)
+    {
+        sum += samples[ii];
+    }
+
+    stats.mean = sum / count;
+
+    for (ii = 0; ii < count; ii++)
+    {
+        squares += (samples[ii] - stats.mean) * (samples[ii] - stats.mean);
+    }
+
+    stats.stddev = (count > 1) ? sqrt(squares / (count - 1)) : 0.0;
+    stats.median = (count & 1) ? samples[count / 2] : (samples[(count / 2) - 1] + samples[count / 2]) / 2.0;
+    stats.min = samples[0];
+    stats.max = samples[count - 1];
+
+    return stats;
+}
+
+static void printStats(const char* name, benchStats stats)
+{
+    printf("\"%s\":{\"median\":%.3f,\"mean\":%.3f,\"stddev\":%.3f,\"min\":%.3f,\"max\":%.3f}",
+           name, stats.median, stats.mean, stats.stddev, stats.min, stats.max);
+}
+
+// Run the ROM from power on for a number of frames, repeatedly and without
+// any pacing, then print the results as a single line of JSON. The last run
+// is timed per hardware module, which slows it down, so it is kept out of
+// the rates and only used for how the time is split.
+static void runBenchmark(char* romFile, int frameCount, int runs)
+{
+    double fps[BENCH_MAX_RUNS];
+    double mips[BENCH_MAX_RUNS];
+    double cyclesPerSecond[BENCH_MAX_RUNS];
+    double realTime[BENCH_MAX_RUNS];
+    double start;
+    double elapsed = 0.0;
+    double hardware;
+    const char* cc;
+    int run;
+    int ii;
+
+    for (run = 0; run <= runs; run++)
+    {
+        freeGbMemory();
+        powerOn(romFile);
+
+        timeHardware = (run == runs);
+        memset(&hwTimes, 0, sizeof(hwTimes));
 
-        // Run our CPU for the duration of one frame of video
-        while(cycle_count > 0)
+        start = hostTimeMs();
+
+        for (ii = 0; ii < frameCount; ii++)
         {
-            //writeLog("LCDSTAT: 0x%X, LCDCONT: 0x%X, LCDY: %d\n", gbIO.LCDSTAT, gbIO.LCDCONT, gbIO.CURLINE);
+            runFrame();
+        }
 
-			// Only execute CPU commands while the CPU is active
-            if (0x00 == gbState.cpuHalted)
-            {
-                cyclesExecuted = executeOpcode();
-            }
-            else
-            {
-                cyclesExecuted = 4;
-            }
-    		
-            cycle_count -= cyclesExecuted;
+        elapsed = hostTimeMs() - start;
 
-            // Run all the hardware functions
-			updateTimers(cyclesExecuted);
-            updateGraphics(gbSurface, cyclesExecuted);
-            doInterrupts();
+        if (run < runs)
+        {
+            fps[run] = (frameCount * 1000.0) / elapsed;
+            mips[run] = instructionsExecuted / (elapsed * 1000.0);
+            cyclesPerSecond[run] = (gbState.cycles * 1000.0) / elapsed;
+            realTime[run] = (frameCount * FRAME_PERIOD_MS) / elapsed;
+
+            fprintf(stderr, "Run %d: %.1f fps, %.2f MIPS\n", run + 1, fps[run], mips[run]);
         }
+    }
+
+    timeHardware = FALSE;
+    hardware = hwTimes.ppu + hwTimes.timers + hwTimes.interrupts + hwTimes.dma + hwTimes.sound;
+
+    printf("{\"rom\":\"");
+
+    for (cc = romFile; *cc; cc++)
+    {
+        if (('"' == *cc) || ('\\' == *cc))
+        {
+            printf("\\%c", *cc);
+        }
+        else if ((unsigned char)*cc >= 0x20)
+        {
+            putchar(*cc);
+        }
+    }
+
+    printf("\",\"frames\":%d,\"runs\":%d,", frameCount, runs);
+    printStats("fps", summarise(fps, runs));
+    printf(",");
+    printStats("mips", summarise(mips, runs));
+    printf(",");
+    printStats("cycles_per_second", summarise(cyclesPerSecond, runs));
+    printf(",");
+    printStats("real_time_factor", summarise(realTime, runs));
+    printf(",\"time_split_ms\":{\"cpu\":%.3f,\"ppu\":%.3f,\"timers\":%.3f,\"interrupts\":%.3f,\"dma\":%.3f,\"sound\":%.3f}",
+           elapsed - hardware, hwTimes.ppu, hwTimes.timers, hwTimes.interrupts, hwTimes.dma, hwTimes.sound);
+    printf(",\"time_split_percent\":{\"cpu\":%.2f,\"ppu\":%.2f,\"timers\":%.2f,\"interrupts\":%.2f,\"dma\":%.2f,\"sound\":%.2f}}\n",
+           ((elapsed - hardware) * 100.0) / elapsed, (hwTimes.ppu * 100.0) / elapsed, (hwTimes.timers * 100.0) / elapsed,
+           (hwTimes.interrupts * 100.0) / elapsed, (hwTimes.dma * 100.0) / elapsed, (hwTimes.sound * 100.0) / elapsed);
+    fflush(stdout);
+}
+
+// For some reason we need to do this otherwise Cygwin spits out undefined
+// reference to_WinMain@16 errors
+#undef main
+
+int main(int argc, char *argv[])
+{
+	int arg_pos = 1;
+	char* romFile = NULL;
+	int fullscreen = FALSE;
+	int renderThreaded = FALSE;
+	int timedDma = FALSE;
+	int rtcHostTime = TRUE;
+	int soundOutput = TRUE;
+	int vsync = FALSE;
+	int headless = FALSE;
+	int headlessFrames = HEADLESS_FRAMES;
+	int bench = FALSE;
+	int benchRuns = BENCH_RUNS;
+	int statsInterval = 0;
+	profileMode profile = PROFILE_OFF;
+	char* profileFile = NULL;
+	char* captureFile = NULL;
+    
+    double nextFrameTime;
+    double behindTime;
+    double currentTime;
+    int framesSinceSkipChange = 0;
+
+    SDL_Event sdl_event;
+
+	// Force DirectX
+	//SDL_putenv("SDL_VIDEODRIVER=directx");
+	
+    printf("\nDoGoBoy - Portable Game Boy Emulator - (c)2009-2013 Douglas Gore\n\n");
+
+    if (argc < 2)
+    {
+        printf("No ROM image specified, please provide a ROM filename on the command line\n");
+        return 1;
+    }
+	
+	while(arg_pos < argc)
+	{
+		if(strcmp(argv[arg_pos], "-f") == 0)
+		{
+			fullscreen = TRUE;
+		}
+		else if(strcmp(argv[arg_pos], "-ka") == 0)
+		{
+			autoFrameSkip = TRUE;
+		}
+		else if(strncmp(argv[arg_pos], "-k", 2) == 0)
+		{
+			frameSkip = argv[arg_pos][2] - '0';
+
+			if ((frameSkip < 0) || (frameSkip > 9))
+			{
+				printf("ERROR: frame skip must be between 0 and 9, or 'a' for automatic\n");
+				exit(0);
+			}
+		}
+		else if(strcmp(argv[arg_pos], "-t") == 0)
+		{
+			renderThreaded = TRUE;
+		}
+		else if(strcmp(argv[arg_pos], "-d") == 0)
+		{
+			timedDma = TRUE;
+		}
+		else if(strcmp(argv[arg_pos], "-b") == 0)
+		{
+			bankStats = TRUE;
+		}
+		else if(strcmp(argv[arg_pos], "-rh") == 0)
+		{
+			rtcHostTime = TRUE;
+		}
+		else if(strcmp(argv[arg_pos], "-re") == 0)
+		{
+			rtcHostTime = FALSE;
+		}
+		else if(strcmp(argv[arg_pos], "-q") == 0)
+		{
+			soundOutput = FALSE;
+		}
+		else if(strcmp(argv[arg_pos], "-lq") == 0)
+		{
+			setResampleQuality(RESAMPLE_LINEAR);
+		}
+		else if(strcmp(argv[arg_pos], "-v") == 0)
+		{
+			vsync = TRUE;
+		}
+		else if(strcmp(argv[arg_pos], "--headless") == 0)
+		{
+			headless = TRUE;
+		}
+		else if(strcmp(argv[arg_pos], "--bench") == 0)
+		{
+			bench = TRUE;
+			headless = TRUE;
+			soundOutput = FALSE;
+		}
+		else if((strcmp(argv[arg_pos], "--runs") == 0) && (arg_pos + 1 < argc))
+		{
+			benchRuns = atoi(argv[++arg_pos]);
+		}
+		else if((strcmp(argv[arg_pos], "--stats") == 0) && (arg_pos + 1 < argc))
+		{
+			statsInterval = atoi(argv[++arg_pos]);
+
+			if (!statsAvailable())
+			{
+				printf("ERROR: this build has no stats, rebuild with GAMEBOY_STATS defined\n");
+				return 1;
+			}
+		}
+		else if((strcmp(argv[arg_pos], "--profile") == 0) && (arg_pos + 2 < argc))
+		{
+			arg_pos++;
+
+			if (strcmp(argv[arg_pos], "exact") == 0)
+			{
+				profile = PROFILE_EXACT;
+			}
+			else if (strcmp(argv[arg_pos], "sample") == 0)
+			{
+				profile = PROFILE_SAMPLE;
+			}
+			else
+			{
+				printf("ERROR: profile mode must be 'exact' or 'sample'\n");
+				return 1;
+			}
+
+			profileFile = argv[++arg_pos];
+		}
+		else if((strcmp(argv[arg_pos], "--frames") == 0) && (arg_pos + 1 < argc))
+		{
+			headlessFrames = atoi(argv[++arg_pos]);
+		}
+		else if((strcmp(argv[arg_pos], "--capture") == 0) && (arg_pos + 1 < argc))
+		{
+			captureFile = argv[++arg_pos];
+		}
+		else if(strncmp(argv[arg_pos], "-s", 2) == 0)
+		{
+			scaleFactor = argv[arg_pos][2] - '0';
+			
+			if (!(scaleFactor > 0) && !(scaleFactor <= 9))
+			{
+				printf("ERROR: scale factor must be between 1 and 9\n");
+				exit(0);
+			}
+		}
+		else
+		{
+			romFile = argv[arg_pos];
+		}
+		
+		arg_pos++;
+	}
+	
+	if ((benchRuns < 1) || (benchRuns > BENCH_MAX_RUNS) || (headlessFrames < 1))
+	{
+		printf("ERROR: benchmark runs must be between 1 and %d, and frames at least 1\n", BENCH_MAX_RUNS);
+		return 1;
+	}
+
+	// Initialise SDL with modules we need, running headless needs no video
+    if (SDL_Init(headless ? SDL_INIT_TIMER : (SDL_INIT_VIDEO | SDL_INIT_TIMER | SDL_INIT_JOYSTICK)) != 0)
+    {
+        printf("ERROR: Could not initialise SDL\n");
+        return 1;
+    }
+	
+	if (!headless && !createWindow(fullscreen, vsync))
+	{
+		return 0;
+	}
+
+	// Headless runs and benchmarks must be repeatable, so run on emulated
+	// time from a blank cartridge RAM and never touch the save file
+	if (headless)
+	{
+		rtcHostTime = FALSE;
+		setBatterySaves(FALSE);
+	}
+
+	setTimedDma(timedDma);
+	setRtcHostTime(rtcHostTime);
+
+	// The audio clock paces the emulation when there is one, unless vsync
+	// has been asked for, in which case the sound is resampled to follow
+	if (vsync)
+	{
+		pacing = PACE_VSYNC;
+	}
+
+	// Headless runs are never played, but may be captured
+	if (initSound(soundOutput && !headless, captureFile) && !vsync)
+	{
+		pacing = PACE_AUDIO;
+	}
+
+	powerOn(romFile);
+	setStatsInterval(statsInterval);
+
+	// Benchmark runs restart the machine, so aren't profiled
+	if (!bench)
+	{
+		initProfiler(profile, profileFile);
+		profiling = (PROFILE_OFF != profile);
+	}
+
+	setDrawFrameFunction(headless ? &countFrame : &drawFrame);
+	setRenderThreaded(renderThreaded);
+	setFrameSkip(frameSkip);
+
+    last_time = SDL_GetTicks();
+    nextFrameTime = hostTimeMs();
+
+    if (bench)
+    {
+        runBenchmark(romFile, headlessFrames, benchRuns);
+        goto quit_app;
+    }
+
+    if (headless)
+    {
+        runHeadless(headlessFrames);
+        goto quit_app;
+    }
+
+    // Loop forever (for loops are more efficient than while)
+    for(;;)
+	{
+        runFrame();
 
         // Process all pending events e.g. keypreses
         while(SDL_PollEvent(&sdl_event))
@@ -547,7 +931,10 @@ int main(int argc, char *argv[])
                     exit_with_debug();
                 break;
 				
-				case SDLK_F1	: showTilemap = (showTilemap == TRUE) ? FALSE : TRUE; break;
+				case SDLK_F1	:
+					showTilemap = (showTilemap == TRUE) ? FALSE : TRUE;
+					forceRedraw = TRUE;
+				break;
 
                 case SDLK_RIGHT : gbKeyPress(1, 0); break;
                 case SDLK_LEFT  : gbKeyPress(1, 1); break;
@@ -643,6 +1030,18 @@ int main(int argc, char *argv[])
 			}
 			break;
 
+			// Window needs repainting even if the frame hasn't changed
+			case SDL_WINDOWEVENT:
+				switch (sdl_event.window.event)
+				{
+					case SDL_WINDOWEVENT_EXPOSED:
+					case SDL_WINDOWEVENT_SIZE_CHANGED:
+					case SDL_WINDOWEVENT_RESTORED:
+						forceRedraw = TRUE;
+					break;
+				}
+			break;
+
             case SDL_QUIT:
                 printf("Terminating application\n");
                 goto quit_app;
@@ -654,18 +1053,87 @@ int main(int argc, char *argv[])
             }
         }
 
-        // Keep the frame rate locked to an upper limit of 60 FPS
-        if ((SDL_GetTicks() - lastDelayTime) <= (1000 / 60))
+        // Keep the emulation running in real time. The timer works to a
+        // running deadline so we also know how far behind we are, with audio
+        // we're behind when the device is about to run out.
+        nextFrameTime += FRAME_PERIOD_MS;
+        currentTime = hostTimeMs();
+        behindTime = 0;
+
+        switch (pacing)
         {
-            SDL_Delay((1000 / 60) - (SDL_GetTicks() - lastDelayTime));
+        case PACE_AUDIO:
+            // The wait polls every millisecond so anything less is on time
+            waitForAudio(0);
+            behindTime = -getSoundAhead();
+
+            if (behindTime < 1.0)
+            {
+                behindTime = 0;
+            }
+            break;
+
+        case PACE_VSYNC:
+            // Presenting normally blocks, these only catch frames where
+            // nothing was presented, e.g. while the LCD is off
+            waitForAudio(FRAME_PERIOD_MS);
+
+            if (currentTime < (nextFrameTime - FRAME_PERIOD_MS))
+            {
+                waitUntil(nextFrameTime - FRAME_PERIOD_MS);
+            }
+            else if (currentTime > nextFrameTime)
+            {
+                nextFrameTime = currentTime;
+            }
+            break;
+
+        default:
+            if (currentTime < nextFrameTime)
+            {
+                waitUntil(nextFrameTime);
+            }
+            else
+            {
+                behindTime = currentTime - nextFrameTime;
+            }
+            break;
+        }
+
+        if (behindTime < 0)
+        {
+            behindTime = 0;
         }
 
-        lastDelayTime = SDL_GetTicks();
+        // Skip more frames while we're more than a frame late, and fewer once
+        // we've been keeping up for a second. Only change once per skip cycle
+        // so each setting gets a chance to take effect.
+        if (autoFrameSkip && (++framesSinceSkipChange > frameSkip))
+        {
+            if ((behindTime > FRAME_PERIOD_MS) && (frameSkip < MAX_FRAME_SKIP))
+            {
+                frameSkip++;
+                framesSinceSkipChange = 0;
+            }
+            else if ((0 == behindTime) && (frameSkip > 0) && (framesSinceSkipChange >= 60))
+            {
+                frameSkip--;
+                framesSinceSkipChange = 0;
+            }
+
+            setFrameSkip(frameSkip);
+        }
+
+        // Don't try to make up time lost to a long stall (e.g. window drag)
+        if (behindTime > (FRAME_PERIOD_MS * 10))
+        {
+            nextFrameTime = currentTime;
+        }
 
         // Record the number of frames per second
         if ((SDL_GetTicks() - last_time) >= 1000)
         {
-            sprintf(window_title, "DoGoBoy FPS: %d", frames);
+            sprintf(window_title, "DoGoBoy FPS: %d Skip: %d%s Lines: %d", frames, frameSkip, autoFrameSkip ? " (auto)" : "", getChangedLineCount());
 
             SDL_SetWindowTitle(screen, window_title);
 
@@ -675,6 +1143,24 @@ int main(int argc, char *argv[])
 	}
 
 quit_app:
+	setRenderThreaded(FALSE);
+
+	// Totals for the whole run
+	if (statsInterval)
+	{
+		emulatorStats stats;
+
+		getEmulatorStats(&stats);
+		printEmulatorStats(stderr, &stats);
+	}
+
+	if (bankStats)
+	{
+		printBankStats();
+	}
+
+	closeProfiler();
+	closeSound();
 	freeGbMemory();
 
     SDL_Quit();
@@ -34,7 +34,9 @@ Memory related emulation functions
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <memory.h>
+#include <time.h>
 
 #include "gameboy.h"
 
@@ -43,14 +45,473 @@ uint8_t WRAMbank1[0x1000];	    // 4KB WRAM bank 1
 uint8_t VRAMbank[0x2000];      	// 8 KB VRAM bank
 uint8_t HRAMbank[0x80];			// 128B HRAM
 uint8_t OAMbank[0xA0];		    // 160B OAM
-uint8_t WFbank[0x10];			// Waveform RAM
 
-uint8_t* cartData = NULL;
+const uint8_t* cartData = NULL;
 uint8_t* switchRAM;
-uint8_t* switchRAMPtr;
+
+static char saveFile[FILENAME_MAX];
+
+static size_t romLength;
+
+// How many times each ROM bank has been switched in
+static uint32_t* bankSelects = NULL;
+
+// The address space split into 4KB pages. A page that is plain memory points
+// straight at the host memory behind it, NULL sends the access down the slow
+// path (MBC registers, VRAM, OAM, I/O and anything else with side effects).
+// Bank switches only swap the pointers.
+#define MEMORY_PAGE_SHIFT		12
+#define MEMORY_PAGE_MASK		0x0FFF
+#define MEMORY_PAGES			16
+
+static const uint8_t* readMap[MEMORY_PAGES];
+static uint8_t* writeMap[MEMORY_PAGES];
+
+// MBC2 has 512 half-bytes of RAM built in
+#define MBC2_RAM_SIZE			0x200
+
+typedef uint8_t (*ioReadHandler)(void);
+typedef void (*ioWriteHandler)(uint8_t value);
+
+// Handlers for the I/O ports at 0xFF00-0xFF7F, only registers with side
+// effects have one. The rest read and write straight through gbIO.regs,
+// apart from the sound registers which go to the sound module.
+static ioReadHandler ioRead[0x80];
+static ioWriteHandler ioWrite[0x80];
+
+// 160 machine cycles to copy the 160 bytes of OAM
+#define DMA_TRANSFER_CYCLES		640
+
+static int timedDma = 0;
+static uint16_t dmaSource;
 
 static void dmaTransfer(uint16_t address);
 
+// Offset into external RAM of the selected bank, or -1 when the bank
+// registers point at nothing that can be mapped directly
+static int externalRamOffset(void)
+{
+    if (!gbState.ramEnabled || (0 == gbState.ramSize) || (gbState.currentRamBank >= gbState.ramBanks))
+    {
+        return -1;
+    }
+
+    return gbState.currentRamBank * 0x2000;
+}
+
+// Point the page tables at the currently selected banks. Called whenever a
+// bank register changes, so the accesses themselves never have to look at
+// the MBC state.
+static void updateMemoryMap(void)
+{
+    const uint8_t* romBank0 = &cartData[gbState.currentRomBank0 * 0x4000];
+    const uint8_t* romBankS = &cartData[gbState.currentRomBank * 0x4000];
+    int ramOffset = externalRamOffset();
+    int ii;
+
+    for (ii = 0; ii < MEMORY_PAGES; ii++)
+    {
+        readMap[ii] = NULL;
+        writeMap[ii] = NULL;
+    }
+
+    // Only the I/O ports and HRAM can be reached during a timed DMA
+    if (gbState.dmaActive)
+    {
+        return;
+    }
+
+    for (ii = 0; ii < 4; ii++)
+    {
+        readMap[0x0 + ii] = &romBank0[ii << MEMORY_PAGE_SHIFT];
+        readMap[0x4 + ii] = &romBankS[ii << MEMORY_PAGE_SHIFT];
+    }
+
+    // VRAM writes have to be seen by the renderer first
+    readMap[0x8] = &VRAMbank[0x0000];
+    readMap[0x9] = &VRAMbank[0x1000];
+
+    // MBC2 RAM and smaller than 8KB RAM need the slow path, as do writes
+    // to battery backed RAM so the save can be flagged as dirty
+    if ((ramOffset >= 0) && (MBC2 != gbState.mbc) && (gbState.ramSize >= 0x2000))
+    {
+        readMap[0xA] = &switchRAM[ramOffset];
+        readMap[0xB] = &switchRAM[ramOffset + 0x1000];
+
+        if (!gbState.batteryBackup)
+        {
+            writeMap[0xA] = &switchRAM[ramOffset];
+            writeMap[0xB] = &switchRAM[ramOffset + 0x1000];
+        }
+    }
+
+    readMap[0xC] = writeMap[0xC] = WRAMbank0;
+    readMap[0xD] = writeMap[0xD] = WRAMbank1;
+    readMap[0xE] = writeMap[0xE] = WRAMbank0;
+}
+
+// MBC3 clock registers, selected as RAM banks 0x08-0x0C
+enum
+{
+    RTC_SECONDS,
+    RTC_MINUTES,
+    RTC_HOURS,
+    RTC_DAY_LOW,
+    RTC_DAY_HIGH,
+    RTC_REGISTERS
+};
+
+#define RTC_DH_DAY_BIT8			0x01
+#define RTC_DH_HALT				0x40
+#define RTC_DH_CARRY			0x80
+
+#define RTC_DAY_SECONDS			86400
+#define RTC_DAYS				512
+
+// The clock isn't ticked, the time is worked out from the seconds count at
+// a base point plus however long it's been since then
+typedef struct
+{
+    uint64_t baseSeconds;		// Clock value at the base point
+    uint64_t baseCycle;			// Emulated cycle of the base point
+    time_t baseHostTime;		// Host time of the base point
+    uint8_t dayHigh;			// Halt and carry flags, bit 8 of the days lives in baseSeconds
+    uint8_t latched[RTC_REGISTERS];
+    uint8_t latchWrite;			// Last value written to the latch register
+} rtcStruct;
+
+static rtcStruct rtc;
+static int rtcHostTime = 1;
+static int batterySaves = 1;
+
+// Seconds elapsed since the clock's base point
+static uint64_t rtcElapsed(void)
+{
+    if (rtc.dayHigh & RTC_DH_HALT)
+    {
+        return 0;
+    }
+
+    if (rtcHostTime)
+    {
+        time_t now = time(NULL);
+
+        return (now > rtc.baseHostTime) ? (uint64_t)(now - rtc.baseHostTime) : 0;
+    }
+
+    return (gbState.cycles - rtc.baseCycle) / CPU_CLOCK_HZ;
+}
+
+// Move the base point up to now, keeping any part second in the base so
+// the clock doesn't lose time
+static void rtcRebase(void)
+{
+    uint64_t elapsed = rtcElapsed();
+
+    rtc.baseSeconds += elapsed;
+
+    if (rtcHostTime)
+    {
+        rtc.baseHostTime += (time_t)elapsed;
+    }
+    else
+    {
+        rtc.baseCycle += elapsed * CPU_CLOCK_HZ;
+    }
+
+    // The day counter overflows after 511, setting the sticky carry flag
+    if (rtc.baseSeconds >= ((uint64_t)RTC_DAYS * RTC_DAY_SECONDS))
+    {
+        rtc.baseSeconds %= (uint64_t)RTC_DAYS * RTC_DAY_SECONDS;
+        rtc.dayHigh |= RTC_DH_CARRY;
+    }
+}
+
+static void rtcGetRegisters(uint8_t* regs)
+{
+    uint64_t seconds;
+    unsigned int days;
+
+    rtcRebase();
+
+    seconds = rtc.baseSeconds;
+    days = (unsigned int)(seconds / RTC_DAY_SECONDS);
+
+    regs[RTC_SECONDS] = seconds % 60;
+    regs[RTC_MINUTES] = (seconds / 60) % 60;
+    regs[RTC_HOURS] = (seconds / 3600) % 24;
+    regs[RTC_DAY_LOW] = days & 0xFF;
+    regs[RTC_DAY_HIGH] = (rtc.dayHigh & (RTC_DH_HALT | RTC_DH_CARRY)) | ((days >> 8) & RTC_DH_DAY_BIT8);
+}
+
+static void rtcSetRegisters(const uint8_t* regs)
+{
+    unsigned int days = regs[RTC_DAY_LOW] | ((regs[RTC_DAY_HIGH] & RTC_DH_DAY_BIT8) << 8);
+
+    rtc.baseSeconds = (uint64_t)days * RTC_DAY_SECONDS + (regs[RTC_HOURS] * 3600) + (regs[RTC_MINUTES] * 60) + regs[RTC_SECONDS];
+    rtc.dayHigh = regs[RTC_DAY_HIGH] & (RTC_DH_HALT | RTC_DH_CARRY);
+    rtc.baseCycle = gbState.cycles;
+    rtc.baseHostTime = time(NULL);
+}
+
+// Writing 0 then 1 to 6000-7FFF copies the clock into the latched registers
+static void rtcLatch(uint8_t value)
+{
+    if ((0x00 == rtc.latchWrite) && (0x01 == value))
+    {
+        rtcGetRegisters(rtc.latched);
+    }
+
+    rtc.latchWrite = value;
+}
+
+static uint8_t rtcRead(void)
+{
+    return rtc.latched[gbState.currentRamBank - 0x08];
+}
+
+// Writes go to the live clock, which restarts the current second
+static void rtcWrite(uint8_t value)
+{
+    uint8_t regs[RTC_REGISTERS];
+
+    rtcGetRegisters(regs);
+    regs[gbState.currentRamBank - 0x08] = value;
+    rtcSetRegisters(regs);
+
+    rtc.latched[gbState.currentRamBank - 0x08] = value;
+}
+
+static int rtcSelected(void)
+{
+    return gbState.rtcPresent && gbState.ramEnabled && (gbState.currentRamBank >= 0x08) && (gbState.currentRamBank <= 0x0C);
+}
+
+void setRtcHostTime(int hostTime)
+{
+    rtcHostTime = hostTime;
+}
+
+// With saves turned off battery backed RAM starts zeroed on the heap and
+// is thrown away, leaving the save file alone
+void setBatterySaves(int saves)
+{
+    batterySaves = saves;
+}
+
+// Work out the selected banks from the MBC registers
+static void updateBanks(void)
+{
+    unsigned int romBank = gbState.mbcRomBank;
+    unsigned int romBank0 = 0;
+    unsigned int ramBank = gbState.mbcRamBank;
+
+    switch (gbState.mbc)
+    {
+    case MBC1:
+        // Bank 0 can't be selected in the switchable area, the upper two
+        // bits go to either the ROM bank or the RAM bank depending on mode
+        if (0 == (romBank & 0x1F))
+        {
+            romBank |= 1;
+        }
+
+        romBank |= (gbState.mbcRamBank & 0x03) << 5;
+
+        if (gbState.bankingMode)
+        {
+            romBank0 = (gbState.mbcRamBank & 0x03) << 5;
+        }
+        else
+        {
+            ramBank = 0;
+        }
+        break;
+
+    case MBC2:
+    case MBC3:
+        if (0 == romBank)
+        {
+            romBank = 1;
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    // The RAM bank wraps on smaller chips, except for the MBC3 clock
+    // registers which live above the RAM banks
+    if ((MBC3 != gbState.mbc) && gbState.ramBanks)
+    {
+        ramBank %= gbState.ramBanks;
+    }
+
+    romBank %= gbState.romBanks;
+    romBank0 %= gbState.romBanks;
+
+    if (romBank != gbState.currentRomBank)
+    {
+        bankSelects[romBank]++;
+    }
+
+    if (romBank0 != gbState.currentRomBank0)
+    {
+        bankSelects[romBank0]++;
+    }
+
+    if ((romBank != gbState.currentRomBank) || (romBank0 != gbState.currentRomBank0) || (ramBank != gbState.currentRamBank))
+    {
+        STATS_ADD(bankSwitches, 1);
+    }
+
+    gbState.currentRomBank = romBank;
+    gbState.currentRomBank0 = romBank0;
+    gbState.currentRamBank = ramBank;
+
+    updateMemoryMap();
+}
+
+// Handle a write to the MBC registers in the ROM area
+static void writeBankController(uint16_t address, uint8_t value)
+{
+    switch (gbState.mbc)
+    {
+    case MBC1:
+        if (address < 0x2000)
+        {
+            gbState.ramEnabled = (0x0A == (value & 0x0F));
+        }
+        else if (address < 0x4000)
+        {
+            gbState.mbcRomBank = value & 0x1F;
+        }
+        else if (address < 0x6000)
+        {
+            gbState.mbcRamBank = value & 0x03;
+        }
+        else
+        {
+            gbState.bankingMode = value & 0x01;
+        }
+        break;
+
+    case MBC2:
+        // Bit 8 of the address picks between RAM enable and ROM bank
+        if (address < 0x4000)
+        {
+            if (address & 0x0100)
+            {
+                gbState.mbcRomBank = value & 0x0F;
+            }
+            else
+            {
+                gbState.ramEnabled = (0x0A == (value & 0x0F));
+            }
+        }
+        break;
+
+    case MBC3:
+        if (address < 0x2000)
+        {
+            gbState.ramEnabled = (0x0A == (value & 0x0F));
+        }
+        else if (address < 0x4000)
+        {
+            gbState.mbcRomBank = value & 0x7F;
+        }
+        else if (address < 0x6000)
+        {
+            // 0x08-0x0C select the clock registers
+            gbState.mbcRamBank = value & 0x0F;
+        }
+        else if (gbState.rtcPresent)
+        {
+            rtcLatch(value);
+        }
+        break;
+
+    case MBC5:
+        if (address < 0x2000)
+        {
+            gbState.ramEnabled = (0x0A == (value & 0x0F));
+        }
+        else if (address < 0x3000)
+        {
+            gbState.mbcRomBank = (gbState.mbcRomBank & 0x100) | value;
+        }
+        else if (address < 0x4000)
+        {
+            gbState.mbcRomBank = (gbState.mbcRomBank & 0xFF) | ((value & 0x01) << 8);
+        }
+        else if (address < 0x6000)
+        {
+            gbState.mbcRamBank = value & 0x0F;
+        }
+        break;
+
+    default:
+        writeLog("Cannot write to ROM, address: 0x%X, value: 0x%X\n", address, value);
+        return;
+    }
+
+    updateBanks();
+}
+
+// Slow path for external RAM, anything the page table can't map directly
+static uint8_t readExternalRam(uint16_t address)
+{
+    int ramOffset = externalRamOffset();
+
+    if (rtcSelected())
+    {
+        return rtcRead();
+    }
+
+    if (ramOffset < 0)
+    {
+        return 0xFF;
+    }
+
+    if (MBC2 == gbState.mbc)
+    {
+        return 0xF0 | switchRAM[address & (MBC2_RAM_SIZE - 1)];
+    }
+
+    // Smaller RAM chips are mirrored across the bank
+    return switchRAM[ramOffset + ((address - ADDR_S_RAM_BANK) % gbState.ramSize)];
+}
+
+static void writeExternalRam(uint16_t address, uint8_t value)
+{
+    int ramOffset = externalRamOffset();
+
+    if (rtcSelected())
+    {
+        rtcWrite(value);
+        return;
+    }
+
+    if (ramOffset < 0)
+    {
+        return;
+    }
+
+    if (MBC2 == gbState.mbc)
+    {
+        switchRAM[address & (MBC2_RAM_SIZE - 1)] = value & 0x0F;
+    }
+    else
+    {
+        switchRAM[ramOffset + ((address - ADDR_S_RAM_BANK) % gbState.ramSize)] = value;
+    }
+
+    if (gbState.batteryBackup)
+    {
+        markBatteryDirty();
+    }
+}
+
 // Write a byte of data into Game Boy memory
 void writeByteToMemory(unsigned int address, uint8_t value)
 {
@@ -74,12 +535,28 @@ void writeByteToMemory(unsigned int address, uint8_t value)
                                   | select an appropriate ROM bank at
                                   | 4000-7FFF. RAM switching is not provided.
 */
+    uint8_t* page = writeMap[(address >> MEMORY_PAGE_SHIFT) & (MEMORY_PAGES - 1)];
+
+    STATS_ACCESS(address & 0xFFFF, 1);
+
+    // Plain RAM
+    if (page)
+    {
+        page[address & MEMORY_PAGE_MASK] = value;
+        return;
+    }
+
+    // Only the I/O ports and HRAM can be reached during a timed DMA
+	if (gbState.dmaActive && (address < ADDR_IO_PORTS))
+	{
+		return;
+	}
 
     // This is the interrupt enable register
 	if (address == 0xFFFF)
 	{
 		//printf("Write to interrupt enable register, value: 0x%X\n", value);
-		gbIO.ISWITCH = value;
+		writeInterruptEnable(value);
 	}
     // High RAM (HRAM) only RAM accessible during the LCD blanking period
 	else if ((address >= 0xFF80) && (address < 0xFFFF))
@@ -91,213 +568,21 @@ void writeByteToMemory(unsigned int address, uint8_t value)
 	else if ((address >= ADDR_IO_PORTS) && (address < 0xFF80))
 	{
 		//printf("Write to I/O port 0x%X value 0x%X\n", address, value);
-		
-		switch(address)
+		ioWriteHandler handler = ioWrite[address - ADDR_IO_PORTS];
+
+		// Plain registers are simply stored, the sound block shares one
+		// handler that needs the address
+		if (handler)
 		{
-		case 0xFF00:
-			gbIO.JOYPAD = value;
-		break;
-		
-		case 0xFF01:
-			gbIO.SIODATA = value;
-		break;
-		
-		case 0xFF02:
-			gbIO.SIOCONT = value;
-		break;
-		
-		// Any write to the this register resets it to zero
-		case 0xFF04:
-			gbIO.DIVIDER = 0;
-		break;
-		
-		case 0xFF05:
-			gbIO.TIMECNT = value;
-		break;
-		
-		case 0xFF06:
-			gbIO.TIMEMOD = value;
-		break;
-
-		case 0xFF07:
-			gbIO.TIMECONT = value;
-		break;
-
-		case 0xFF0F:
-			gbIO.IFLAGS = value;
-		break;
-
-		case 0xFF10:
-			gbIO.SNDREG10 = value;
-		break;
-
-		case 0xFF11:
-			gbIO.SNDREG11 = value;
-		break;
-
-		case 0xFF12:
-			gbIO.SNDREG12 = value;
-		break;
-
-		case 0xFF13:
-			gbIO.SNDREG13 = value;
-		break;
-
-		case 0xFF14:
-			gbIO.SNDREG14 = value;
-		break;
-
-		case 0xFF16:
-			gbIO.SNDREG21 = value;
-		break;
-
-		case 0xFF17:
-			gbIO.SNDREG22 = value;
-		break;
-
-		case 0xFF18:
-			gbIO.SNDREG23 = value;
-		break;
-
-		case 0xFF19:
-			gbIO.SNDREG24 = value;
-		break;
-
-		case 0xFF1A:
-			gbIO.SNDREG30 = value;
-		break;
-
-		case 0xFF1B:
-			gbIO.SNDREG31 = value;
-		break;
-
-		case 0xFF1C:
-			gbIO.SNDREG32 = value;
-		break;
-
-		case 0xFF1D:
-			gbIO.SNDREG33 = value;
-		break;
-
-		case 0xFF1E:
-			gbIO.SNDREG34 = value;
-		break;
-
-		case 0xFF20:
-			gbIO.SNDREG41 = value;
-		break;
-
-		case 0xFF21:
-			gbIO.SNDREG42 = value;
-		break;
-
-		case 0xFF22:
-			gbIO.SNDREG43 = value;
-		break;
-		
-		case 0xFF23:
-			gbIO.SNDREG44 = value;
-		break;
-		
-		case 0xFF24:
-			gbIO.SNDREG50 = value;
-		break;
-		
-		case 0xFF25:
-			gbIO.SNDREG51 = value;
-		break;
-		
-		case 0xFF26:
-			gbIO.SNDREG52 = value;
-		break;
-
-		case 0xFF30:
-		case 0xFF31:
-		case 0xFF32:
-		case 0xFF33:
-		case 0xFF34:
-		case 0xFF35:
-		case 0xFF36:
-		case 0xFF37:
-		case 0xFF38:
-		case 0xFF39:
-		case 0xFF3A:
-		case 0xFF3B:
-		case 0xFF3C:
-		case 0xFF3D:
-		case 0xFF3E:
-		case 0xFF3F:
-			WFbank[address - 0xFF30] = value;
-		break;
-
-		case 0xFF40:
-			gbIO.LCDCONT = value;
-		break;
-		
-		case 0xFF41:
-			gbIO.LCDSTAT = value;
-		break;
-		
-		case 0xFF42:
-			gbIO.SCROLLY = value;
-		break;
-		
-		case 0xFF43:
-			gbIO.SCROLLX = value;
-		break;
-
-        // Current scanline, writing to this register resets it
-		case 0xFF44:
-			gbIO.CURLINE = 0x00;
-		break;
-
-		case 0xFF45:
-			gbIO.CMPLINE = value;
-		break;
-
-		case 0xFF46:
-			dmaTransfer(value << 8);
-		break;
-
-		case 0xFF47:
-			gbIO.BGRDPAL = value;
-            gbState.bgPal[0] = gbIO.BGRDPAL & 0x3;
-            gbState.bgPal[1] = (gbIO.BGRDPAL >> 2) & 0x3;
-            gbState.bgPal[2] = (gbIO.BGRDPAL >> 4) & 0x3;
-            gbState.bgPal[3] = (gbIO.BGRDPAL >> 6) & 0x3;
-		break;
-
-		case 0xFF48:
-			gbIO.OBJ0PAL = value;
-            gbState.obj0Pal[0] = gbIO.OBJ0PAL & 0x3;
-            gbState.obj0Pal[1] = (gbIO.OBJ0PAL >> 2) & 0x3;
-            gbState.obj0Pal[2] = (gbIO.OBJ0PAL >> 4) & 0x3;
-            gbState.obj0Pal[3] = (gbIO.OBJ0PAL >> 6) & 0x3;
-		break;
-
-		case 0xFF49:
-			gbIO.OBJ1PAL = value;
-            gbState.obj1Pal[0] = gbIO.OBJ1PAL & 0x3;
-            gbState.obj1Pal[1] = (gbIO.OBJ1PAL >> 2) & 0x3;
-            gbState.obj1Pal[2] = (gbIO.OBJ1PAL >> 4) & 0x3;
-            gbState.obj1Pal[3] = (gbIO.OBJ1PAL >> 6) & 0x3;
-		break;
-
-		case 0xFF4A:
-			gbIO.WNDPOSY = value;
-		break;
-
-		case 0xFF4B:
-			gbIO.WNDPOSX = value;
-		break;
-		
-		case 0xFF4D:
-			gbIO.KEY1 = value;
-		break;
-
-		default:
-			printf("I/O port 0x%X not supported\n", address);
-			//exit(0);
+			handler(value);
+		}
+		else if ((address >= ADDR_SOUND_REGS) && (address < ADDR_SOUND_END))
+		{
+			writeSoundRegister(address, value);
+		}
+		else
+		{
+			gbIO.regs[address - ADDR_IO_PORTS] = value;
 		}
 	}
     // Unusable memory
@@ -310,105 +595,38 @@ void writeByteToMemory(unsigned int address, uint8_t value)
 	else if ((address >= ADDR_OAM_MEMORY) && (address < ADDR_RESERVED1))
 	{
 		//printf("Write to sprite attribute (OAM) address: 0x%X with value: 0x%X\n", address, value);
-		OAMbank[address - ADDR_OAM_MEMORY] = value;
-	}
-    // Echo of WRAM bank 0 and 1
-	else if ((address >= ADDR_INTERNAL_RAM_ECHO) && (address < ADDR_OAM_MEMORY))
-	{
-		//printf("Write to ECHO of 0xC000, address: 0x%X, value: 0x%X\n", address, value);
-        if (address < 0xF000)
+        // Rewriting the same value (e.g. DMA of unchanged sprites) doesn't
+        // disturb the renderer's line cache
+        if (OAMbank[address - ADDR_OAM_MEMORY] != value)
         {
-		    WRAMbank0[address - ADDR_INTERNAL_RAM_ECHO] = value;
+		    syncVideoMemory(address);
+		    OAMbank[address - ADDR_OAM_MEMORY] = value;
         }
-        else
-        {
-            WRAMbank1[address - 0xF000] = value;
-        }
-    }
-    // Work RAM bank 1 (switchable on CGB)
-	else if ((address >= 0xD000) && (address < ADDR_INTERNAL_RAM_ECHO))
-	{
-		//printf("Write to work RAM bank 1, address: 0x%X, value: 0x%X\n", address, value);
-		WRAMbank1[address - 0xD000] = value;
 	}
-    // Work RAM bank 0 (fixed)
-	else if ((address >= ADDR_INTERNAL_RAM) && (address < 0xD000))
+    // Echo of WRAM bank 1, the bank 0 half is in the page table
+	else if ((address >= 0xF000) && (address < ADDR_OAM_MEMORY))
 	{
-		//printf("Write to work RAM bank 0, address: 0x%X, value: 0x%X\n", address, value);
-		WRAMbank0[address - ADDR_INTERNAL_RAM] = value;
-	}
+        WRAMbank1[address - 0xF000] = value;
+    }
     // External RAM (8KB), if present
 	else if ((address >= ADDR_S_RAM_BANK) && (address < ADDR_INTERNAL_RAM))
 	{
 		//printf("Write to 8kB switchable RAM bank, address: 0x%X, value: 0x%X\n", address, value);
-
-        // If we have no external RAM then don't try to access it
-        if (gbState.ramMode == 0x00)
-        {
-            return;
-        }
-        // Protect against invalid RAM access in 2K mode
-        else if ((gbState.ramMode == 0x01) && (address >= 0xA800))
-        {
-            return;
-        }
-
-        switchRAMPtr[address - ADDR_S_RAM_BANK] = value;
+        writeExternalRam(address, value);
 	}
     // Video RAM (switchable on CGB)
 	else if ((address >= ADDR_VIDEO_RAM) && (address < ADDR_S_RAM_BANK))
 	{
-		VRAMbank[address - ADDR_VIDEO_RAM] = value;
-	}
-    // Switchable ROM bank
-	else if ((address >= ADDR_ROM_BANK_S) && (address < ADDR_VIDEO_RAM))
-	{
-        switch(gbState.mbc)
+        if (VRAMbank[address - ADDR_VIDEO_RAM] != value)
         {
-        case ROM_ONLY:
-		    writeLog("Cannot write to 16kb switchable ROM bank\n");
-		    //exit_with_debug();
-            break;
-
-        default:
-            // MBC unhandled
-            break;
+		    syncVideoMemory(address);
+		    VRAMbank[address - ADDR_VIDEO_RAM] = value;
         }
 	}
-    // Fixed ROM bank
-	else if ((address >= ADDR_ROM_BANK_0) && (address < ADDR_ROM_BANK_S))
+    // Writes to ROM go to the memory bank controller
+	else if (address < ADDR_VIDEO_RAM)
 	{
-        switch(gbState.mbc)
-        {
-        case ROM_ONLY:
-    		writeLog("Cannot write to 16kb ROM bank #0, address: 0x%X, value: 0x%X\n", address, value);
-            writeLog("Bank switching not supported in this MBC mode\n");
-        break;
-
-        case MBC1:
-            if (address >= 0x2000)
-            {
-                if (0x00 == value)
-                {
-                    value = 1;
-                }
-
-                if (value < gbState.romBanks)
-                {
-                    gbState.currentRomBank = value;
-                }
-                else
-                {
-                    printf("Invalid ROM bank %i (of %i)\n", value, gbState.romBanks);
-                    //exit_with_debug();
-                }
-            }
-		break;
-
-        default:
-            // MBC unhandled
-            break;
-        }
+        writeBankController(address, value);
 	}
 	else
 	{
@@ -439,6 +657,20 @@ uint8_t readByteFromMemory(uint16_t address)
                                   | select an appropriate ROM bank at
                                   | 4000-7FFF. RAM switching is not provided.
 */
+    const uint8_t* page = readMap[address >> MEMORY_PAGE_SHIFT];
+
+    STATS_ACCESS(address, 0);
+
+    // ROM, VRAM and plain RAM
+    if (page)
+    {
+        return page[address & MEMORY_PAGE_MASK];
+    }
+
+	if (gbState.dmaActive && (address < ADDR_IO_PORTS))
+	{
+		return 0xFF;
+	}
 
 	if (address == 0xFFFF)
 	{
@@ -452,181 +684,19 @@ uint8_t readByteFromMemory(uint16_t address)
 	else if ((address >= ADDR_IO_PORTS) && (address < 0xFF80))
 	{
         //printf("Read from I/O port, address: 0x%X\n", address);
+		ioReadHandler handler = ioRead[address - ADDR_IO_PORTS];
+
+		if (handler)
+		{
+			return handler();
+		}
 
-		switch(address)
+		if ((address >= ADDR_SOUND_REGS) && (address < ADDR_SOUND_END))
 		{
-		case 0xFF00:
-			return getJoypadState();
-		break;
-		
-		case 0xFF01:
-			return gbIO.SIODATA;
-		break;
-		
-		case 0xFF02:
-			return gbIO.SIOCONT;
-		break;
-		
-		case 0xFF04:
-			return gbIO.DIVIDER;
-		break;
-		
-		case 0xFF05:
-			return gbIO.TIMECNT;
-		break;
-		
-		case 0xFF06:
-			return gbIO.TIMEMOD;
-		break;
-
-		case 0xFF07:
-			return gbIO.TIMECONT;
-		break;
-
-		case 0xFF0F:
-			return gbIO.IFLAGS;
-		break;
-
-		case 0xFF10:
-			return gbIO.SNDREG10;
-		break;
-
-		case 0xFF11:
-			return gbIO.SNDREG11;
-		break;
-
-		case 0xFF12:
-			return gbIO.SNDREG12;
-		break;
-
-		case 0xFF13:
-			return gbIO.SNDREG13;
-		break;
-
-		case 0xFF14:
-			return gbIO.SNDREG14;
-		break;
-
-		case 0xFF16:
-			return gbIO.SNDREG21;
-		break;
-
-		case 0xFF17:
-			return gbIO.SNDREG22;
-		break;
-
-		case 0xFF18:
-			return gbIO.SNDREG23;
-		break;
-
-		case 0xFF19:
-			return gbIO.SNDREG24;
-		break;
-
-		case 0xFF1A:
-			return gbIO.SNDREG30;
-		break;
-
-		case 0xFF1B:
-			return gbIO.SNDREG31;
-		break;
-
-		case 0xFF1C:
-			return gbIO.SNDREG32;
-		break;
-
-		case 0xFF1D:
-			return gbIO.SNDREG33;
-		break;
-
-		case 0xFF1E:
-			return gbIO.SNDREG34;
-		break;
-
-		case 0xFF20:
-			return gbIO.SNDREG41;
-		break;
-
-		case 0xFF21:
-			return gbIO.SNDREG42;
-		break;
-
-		case 0xFF22:
-			return gbIO.SNDREG43;
-		break;
-		
-		case 0xFF23:
-			return gbIO.SNDREG44;
-		break;
-		
-		case 0xFF24:
-			return gbIO.SNDREG50;
-		break;
-		
-		case 0xFF25:
-			return gbIO.SNDREG51;
-		break;
-		
-		case 0xFF26:
-			return gbIO.SNDREG52;
-		break;
-		
-		case 0xFF40:
-			return gbIO.LCDCONT;
-		break;
-		
-		case 0xFF41:
-			return gbIO.LCDSTAT;
-		break;
-		
-		case 0xFF42:
-			return gbIO.SCROLLY;
-		break;
-		
-		case 0xFF43:
-			return gbIO.SCROLLX;
-		break;
-
-		case 0xFF44:
-			return gbIO.CURLINE;
-		break;
-
-		case 0xFF45:
-			return gbIO.CMPLINE;
-		break;
-
-		case 0xFF46:
-			return gbIO.DMACONT;
-		break;
-
-		case 0xFF47:
-			return gbIO.BGRDPAL;
-		break;
-
-		case 0xFF48:
-			return gbIO.OBJ0PAL;
-		break;
-
-		case 0xFF49:
-			return gbIO.OBJ1PAL;
-		break;
-
-		case 0xFF4A:
-			return gbIO.WNDPOSY;
-		break;
-
-		case 0xFF4B:
-			return gbIO.WNDPOSX;
-		break;
-		
-		case 0xFF4D:
-			return gbIO.KEY1;
-		break;
-
-		default:
-			printf("I/O port not supported\n");
-			return 0;
+			return readSoundRegister(address);
 		}
+
+		return gbIO.regs[address - ADDR_IO_PORTS];
 	}
 	else if ((address >= ADDR_RESERVED1) && (address < ADDR_IO_PORTS))
 	{
@@ -639,111 +709,215 @@ uint8_t readByteFromMemory(uint16_t address)
 		//printf("Read from Spirte Attribute Table, address: 0x%X, value: 0x%X\n", address, OAMbank[address - ADDR_OAM_MEMORY]);
 		return OAMbank[address - ADDR_OAM_MEMORY];
 	}
-	else if ((address >= ADDR_INTERNAL_RAM_ECHO) && (address < ADDR_OAM_MEMORY))
+	else if ((address >= 0xF000) && (address < ADDR_OAM_MEMORY))
 	{
-		//printf("Read from echo WRAM0, address: 0x%X, value: 0x%X\n", address, WRAMbank0[address - ADDR_INTERNAL_RAM_ECHO]);
-		return WRAMbank0[address - ADDR_INTERNAL_RAM_ECHO];
+		//printf("Read from echo WRAM1, address: 0x%X, value: 0x%X\n", address, WRAMbank1[address - 0xF000]);
+		return WRAMbank1[address - 0xF000];
 	}
-	else if ((address >= 0xD000) && (address < ADDR_INTERNAL_RAM_ECHO))
+	else if ((address >= ADDR_S_RAM_BANK) && (address < ADDR_INTERNAL_RAM))
 	{
-		//printf("Read from WRAM bank 1, address: 0x%X, value: 0x%X\n", address, WRAMbank1[address - 0xD000]);
-		return WRAMbank1[address - 0xD000];
+		//printf("Read from 8kB switchable RAM bank\n");
+		return readExternalRam(address);
 	}
-	else if ((address >= ADDR_INTERNAL_RAM) && (address < 0xD000))
+	else
 	{
-		//writeLog("Read from WRAM bank 0, address: 0x%X, value: 0x%X\n", address, WRAMbank0[address - ADDR_INTERNAL_RAM]);
-		return WRAMbank0[address - ADDR_INTERNAL_RAM];
+		printf("Reading from invalid memory address 0x%X\n", address);
+		exit(0);
 	}
-	else if ((address >= ADDR_S_RAM_BANK) && (address < ADDR_INTERNAL_RAM))
-	{
-		//printf("Read from 8kB switchable RAM bank\n");
+}
 
-        // If we have no external RAM then don't try to access it
-        if (gbState.ramMode == 0x00)
-        {
-            return 0x00;
-        }
-        // Protect against invalid RAM access in 2K mode
-        else if ((gbState.ramMode == 0x01) && (address >= 0xA800))
-        {
-            return 0x00;
-        }
+// Copy the DMA source page into Object Attribute Memory (OAM). Sources that
+// the page table maps are copied straight from host memory.
+static void dmaCopy(uint16_t address)
+{
+	const uint8_t* page = readMap[address >> MEMORY_PAGE_SHIFT];
+	const uint8_t* source;
+	int ii;
 
-		return switchRAMPtr[address - ADDR_S_RAM_BANK];
-	}
-	else if ((address >= ADDR_VIDEO_RAM) && (address < ADDR_S_RAM_BANK))
+	if ((NULL == page) || (address >= ADDR_OAM_MEMORY))
 	{
-		//if (address >= 0x9800)
-			//printf("Read from VRAM, address: 0x%X, value 0x%X\n", address, VRAMbank[address - ADDR_VIDEO_RAM]);
-		return VRAMbank[address - ADDR_VIDEO_RAM];
+		for (ii = 0; ii < 0xA0; ii++)
+		{
+			writeByteToMemory(ADDR_OAM_MEMORY + ii, readByteFromMemory(address + ii));
+		}
+
+		return;
 	}
-	else if ((address >= ADDR_ROM_BANK_S) && (address < ADDR_VIDEO_RAM))
+
+	source = &page[address & MEMORY_PAGE_MASK];
+
+	// Only sprites that actually change are passed by the renderer, so
+	// repeating the same DMA every frame keeps the line cache intact
+	for (ii = 0; ii < 0xA0; ii += 4)
 	{
-        //printf("Read from 16kb switchable ROM bank, address: 0x%X (0x%X)\n", address, (address - ADDR_ROM_BANK_S) + (ADDR_ROM_BANK_S * gbState.currentRomBank));
-        return cartData[(address - ADDR_ROM_BANK_S) + (ADDR_ROM_BANK_S * gbState.currentRomBank)];
+		if (memcmp(&OAMbank[ii], &source[ii], 4) != 0)
+		{
+			syncVideoMemory(ADDR_OAM_MEMORY + ii);
+			memcpy(&OAMbank[ii], &source[ii], 4);
+		}
 	}
-	else if ((address >= ADDR_ROM_BANK_0) && (address < ADDR_ROM_BANK_S))
+}
+
+// Transfer some data straight into Object Attribute Memory (OAM). In timed
+// mode the copy lands when the transfer ends and until then the CPU can only
+// reach the I/O ports and HRAM.
+static void dmaTransfer(uint16_t address)
+{
+	if (timedDma)
 	{
-		//printf("Read from 16kb ROM bank #0\n");
-		return cartData[address];
+		dmaSource = address;
+		gbState.dmaActive = 1;
+		gbState.dmaEventCycle = gbState.cycles + DMA_TRANSFER_CYCLES;
+
+		updateMemoryMap();
 	}
 	else
 	{
-		printf("Reading from invalid memory address 0x%X\n", address);
-		exit(0);
+		dmaCopy(address);
 	}
 }
 
-// Transfer some data straight into Object Attribute Memory (OAM)
-void dmaTransfer(uint16_t address)
+// Called by the main loop once a timed transfer is due to finish
+void updateDma(void)
 {
-	int ii;
+	gbState.dmaActive = 0;
+	gbState.dmaEventCycle = CYCLE_NEVER;
 
-	for (ii = 0; ii < 0xA0; ii++)
-	{
-		writeByteToMemory(ADDR_OAM_MEMORY + ii, readByteFromMemory(address + ii));
-	}
+	updateMemoryMap();
+	dmaCopy(dmaSource);
+}
+
+void setTimedDma(int timed)
+{
+	timedDma = timed;
+}
+
+// Battery saves use the common .sav layout, the raw RAM contents followed on
+// MBC3 clock cartridges by a 48 byte footer. The footer holds the live and
+// latched clock registers as 32-bit little endian values then a 64-bit unix
+// timestamp of when the file was written.
+#define RTC_FOOTER_SIZE			48
+
+static void putLittleEndian(uint8_t* buffer, uint64_t value, int bytes)
+{
+    int ii;
+
+    for (ii = 0; ii < bytes; ii++)
+    {
+        buffer[ii] = (value >> (ii * 8)) & 0xFF;
+    }
+}
+
+static uint64_t getLittleEndian(const uint8_t* buffer, int bytes)
+{
+    uint64_t value = 0;
+    int ii;
+
+    for (ii = bytes - 1; ii >= 0; ii--)
+    {
+        value = (value << 8) | buffer[ii];
+    }
+
+    return value;
+}
+
+static void writeRtcFooter(uint8_t* footer)
+{
+    uint8_t regs[RTC_REGISTERS];
+    int ii;
+
+    rtcGetRegisters(regs);
+
+    for (ii = 0; ii < RTC_REGISTERS; ii++)
+    {
+        putLittleEndian(&footer[ii * 4], regs[ii], 4);
+        putLittleEndian(&footer[(RTC_REGISTERS + ii) * 4], rtc.latched[ii], 4);
+    }
+
+    putLittleEndian(&footer[40], (uint64_t)time(NULL), 8);
+}
+
+static void readRtcFooter(const uint8_t* footer)
+{
+    uint8_t regs[RTC_REGISTERS];
+    time_t saved;
+    int ii;
+
+    for (ii = 0; ii < RTC_REGISTERS; ii++)
+    {
+        regs[ii] = (uint8_t)getLittleEndian(&footer[ii * 4], 4);
+        rtc.latched[ii] = (uint8_t)getLittleEndian(&footer[(RTC_REGISTERS + ii) * 4], 4);
+    }
+
+    rtcSetRegisters(regs);
+
+    // A clock running off host time carries on from when it was saved,
+    // emulated time only moves while the game runs
+    saved = (time_t)getLittleEndian(&footer[40], 8);
+
+    if (rtcHostTime && !(rtc.dayHigh & RTC_DH_HALT) && (rtc.baseHostTime > saved))
+    {
+        rtc.baseHostTime = saved;
+    }
+}
+
+// Replace the ROM file's extension with .sav
+static void makeSaveFileName(const char* filename)
+{
+    char* extension;
+
+    snprintf(saveFile, sizeof(saveFile) - 4, "%s", filename);
+
+    extension = strrchr(saveFile, '.');
+
+    if ((NULL == extension) || strchr(extension, '/') || strchr(extension, '\\'))
+    {
+        extension = saveFile + strlen(saveFile);
+    }
+
+    strcpy(extension, ".sav");
 }
 
 // Load ROM into our system RAM and parse ROM data for system configuration
 void loadRom(char* filename)
 {
-	FILE *fp;
-	unsigned int fileLength;
+	size_t fileLength;
+	uint8_t romSize;
+	uint8_t ramSize;
 
     cartData = NULL;
     switchRAM = NULL;
 
-	fp = fopen(filename, "rb");
+	cartData = acquireRom(filename, &fileLength);
 
-	if (fp == NULL)
+	if (cartData == NULL)
 	{
 		printf("Failed to open '%s'\n", filename);
 		exit(1);
 	}
-	
-	// obtain file size:
-	fseek (fp, 0, SEEK_END);
-	fileLength = ftell(fp);
-	rewind(fp);
-
-    cartData = malloc(fileLength);
 
-    printf("Cart data located at 0x%X\n", cartData);
+    romLength = fileLength;
 
-	fread(cartData, 1, fileLength, fp);
-	fclose(fp);
-
-    printf("Cart length: 0x%X\n", fileLength);
+    printf("Cart length: 0x%X\n", (unsigned int)fileLength);
     printf("Cart type: 0x%X\n", cartData[0x147]);
 
+    gbState.batteryBackup = 0;
+    gbState.rtcPresent = 0;
+
     switch(cartData[0x147])
     {
     case 0x00:
+    case 0x08:
         gbState.mbc = ROM_ONLY;
         break;
 
+    case 0x09:
+        gbState.mbc = ROM_ONLY;
+        gbState.batteryBackup = 1;
+        break;
+
     case 0x01:
+    case 0x02:
         gbState.mbc = MBC1;
         break;
 
@@ -752,88 +926,352 @@ void loadRom(char* filename)
         gbState.batteryBackup = 1;
         break;
 
-    default:
-        printf("ROM type not supported yet!\n");
-        exit(0);
-    }
+    case 0x05:
+        gbState.mbc = MBC2;
+        break;
 
-    printf("ROM size: %d\n", cartData[0x148]);
-    printf("RAM size: %d\n", cartData[0x149]);
+    case 0x06:
+        gbState.mbc = MBC2;
+        gbState.batteryBackup = 1;
+        break;
 
-    switch(cartData[0x148])
-    {
-    case 0x00:
-        gbState.romBanks = 0;
+    case 0x0F:
+    case 0x10:
+        gbState.mbc = MBC3;
+        gbState.batteryBackup = 1;
+        gbState.rtcPresent = 1;
         break;
 
-    case 0x01:
-        gbState.romBanks = 4;
+    case 0x11:
+    case 0x12:
+        gbState.mbc = MBC3;
         break;
 
-    case 0x02:
-        gbState.romBanks = 8;
+    case 0x13:
+        gbState.mbc = MBC3;
+        gbState.batteryBackup = 1;
         break;
 
-    case 0x03:
-        gbState.romBanks = 16;
+    case 0x19:
+    case 0x1A:
+    case 0x1C:
+    case 0x1D:
+        gbState.mbc = MBC5;
         break;
 
-    case 0x04:
-        gbState.romBanks = 32;
+    case 0x1B:
+    case 0x1E:
+        gbState.mbc = MBC5;
+        gbState.batteryBackup = 1;
         break;
 
     default:
-        printf("ROM size %i not supported yet!\n", cartData[0x148]);
+        printf("ROM type not supported yet!\n");
+        exit(0);
+    }
+
+    romSize = cartData[0x148];
+    ramSize = cartData[0x149];
+
+    printf("ROM size: %d\n", romSize);
+    printf("RAM size: %d\n", ramSize);
+
+    // 32KB doubled for each step, plus three odd sizes
+    if (romSize <= 0x08)
+    {
+        gbState.romBanks = 2 << romSize;
+    }
+    else if ((romSize >= 0x52) && (romSize <= 0x54))
+    {
+        static const uint16_t oddSizes[3] = { 72, 80, 96 };
+
+        gbState.romBanks = oddSizes[romSize - 0x52];
+    }
+    else
+    {
+        printf("ROM size %i not supported yet!\n", romSize);
         exit_with_debug();
     }
-    
-    switch(cartData[0x149])
+
+    // Don't map banks past the end of a truncated image
+    if (fileLength < ((size_t)gbState.romBanks * 0x4000))
+    {
+        printf("ROM image is shorter than its header says\n");
+        gbState.romBanks = fileLength / 0x4000;
+
+        if (gbState.romBanks < 2)
+        {
+            exit_with_debug();
+        }
+    }
+
+    switch(ramSize)
     {
     case 0x00:
-        gbState.ramMode = 0;
+        gbState.ramSize = 0;
         break;
 
     case 0x01:
-        gbState.ramMode = 1;
         gbState.ramSize = 0x800;        // 2KB
         break;
 
     case 0x02:
-        gbState.ramMode = 2;
         gbState.ramSize = 0x2000;       // 8KB
         break;
 
     case 0x03:
-        gbState.ramMode = 3;
         gbState.ramSize = 0x8000;       // 32KB
         break;
 
+    case 0x04:
+        gbState.ramSize = 0x20000;      // 128KB
+        break;
+
+    case 0x05:
+        gbState.ramSize = 0x10000;      // 64KB
+        break;
+
     default:
         printf("ERROR: RAM banks not supported\n");
 		exit(0);
     }
 
-    switchRAM = malloc(gbState.ramSize);
-    switchRAMPtr = switchRAM;
+    if (MBC2 == gbState.mbc)
+    {
+        gbState.ramSize = MBC2_RAM_SIZE;
+    }
+
+    gbState.ramBanks = (gbState.ramSize + 0x1FFF) / 0x2000;
+
+    makeSaveFileName(filename);
+
+    memset(&rtc, 0, sizeof(rtc));
+    rtc.baseCycle = gbState.cycles;
+    rtc.baseHostTime = time(NULL);
+
+    if (!batterySaves)
+    {
+        gbState.batteryBackup = 0;
+    }
+
+    // Battery backed RAM lives in the mapped save file, with room for the
+    // clock after it
+    if (gbState.batteryBackup)
+    {
+        size_t saveSize = gbState.ramSize + (gbState.rtcPresent ? RTC_FOOTER_SIZE : 0);
+        size_t existing;
+
+        switchRAM = openBatteryFile(saveFile, saveSize, &existing);
+
+        if (NULL == switchRAM)
+        {
+            gbState.batteryBackup = 0;
+        }
+        else if (gbState.rtcPresent && (existing == saveSize))
+        {
+            readRtcFooter(&switchRAM[gbState.ramSize]);
+        }
+    }
+
+    if ((NULL == switchRAM) && gbState.ramSize)
+    {
+        switchRAM = calloc(1, gbState.ramSize);
+    }
+
+    adviseRomAccess(cartData, fileLength, ROM_ACCESS_RANDOM);
+
+    // Bank 0 is always mapped and bank 1 is where most games start
+    adviseRomAccess(cartData, 0x8000, ROM_ACCESS_NEEDED);
+
+    bankSelects = calloc(gbState.romBanks, sizeof(uint32_t));
+    bankSelects[0] = 1;
+    bankSelects[1] = 1;
+
+    gbState.currentRomBank = 1;
+    gbState.currentRomBank0 = 0;
+    gbState.mbcRomBank = 1;
+    gbState.mbcRamBank = 0;
+    gbState.bankingMode = 0;
+    // Without an MBC any RAM is always enabled
+    gbState.ramEnabled = (ROM_ONLY == gbState.mbc);
+
+    updateBanks();
+}
+
+// Unused ports read back as all ones and ignore writes
+static uint8_t readUnusedPort(void)
+{
+	return 0xFF;
+}
+
+static void writeUnusedPort(uint8_t value)
+{
+}
+
+static void writeDma(uint8_t value)
+{
+	gbIO.DMACONT = value;
+	dmaTransfer(value << 8);
+}
+
+// Split a palette register into the shade for each colour
+static void unpackPalette(uint8_t value, uint8_t* palette)
+{
+	palette[0] = value & 0x3;
+	palette[1] = (value >> 2) & 0x3;
+	palette[2] = (value >> 4) & 0x3;
+	palette[3] = (value >> 6) & 0x3;
+}
+
+static void writeBgPalette(uint8_t value)
+{
+	gbIO.BGRDPAL = value;
+	unpackPalette(value, gbState.bgPal);
+}
+
+static void writeObj0Palette(uint8_t value)
+{
+	gbIO.OBJ0PAL = value;
+	unpackPalette(value, gbState.obj0Pal);
+}
+
+static void writeObj1Palette(uint8_t value)
+{
+	gbIO.OBJ1PAL = value;
+	unpackPalette(value, gbState.obj1Pal);
+}
+
+static void setIoHandlers(uint16_t address, ioReadHandler readFunc, ioWriteHandler writeFunc)
+{
+	ioRead[address - ADDR_IO_PORTS] = readFunc;
+	ioWrite[address - ADDR_IO_PORTS] = writeFunc;
+}
+
+static void initIoHandlers(void)
+{
+	int ii;
+
+	// Start with every port unused, then fill in the ones that exist
+	for (ii = 0; ii < 0x80; ii++)
+	{
+		ioRead[ii] = readUnusedPort;
+		ioWrite[ii] = writeUnusedPort;
+	}
+
+	// The sound registers are passed to the sound module by address
+	for (ii = ADDR_SOUND_REGS; ii < ADDR_SOUND_END; ii++)
+	{
+		setIoHandlers(ii, NULL, NULL);
+	}
+
+	// Plain storage
+	setIoHandlers(0xFF01, NULL, NULL);				// SB
+	setIoHandlers(0xFF02, NULL, NULL);				// SC
+	setIoHandlers(0xFF06, NULL, NULL);				// TMA
+	setIoHandlers(0xFF07, NULL, writeTimerControl);	// TAC
+	setIoHandlers(0xFF42, NULL, NULL);				// SCY
+	setIoHandlers(0xFF43, NULL, NULL);				// SCX
+	setIoHandlers(0xFF4A, NULL, NULL);				// WY
+	setIoHandlers(0xFF4B, NULL, NULL);				// WX
+	setIoHandlers(0xFF4D, NULL, NULL);				// KEY1
+
+	// Registers with side effects
+	setIoHandlers(0xFF00, getJoypadState, NULL);				// P1
+	setIoHandlers(0xFF04, readDivider, writeDivider);			// DIV
+	setIoHandlers(0xFF05, readTimerCounter, writeTimerCounter);	// TIMA
+	setIoHandlers(0xFF0F, NULL, writeInterruptFlags);			// IF
+	setIoHandlers(0xFF40, NULL, writeLcdControl);				// LCDC
+	setIoHandlers(0xFF41, readLcdStatus, writeLcdStatus);		// STAT
+	setIoHandlers(0xFF44, NULL, writeLcdLine);					// LY
+	setIoHandlers(0xFF45, NULL, writeLcdCompare);				// LYC
+	setIoHandlers(0xFF46, NULL, writeDma);						// DMA
+	setIoHandlers(0xFF47, NULL, writeBgPalette);				// BGP
+	setIoHandlers(0xFF48, NULL, writeObj0Palette);				// OBP0
+	setIoHandlers(0xFF49, NULL, writeObj1Palette);				// OBP1
 }
 
 void initGbMemory(void)
 {
+	initIoHandlers();
+
+	gbState.dmaActive = 0;
+	gbState.dmaEventCycle = CYCLE_NEVER;
+
 	memset(WRAMbank0, 0, sizeof(WRAMbank0));
 	memset(WRAMbank1, 0, sizeof(WRAMbank1));
+	memset(VRAMbank, 0, sizeof(VRAMbank));
+	memset(HRAMbank, 0, sizeof(HRAMbank));
+	memset(OAMbank, 0, sizeof(OAMbank));
+}
+
+// Report how often the game selected each ROM bank and how much of the image
+// ended up in the page cache, for sizing the cache on hosts running many
+// instances. Selects count the bank being mapped in, which includes banks 0
+// and 1 at power on, the resident column is what was really read.
+void printBankStats(void)
+{
+    long resident;
+    int banksSelected = 0;
+    int ii;
+
+    if ((NULL == cartData) || (NULL == bankSelects))
+    {
+        return;
+    }
+
+    printf("\nROM bank usage\n");
+    printf("bank  selects  resident KB\n");
+
+    for (ii = 0; ii < gbState.romBanks; ii++)
+    {
+        resident = residentRomBytes(cartData, ii * 0x4000, 0x4000);
+
+        if (bankSelects[ii] || (resident > 0))
+        {
+            printf("%4d  %7u  %ld\n", ii, (unsigned int)bankSelects[ii], (resident < 0) ? -1 : (resident / 1024));
+        }
+
+        if (bankSelects[ii])
+        {
+            banksSelected++;
+        }
+    }
+
+    printf("%d of %d banks selected\n", banksSelected, gbState.romBanks);
+
+    resident = residentRomBytes(cartData, 0, romLength);
+
+    if (resident >= 0)
+    {
+        printf("%ld KB of %ld KB resident\n", resident / 1024, (long)(romLength / 1024));
+    }
 }
 
 void freeGbMemory(void)
 {
 	if (cartData)
 	{
-		free(cartData);
+		releaseRom(cartData);
 		cartData = NULL;
 	}
 
-    if (switchRAM)
+    free(bankSelects);
+    bankSelects = NULL;
+
+    if (switchRAM && gbState.batteryBackup)
+    {
+        if (gbState.rtcPresent)
+        {
+            writeRtcFooter(&switchRAM[gbState.ramSize]);
+            markBatteryDirty();
+        }
+
+        closeBatteryFile();
+    }
+    else if (switchRAM)
     {
         free(switchRAM);
-        switchRAM = NULL;
     }
+
+    switchRAM = NULL;
 }
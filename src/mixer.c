@@ -0,0 +1,396 @@
+/******************************************************************************
+DoGoBoy - Nintendo GameBoy Emulator
+*******************************************************************************
+Copyright (c) 2009-2013, Douglas Gore (doug@ssonic.co.uk)
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the Douglas Gore nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL DOUGLAS GORE BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*******************************************************************************
+Purpose:
+
+Mixing of the sound channels into stereo and conversion from the sound
+processor's internal rate to the host rate. These run over every output
+sample so they are vectorised, with scalar versions for other hosts. A
+cheap linear interpolator is there for runs that only need the sound for
+statistics rather than listening.
+******************************************************************************/
+
+#include <math.h>
+
+#include "SDL.h"
+
+#include "gameboy.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// The integrators leak slightly, which removes the DC offset of the channels
+#define INTEGRATOR_LEAK		0.999f
+
+// Windowed-sinc filter with 256 sub-sample phases, the taps are interpolated
+// between the two phases either side of the output sample
+#define RESAMPLE_PHASE_BITS	8
+#define RESAMPLE_PHASES		(1 << RESAMPLE_PHASE_BITS)
+#define RESAMPLE_CUTOFF		0.305		// 20kHz at the 65536Hz input rate
+#define KAISER_BETA			8.0
+
+static float sincTable[RESAMPLE_PHASES + 1][RESAMPLE_TAPS];
+static int sincTableBuilt = 0;
+
+static resampleQuality quality = RESAMPLE_SINC;
+
+// Zeroth order modified Bessel function for the Kaiser window
+static double besselI0(double x)
+{
+    double sum = 1.0;
+    double term = 1.0;
+    int kk;
+
+    for (kk = 1; kk < 32; kk++)
+    {
+        term *= (x / (2.0 * kk)) * (x / (2.0 * kk));
+        sum += term;
+    }
+
+    return sum;
+}
+
+// Phase p holds the taps for an output sample p/256 of the way between two
+// input samples, tap 15 being the input sample just before it. Every phase
+// sums to one so the gain is the same for all of them. There's one extra
+// phase on the end to interpolate towards.
+static void buildSincTable(void)
+{
+    const double halfWidth = RESAMPLE_TAPS / 2;
+    int phase, tap;
+
+    for (phase = 0; phase <= RESAMPLE_PHASES; phase++)
+    {
+        double fraction = (double)phase / RESAMPLE_PHASES;
+        double sum = 0;
+
+        for (tap = 0; tap < RESAMPLE_TAPS; tap++)
+        {
+            double x = tap - (halfWidth - 1) - fraction;
+            double sinc = (0 == x) ? 1.0 : sin(2.0 * M_PI * RESAMPLE_CUTOFF * x) / (2.0 * M_PI * RESAMPLE_CUTOFF * x);
+            double ratio = x / halfWidth;
+            double window = (fabs(ratio) < 1.0) ? besselI0(KAISER_BETA * sqrt(1.0 - (ratio * ratio))) / besselI0(KAISER_BETA) : 0;
+
+            sincTable[phase][tap] = (float)(sinc * window);
+            sum += sinc * window;
+        }
+
+        for (tap = 0; tap < RESAMPLE_TAPS; tap++)
+        {
+            sincTable[phase][tap] = (float)(sincTable[phase][tap] / sum);
+        }
+    }
+
+    sincTableBuilt = 1;
+}
+
+void setResampleQuality(resampleQuality newQuality)
+{
+    quality = newQuality;
+}
+
+// Integrate the step buffer of each channel, which holds the four channels
+// side by side for every sample, and pan them into left and right. The gains
+// include the NR51 enables and the NR50 master volume.
+void mixSoundChannels(const float* deltas, int count, float* integrators, const float* leftGains, const float* rightGains, float* left, float* right)
+{
+    int ii = 0;
+
+#ifdef __SSE2__
+    {
+        const __m128 leak = _mm_set1_ps(INTEGRATOR_LEAK);
+        __m128 acc = _mm_loadu_ps(integrators);
+        __m128 gainL[4];
+        __m128 gainR[4];
+        int ch;
+
+        for (ch = 0; ch < 4; ch++)
+        {
+            gainL[ch] = _mm_set1_ps(leftGains[ch]);
+            gainR[ch] = _mm_set1_ps(rightGains[ch]);
+        }
+
+        // Each vector holds the four channels, the integration runs down the
+        // samples and four samples are transposed at a time so the panning
+        // is a plain multiply-add per channel
+        for (; (ii + 4) <= count; ii += 4)
+        {
+            __m128 s0, s1, s2, s3;
+
+            acc = _mm_add_ps(_mm_mul_ps(acc, leak), _mm_loadu_ps(&deltas[(ii + 0) * 4]));
+            s0 = acc;
+            acc = _mm_add_ps(_mm_mul_ps(acc, leak), _mm_loadu_ps(&deltas[(ii + 1) * 4]));
+            s1 = acc;
+            acc = _mm_add_ps(_mm_mul_ps(acc, leak), _mm_loadu_ps(&deltas[(ii + 2) * 4]));
+            s2 = acc;
+            acc = _mm_add_ps(_mm_mul_ps(acc, leak), _mm_loadu_ps(&deltas[(ii + 3) * 4]));
+            s3 = acc;
+
+            _MM_TRANSPOSE4_PS(s0, s1, s2, s3);
+
+            _mm_storeu_ps(&left[ii], _mm_add_ps(_mm_add_ps(_mm_mul_ps(s0, gainL[0]), _mm_mul_ps(s1, gainL[1])),
+                                                _mm_add_ps(_mm_mul_ps(s2, gainL[2]), _mm_mul_ps(s3, gainL[3]))));
+            _mm_storeu_ps(&right[ii], _mm_add_ps(_mm_add_ps(_mm_mul_ps(s0, gainR[0]), _mm_mul_ps(s1, gainR[1])),
+                                                 _mm_add_ps(_mm_mul_ps(s2, gainR[2]), _mm_mul_ps(s3, gainR[3]))));
+        }
+
+        _mm_storeu_ps(integrators, acc);
+    }
+#endif
+
+    for (; ii < count; ii++)
+    {
+        float sumL = 0;
+        float sumR = 0;
+        int ch;
+
+        for (ch = 0; ch < 4; ch++)
+        {
+            integrators[ch] = (integrators[ch] * INTEGRATOR_LEAK) + deltas[(ii * 4) + ch];
+            sumL += integrators[ch] * leftGains[ch];
+            sumR += integrators[ch] * rightGains[ch];
+        }
+
+        left[ii] = sumL;
+        right[ii] = sumR;
+    }
+}
+
+static int16_t clampSample(float sample)
+{
+    if (sample > 32767.0f)
+    {
+        return 32767;
+    }
+
+    if (sample < -32768.0f)
+    {
+        return -32768;
+    }
+
+    return (int16_t)sample;
+}
+
+static int resampleLinear(const float* left, const float* right, int available, uint32_t* position, uint32_t step, int16_t* out)
+{
+    uint32_t pos = *position;
+    int frames = 0;
+
+    while ((int)(pos >> 16) + (RESAMPLE_TAPS / 2) < available)
+    {
+        int index = pos >> 16;
+        float fraction = (pos & 0xFFFF) * (1.0f / 65536.0f);
+
+        out[frames * 2] = clampSample(left[index] + ((left[index + 1] - left[index]) * fraction));
+        out[(frames * 2) + 1] = clampSample(right[index] + ((right[index + 1] - right[index]) * fraction));
+        frames++;
+
+        pos += step;
+    }
+
+    *position = pos;
+
+    return frames;
+}
+
+// Round to nearest and saturate, as the vector conversions do
+static int16_t roundSample(float sample)
+{
+    long rounded = lrintf(sample);
+
+    if (rounded > 32767)
+    {
+        return 32767;
+    }
+
+    if (rounded < -32768)
+    {
+        return -32768;
+    }
+
+    return (int16_t)rounded;
+}
+
+// One output frame of the sinc filter in plain C. The taps are summed in
+// eight lanes and folded in the same order as the vector versions, so every
+// build gives exactly the same samples
+static void sincFrameScalar(const float* inL, const float* inR, const float* taps, const float* nextTaps, float blend, int16_t* out)
+{
+    float laneL[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+    float laneR[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+    int tap, lane;
+
+    for (tap = 0; tap < RESAMPLE_TAPS; tap += 8)
+    {
+        for (lane = 0; lane < 8; lane++)
+        {
+            float coeff = taps[tap + lane] + ((nextTaps[tap + lane] - taps[tap + lane]) * blend);
+
+            laneL[lane] += inL[tap + lane] * coeff;
+            laneR[lane] += inR[tap + lane] * coeff;
+        }
+    }
+
+    for (lane = 0; lane < 4; lane++)
+    {
+        laneL[lane] += laneL[lane + 4];
+        laneR[lane] += laneR[lane + 4];
+    }
+
+    out[0] = roundSample((laneL[0] + laneL[2]) + (laneL[1] + laneL[3]));
+    out[1] = roundSample((laneR[0] + laneR[2]) + (laneR[1] + laneR[3]));
+}
+
+#if defined(__AVX2__)
+static void sincFrame(const float* inL, const float* inR, const float* taps, const float* nextTaps, float blend, int16_t* out)
+{
+    __m256 sumL = _mm256_setzero_ps();
+    __m256 sumR = _mm256_setzero_ps();
+    __m256 weight = _mm256_set1_ps(blend);
+    __m128 halfL, halfR, pair;
+    int32_t packed;
+    int tap;
+
+    for (tap = 0; tap < RESAMPLE_TAPS; tap += 8)
+    {
+        __m256 coeff = _mm256_loadu_ps(&taps[tap]);
+
+        coeff = _mm256_add_ps(coeff, _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(&nextTaps[tap]), coeff), weight));
+
+        sumL = _mm256_add_ps(sumL, _mm256_mul_ps(_mm256_loadu_ps(&inL[tap]), coeff));
+        sumR = _mm256_add_ps(sumR, _mm256_mul_ps(_mm256_loadu_ps(&inR[tap]), coeff));
+    }
+
+    halfL = _mm_add_ps(_mm256_castps256_ps128(sumL), _mm256_extractf128_ps(sumL, 1));
+    halfR = _mm_add_ps(_mm256_castps256_ps128(sumR), _mm256_extractf128_ps(sumR, 1));
+
+    // Fold both down together, ending with left and right in the
+    // bottom two lanes so they pack straight into one frame
+    pair = _mm_add_ps(_mm_unpacklo_ps(halfL, halfR), _mm_unpackhi_ps(halfL, halfR));
+    pair = _mm_add_ps(pair, _mm_movehl_ps(pair, pair));
+
+    // Saturate both to 16 bits in one go
+    packed = _mm_cvtsi128_si32(_mm_packs_epi32(_mm_cvtps_epi32(pair), _mm_setzero_si128()));
+    out[0] = (int16_t)packed;
+    out[1] = (int16_t)(packed >> 16);
+}
+#elif defined(__SSE2__)
+// Two sums a side make the same eight lanes as the AVX2 version
+static void sincFrame(const float* inL, const float* inR, const float* taps, const float* nextTaps, float blend, int16_t* out)
+{
+    __m128 sumL[2] = { _mm_setzero_ps(), _mm_setzero_ps() };
+    __m128 sumR[2] = { _mm_setzero_ps(), _mm_setzero_ps() };
+    __m128 weight = _mm_set1_ps(blend);
+    __m128 halfL, halfR, pair;
+    int32_t packed;
+    int tap, half;
+
+    for (tap = 0; tap < RESAMPLE_TAPS; tap += 8)
+    {
+        for (half = 0; half < 2; half++)
+        {
+            __m128 coeff = _mm_loadu_ps(&taps[tap + (half * 4)]);
+
+            coeff = _mm_add_ps(coeff, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&nextTaps[tap + (half * 4)]), coeff), weight));
+
+            sumL[half] = _mm_add_ps(sumL[half], _mm_mul_ps(_mm_loadu_ps(&inL[tap + (half * 4)]), coeff));
+            sumR[half] = _mm_add_ps(sumR[half], _mm_mul_ps(_mm_loadu_ps(&inR[tap + (half * 4)]), coeff));
+        }
+    }
+
+    halfL = _mm_add_ps(sumL[0], sumL[1]);
+    halfR = _mm_add_ps(sumR[0], sumR[1]);
+
+    pair = _mm_add_ps(_mm_unpacklo_ps(halfL, halfR), _mm_unpackhi_ps(halfL, halfR));
+    pair = _mm_add_ps(pair, _mm_movehl_ps(pair, pair));
+
+    // Saturate both to 16 bits in one go
+    packed = _mm_cvtsi128_si32(_mm_packs_epi32(_mm_cvtps_epi32(pair), _mm_setzero_si128()));
+    out[0] = (int16_t)packed;
+    out[1] = (int16_t)(packed >> 16);
+}
+#else
+#define sincFrame sincFrameScalar
+#endif
+
+static int resampleSinc(const float* left, const float* right, int available, uint32_t* position, uint32_t step, int16_t* out, int scalar)
+{
+    uint32_t pos = *position;
+    int frames = 0;
+
+    if (!sincTableBuilt)
+    {
+        buildSincTable();
+    }
+
+    while ((int)(pos >> 16) + (RESAMPLE_TAPS / 2) < available)
+    {
+        int first = (int)(pos >> 16) - ((RESAMPLE_TAPS / 2) - 1);
+        const float* taps = sincTable[(pos >> (16 - RESAMPLE_PHASE_BITS)) & (RESAMPLE_PHASES - 1)];
+        float blend = (pos & ((1 << (16 - RESAMPLE_PHASE_BITS)) - 1)) * (1.0f / (1 << (16 - RESAMPLE_PHASE_BITS)));
+
+        if (scalar)
+        {
+            sincFrameScalar(&left[first], &right[first], taps, taps + RESAMPLE_TAPS, blend, &out[frames * 2]);
+        }
+        else
+        {
+            sincFrame(&left[first], &right[first], taps, taps + RESAMPLE_TAPS, blend, &out[frames * 2]);
+        }
+
+        frames++;
+        pos += step;
+    }
+
+    *position = pos;
+
+    return frames;
+}
+
+// Convert as much of the mixed input as the filter can see to the host rate,
+// position is 16.16 in input samples and is left on the next output sample.
+// The caller keeps the last RESAMPLE_HISTORY input samples for next time.
+int resampleSound(const float* left, const float* right, int available, uint32_t* position, uint32_t step, int16_t* out)
+{
+    if (RESAMPLE_LINEAR == quality)
+    {
+        return resampleLinear(left, right, available, position, step, out);
+    }
+
+    return resampleSinc(left, right, available, position, step, out, RESAMPLE_SINC_SCALAR == quality);
+}
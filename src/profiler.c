@@ -0,0 +1,467 @@
+/******************************************************************************
+DoGoBoy - Nintendo GameBoy Emulator
+*******************************************************************************
+Copyright (c) 2009-2013, Douglas Gore (doug@ssonic.co.uk)
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the Douglas Gore nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL DOUGLAS GORE BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*******************************************************************************
+Purpose:
+
+Profiler for the game's own code. Instructions and cycles are attributed to
+the ROM bank and address they ran from, either exactly for every instruction
+or by sampling whatever is running every so many cycles. Calls are followed
+through CALL, RST, interrupts and returns to build a call tree. Both the flat
+profile and the call tree are written in the folded stack format that
+flamegraph tools read, weighted by cycles.
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gameboy.h"
+
+// Prime, so sampling doesn't fall into step with the game's loops
+#define PROFILE_SAMPLE_CYCLES	1021
+
+// Every ROM bank gets a page of 16KB addresses, then VRAM/cart RAM and
+// WRAM/HRAM each get one whatever bank is mapped
+#define PROFILE_ROM_PAGES		512
+#define PROFILE_PAGES			(PROFILE_ROM_PAGES + 2)
+#define PROFILE_PAGE_SIZE		0x4000
+
+#define PROFILE_MAX_DEPTH		128
+#define PROFILE_TOP_ENTRIES		20
+
+// Call tree keys are the page and address of a function's entry point
+#define PROFILE_KEY(page, pc)	(((uint32_t)(page) << 16) | (pc))
+#define PROFILE_KEY_ROOT		0xFFFFFFFE
+#define PROFILE_KEY_HALTED		0xFFFFFFFF
+
+typedef struct
+{
+    uint32_t hits[PROFILE_PAGE_SIZE];	// Instructions run, or samples taken
+    uint64_t cycles[PROFILE_PAGE_SIZE];
+} profilePage;
+
+typedef struct
+{
+    uint32_t key;
+    int parent;
+    int firstChild;
+    int nextSibling;
+    uint16_t sp;						// Stack pointer just after the call
+    uint64_t cycles;					// Spent in the function itself
+} callNode;
+
+typedef struct
+{
+    uint32_t key;
+    uint32_t hits;
+    uint64_t cycles;
+} flatEntry;
+
+static profileMode mode = PROFILE_OFF;
+static char* outputPrefix = NULL;
+
+static profilePage* pages[PROFILE_PAGES];
+static uint64_t haltedCycles = 0;
+static uint64_t totalCycles = 0;
+
+static callNode* nodes = NULL;
+static int nodeCount = 0;
+static int nodeSpace = 0;
+static int currentNode = 0;
+static int depth = 0;
+static uint16_t lastSP = 0;
+
+static uint64_t nextSample = 0;
+
+// Which page the code at this address is in, with the banks mapped now
+static int pageOf(uint16_t pc)
+{
+    if (pc < 0x4000)
+    {
+        return gbState.currentRomBank0;
+    }
+    else if (pc < 0x8000)
+    {
+        return gbState.currentRomBank;
+    }
+
+    return PROFILE_ROM_PAGES + ((pc >> 14) - 2);
+}
+
+static void formatKey(uint32_t key, char* buffer, size_t size)
+{
+    unsigned int page = key >> 16;
+
+    if (PROFILE_KEY_ROOT == key)
+    {
+        snprintf(buffer, size, "start");
+    }
+    else if (PROFILE_KEY_HALTED == key)
+    {
+        snprintf(buffer, size, "[halted]");
+    }
+    else if (page >= PROFILE_ROM_PAGES)
+    {
+        snprintf(buffer, size, "ram:%04X", key & 0xFFFF);
+    }
+    else
+    {
+        snprintf(buffer, size, "%02X:%04X", page, key & 0xFFFF);
+    }
+}
+
+static int addNode(uint32_t key, int parent)
+{
+    callNode* node;
+
+    if (nodeCount == nodeSpace)
+    {
+        nodeSpace = nodeSpace ? (nodeSpace * 2) : 1024;
+        nodes = (callNode*)realloc(nodes, nodeSpace * sizeof(callNode));
+
+        if (NULL == nodes)
+        {
+            printf("Out of memory for the profiler call tree\n");
+            exit(1);
+        }
+    }
+
+    node = &nodes[nodeCount];
+    node->key = key;
+    node->parent = parent;
+    node->firstChild = -1;
+    node->nextSibling = -1;
+    node->sp = 0;
+    node->cycles = 0;
+
+    if (parent >= 0)
+    {
+        node->nextSibling = nodes[parent].firstChild;
+        nodes[parent].firstChild = nodeCount;
+    }
+
+    return nodeCount++;
+}
+
+static int findChild(int parent, uint32_t key)
+{
+    int child;
+
+    for (child = nodes[parent].firstChild; child >= 0; child = nodes[child].nextSibling)
+    {
+        if (nodes[child].key == key)
+        {
+            return child;
+        }
+    }
+
+    return addNode(key, parent);
+}
+
+// Add to the flat profile and to the function running now
+static void attribute(uint16_t pc, uint32_t hits, uint64_t cycles)
+{
+    int page = pageOf(pc);
+    profilePage* counts = pages[page];
+
+    if (NULL == counts)
+    {
+        counts = pages[page] = (profilePage*)calloc(1, sizeof(profilePage));
+
+        if (NULL == counts)
+        {
+            printf("Out of memory for the profiler\n");
+            exit(1);
+        }
+    }
+
+    counts->hits[pc & (PROFILE_PAGE_SIZE - 1)] += hits;
+    counts->cycles[pc & (PROFILE_PAGE_SIZE - 1)] += cycles;
+    nodes[currentNode].cycles += cycles;
+}
+
+// How many sample points fall within the cycles just run. The main loop
+// calls in before adding them to the cycle counter.
+static uint64_t samplesDue(int cycles)
+{
+    uint64_t end = gbState.cycles + cycles;
+    uint64_t samples = 0;
+
+    while (end > nextSample)
+    {
+        nextSample += PROFILE_SAMPLE_CYCLES;
+        samples++;
+    }
+
+    return samples;
+}
+
+static void enterFunction(uint16_t target)
+{
+    if (depth < PROFILE_MAX_DEPTH)
+    {
+        currentNode = findChild(currentNode, PROFILE_KEY(pageOf(target), target));
+        nodes[currentNode].sp = REGS.w.SP;
+        depth++;
+    }
+}
+
+// Leave every function whose return address is now above the stack, which
+// also copes with code that drops return addresses off the stack itself
+static void leaveFunctions(uint16_t sp)
+{
+    while ((depth > 0) && (nodes[currentNode].sp < sp))
+    {
+        currentNode = nodes[currentNode].parent;
+        depth--;
+    }
+}
+
+void initProfiler(profileMode newMode, const char* prefix)
+{
+    mode = newMode;
+
+    if (PROFILE_OFF == mode)
+    {
+        return;
+    }
+
+    outputPrefix = (char*)malloc(strlen(prefix) + 1);
+    strcpy(outputPrefix, prefix);
+
+    currentNode = addNode(PROFILE_KEY_ROOT, -1);
+    lastSP = REGS.w.SP;
+    nextSample = gbState.cycles + PROFILE_SAMPLE_CYCLES;
+}
+
+// Called after each instruction with where it started. A call pushes two
+// bytes and jumps away, a return pops and jumps; anything else that moves
+// the stack pointer runs on to the next instruction.
+void profileInstruction(uint16_t pc, int cycles)
+{
+    uint16_t sp = REGS.w.SP;
+    uint16_t length = REGS.w.PC - pc;
+
+    if (PROFILE_EXACT == mode)
+    {
+        attribute(pc, 1, cycles);
+    }
+    else if ((gbState.cycles + cycles) > nextSample)
+    {
+        uint64_t samples = samplesDue(cycles);
+
+        attribute(pc, (uint32_t)samples, samples * PROFILE_SAMPLE_CYCLES);
+    }
+
+    totalCycles += cycles;
+
+    if (sp != lastSP)
+    {
+        if ((sp == (uint16_t)(lastSP - 2)) && ((length == 0) || (length > 3)))
+        {
+            enterFunction(REGS.w.PC);
+        }
+        else if ((sp > lastSP) && ((length == 0) || (length > 3)))
+        {
+            leaveFunctions(sp);
+        }
+
+        lastSP = sp;
+    }
+}
+
+// Cycles spent halted count against the function that halted
+void profileHalted(int cycles)
+{
+    uint64_t counted = cycles;
+    int running = currentNode;
+
+    if (PROFILE_SAMPLE == mode)
+    {
+        counted = samplesDue(cycles) * PROFILE_SAMPLE_CYCLES;
+    }
+
+    currentNode = findChild(currentNode, PROFILE_KEY_HALTED);
+    nodes[currentNode].cycles += counted;
+    currentNode = running;
+
+    haltedCycles += counted;
+    totalCycles += cycles;
+}
+
+// The CPU has just pushed PC and jumped to an interrupt vector
+void profileInterrupt(void)
+{
+    if (PROFILE_OFF == mode)
+    {
+        return;
+    }
+
+    enterFunction(REGS.w.PC);
+    lastSP = REGS.w.SP;
+}
+
+static int compareEntries(const void* a, const void* b)
+{
+    const flatEntry* ea = (const flatEntry*)a;
+    const flatEntry* eb = (const flatEntry*)b;
+
+    return (ea->cycles < eb->cycles) - (ea->cycles > eb->cycles);
+}
+
+// Write the folded stack of every node that has cycles of its own
+static void writeFolded(FILE* file, int node, char* path, size_t length)
+{
+    char name[16];
+    int child;
+
+    formatKey(nodes[node].key, name, sizeof(name));
+
+    if ((length + strlen(name) + 2) >= (PROFILE_MAX_DEPTH * 16))
+    {
+        return;
+    }
+
+    length += sprintf(&path[length], "%s%s", length ? ";" : "", name);
+
+    if (nodes[node].cycles)
+    {
+        fprintf(file, "%s %llu\n", path, (unsigned long long)nodes[node].cycles);
+    }
+
+    for (child = nodes[node].firstChild; child >= 0; child = nodes[child].nextSibling)
+    {
+        writeFolded(file, child, path, length);
+    }
+}
+
+// Write out both profiles and print the hottest addresses
+void closeProfiler(void)
+{
+    static char path[PROFILE_MAX_DEPTH * 16];
+    char filename[1024];
+    flatEntry* entries;
+    int entryCount = 0;
+    uint64_t counted = haltedCycles;
+    FILE* file;
+    int page, pc, ii;
+
+    if (PROFILE_OFF == mode)
+    {
+        return;
+    }
+
+    for (page = 0; page < PROFILE_PAGES; page++)
+    {
+        for (pc = 0; pages[page] && (pc < PROFILE_PAGE_SIZE); pc++)
+        {
+            entryCount += (pages[page]->hits[pc] != 0);
+        }
+    }
+
+    entries = (flatEntry*)malloc((entryCount + 1) * sizeof(flatEntry));
+    entryCount = 0;
+
+    for (page = 0; page < PROFILE_PAGES; page++)
+    {
+        for (pc = 0; pages[page] && (pc < PROFILE_PAGE_SIZE); pc++)
+        {
+            if (pages[page]->hits[pc])
+            {
+                // Bank 0 is normally mapped low and the others high
+                uint16_t address = (page < PROFILE_ROM_PAGES) ? (uint16_t)(pc + ((page ? 1 : 0) * PROFILE_PAGE_SIZE))
+                                                              : (uint16_t)(pc + ((page - PROFILE_ROM_PAGES + 2) * PROFILE_PAGE_SIZE));
+
+                entries[entryCount].key = PROFILE_KEY(page, address);
+                entries[entryCount].hits = pages[page]->hits[pc];
+                entries[entryCount].cycles = pages[page]->cycles[pc];
+                counted += entries[entryCount].cycles;
+                entryCount++;
+            }
+        }
+
+        free(pages[page]);
+        pages[page] = NULL;
+    }
+
+    qsort(entries, entryCount, sizeof(flatEntry), compareEntries);
+
+    snprintf(filename, sizeof(filename), "%s.flat", outputPrefix);
+    file = fopen(filename, "w");
+
+    if (file)
+    {
+        for (ii = 0; ii < entryCount; ii++)
+        {
+            char name[16];
+
+            formatKey(entries[ii].key, name, sizeof(name));
+            fprintf(file, "%s %llu\n", name, (unsigned long long)entries[ii].cycles);
+        }
+
+        if (haltedCycles)
+        {
+            fprintf(file, "[halted] %llu\n", (unsigned long long)haltedCycles);
+        }
+
+        fclose(file);
+    }
+
+    snprintf(filename, sizeof(filename), "%s.folded", outputPrefix);
+    file = fopen(filename, "w");
+
+    if (file)
+    {
+        writeFolded(file, 0, path, 0);
+        fclose(file);
+    }
+
+    printf("\n%s profile of %llu cycles, %.1f%% halted, written to %s.flat and %s.folded\n",
+           (PROFILE_EXACT == mode) ? "Exact" : "Sampled", (unsigned long long)totalCycles,
+           counted ? ((haltedCycles * 100.0) / counted) : 0.0, outputPrefix, outputPrefix);
+    printf("address  %12s %14s %7s\n", (PROFILE_EXACT == mode) ? "instructions" : "samples", "cycles", "share");
+
+    for (ii = 0; (ii < entryCount) && (ii < PROFILE_TOP_ENTRIES); ii++)
+    {
+        char name[16];
+
+        formatKey(entries[ii].key, name, sizeof(name));
+        printf("%-8s %12u %14llu %6.2f%%\n", name, entries[ii].hits,
+               (unsigned long long)entries[ii].cycles, (entries[ii].cycles * 100.0) / counted);
+    }
+
+    free(entries);
+    free(nodes);
+    free(outputPrefix);
+
+    nodes = NULL;
+    nodeCount = nodeSpace = 0;
+    outputPrefix = NULL;
+    mode = PROFILE_OFF;
+}
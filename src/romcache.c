@@ -0,0 +1,354 @@
+/******************************************************************************
+DoGoBoy - Nintendo GameBoy Emulator
+*******************************************************************************
+Copyright (c) 2009-2013, Douglas Gore (doug@ssonic.co.uk)
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the Douglas Gore nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL DOUGLAS GORE BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*******************************************************************************
+Purpose:
+
+Cartridge ROM loading. ROM images are mapped read-only and shared through a
+reference counted cache, so every instance running the same cartridge, in
+this process or any other, uses the same physical pages.
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__WIN32__) || defined(_MSC_VER)
+#define ROM_CACHE_NO_MMAP
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "gameboy.h"
+
+// The cartridge header, from the entry point to the global checksum
+#define ROM_HEADER_START		0x100
+#define ROM_HEADER_END			0x150
+
+typedef struct romCacheEntry
+{
+    char* path;
+    uint32_t headerHash;
+    size_t length;
+    uint8_t* data;
+    int refCount;
+    struct romCacheEntry* next;
+} romCacheEntry;
+
+static romCacheEntry* romCache = NULL;
+
+// FNV-1a hash of the cartridge header and file length. The header holds the
+// title and both checksums so it tells images at the same path apart without
+// reading the whole file.
+static uint32_t hashRomHeader(const uint8_t* header, size_t length)
+{
+    uint32_t hash = 2166136261U;
+    size_t ii;
+
+    for (ii = 0; ii < (ROM_HEADER_END - ROM_HEADER_START); ii++)
+    {
+        hash = (hash ^ header[ii]) * 16777619U;
+    }
+
+    for (ii = 0; ii < sizeof(length); ii++)
+    {
+        hash = (hash ^ ((length >> (ii * 8)) & 0xFF)) * 16777619U;
+    }
+
+    return hash;
+}
+
+#ifdef ROM_CACHE_NO_MMAP
+
+// No mmap here, so read the image into the heap. It is still shared between
+// instances in this process through the cache.
+static uint8_t* mapRomFile(const char* filename, size_t* length, uint32_t* headerHash)
+{
+    FILE* fp;
+    uint8_t* data;
+    long fileLength;
+
+    fp = fopen(filename, "rb");
+
+    if (NULL == fp)
+    {
+        return NULL;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    fileLength = ftell(fp);
+    rewind(fp);
+
+    if (fileLength < ROM_HEADER_END)
+    {
+        fclose(fp);
+        return NULL;
+    }
+
+    data = malloc(fileLength);
+
+    if ((NULL == data) || (fread(data, 1, fileLength, fp) != (size_t)fileLength))
+    {
+        free(data);
+        fclose(fp);
+        return NULL;
+    }
+
+    fclose(fp);
+
+    *length = fileLength;
+    *headerHash = hashRomHeader(&data[ROM_HEADER_START], *length);
+
+    return data;
+}
+
+static void unmapRomFile(uint8_t* data, size_t length)
+{
+    free(data);
+}
+
+static char* canonicalPath(const char* filename)
+{
+    char* path = malloc(strlen(filename) + 1);
+
+    if (path)
+    {
+        strcpy(path, filename);
+    }
+
+    return path;
+}
+
+#else
+
+static uint8_t* mapRomFile(const char* filename, size_t* length, uint32_t* headerHash)
+{
+    struct stat info;
+    uint8_t* data;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+
+    if (fd < 0)
+    {
+        return NULL;
+    }
+
+    if ((fstat(fd, &info) != 0) || (info.st_size < ROM_HEADER_END))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    // MAP_SHARED so every process mapping the file shares the page cache
+    data = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (MAP_FAILED == data)
+    {
+        return NULL;
+    }
+
+    *length = info.st_size;
+    *headerHash = hashRomHeader(&data[ROM_HEADER_START], *length);
+
+    return data;
+}
+
+static void unmapRomFile(uint8_t* data, size_t length)
+{
+    munmap(data, length);
+}
+
+static char* canonicalPath(const char* filename)
+{
+    char* path = realpath(filename, NULL);
+
+    if ((NULL == path) && (path = malloc(strlen(filename) + 1)))
+    {
+        strcpy(path, filename);
+    }
+
+    return path;
+}
+
+#endif
+
+#ifdef ROM_CACHE_NO_MMAP
+
+void adviseRomAccess(const uint8_t* data, size_t length, romAccess access)
+{
+}
+
+long residentRomBytes(const uint8_t* data, size_t offset, size_t length)
+{
+    return -1;
+}
+
+#else
+
+// Tell the kernel how the image is about to be used. Banks are hit in
+// whatever order the game switches them, so read-ahead would only fault in
+// banks nobody asked for.
+void adviseRomAccess(const uint8_t* data, size_t length, romAccess access)
+{
+    long pageSize = sysconf(_SC_PAGESIZE);
+    size_t start = (size_t)data & ~(size_t)(pageSize - 1);
+    int advice;
+
+    switch (access)
+    {
+    case ROM_ACCESS_NEEDED: advice = MADV_WILLNEED; break;
+    case ROM_ACCESS_RANDOM:
+    default: advice = MADV_RANDOM; break;
+    }
+
+    madvise((void*)start, length + ((size_t)data - start), advice);
+}
+
+// How much of part of the image is in the page cache, or -1 if that can't
+// be found out
+long residentRomBytes(const uint8_t* data, size_t offset, size_t length)
+{
+    long pageSize = sysconf(_SC_PAGESIZE);
+    size_t pages = (length + pageSize - 1) / pageSize;
+    unsigned char* resident;
+    long count = 0;
+    size_t ii;
+
+    resident = malloc(pages);
+
+    if ((NULL == resident) || (mincore((void*)&data[offset], length, resident) != 0))
+    {
+        free(resident);
+        return -1;
+    }
+
+    for (ii = 0; ii < pages; ii++)
+    {
+        count += resident[ii] & 1;
+    }
+
+    free(resident);
+
+    return count * pageSize;
+}
+
+#endif
+
+// Get a read-only view of a ROM image, sharing an existing one if the same
+// image is already loaded. Returns NULL if the file can't be read.
+const uint8_t* acquireRom(const char* filename, size_t* length)
+{
+    romCacheEntry* entry;
+    uint32_t headerHash;
+    size_t mappedLength;
+    uint8_t* data;
+    char* path;
+
+    path = canonicalPath(filename);
+
+    if (NULL == path)
+    {
+        return NULL;
+    }
+
+    // Mapping the file again is cheap, it's only kept if the image is new
+    data = mapRomFile(path, &mappedLength, &headerHash);
+
+    if (NULL == data)
+    {
+        free(path);
+        return NULL;
+    }
+
+    for (entry = romCache; entry != NULL; entry = entry->next)
+    {
+        if ((entry->headerHash == headerHash) && (entry->length == mappedLength) && (0 == strcmp(entry->path, path)))
+        {
+            unmapRomFile(data, mappedLength);
+            free(path);
+
+            entry->refCount++;
+            *length = entry->length;
+
+            return entry->data;
+        }
+    }
+
+    entry = malloc(sizeof(romCacheEntry));
+
+    if (NULL == entry)
+    {
+        unmapRomFile(data, mappedLength);
+        free(path);
+        return NULL;
+    }
+
+    entry->path = path;
+    entry->headerHash = headerHash;
+    entry->length = mappedLength;
+    entry->data = data;
+    entry->refCount = 1;
+    entry->next = romCache;
+    romCache = entry;
+
+    *length = mappedLength;
+
+    return data;
+}
+
+// Drop a reference to a ROM image, unmapping it once nobody is using it
+void releaseRom(const uint8_t* data)
+{
+    romCacheEntry** link;
+
+    for (link = &romCache; *link != NULL; link = &(*link)->next)
+    {
+        romCacheEntry* entry = *link;
+
+        if (entry->data == data)
+        {
+            entry->refCount--;
+
+            if (0 == entry->refCount)
+            {
+                *link = entry->next;
+
+                unmapRomFile(entry->data, entry->length);
+                free(entry->path);
+                free(entry);
+            }
+
+            return;
+        }
+    }
+}
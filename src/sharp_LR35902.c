@@ -964,7 +964,9 @@ static __inline unsigned int executeExetendedOpcode(void)
 	writeLog("0x%04X: %s\n", REGS.w.PC - 1, cb_opcodes[opcode].text);
 #endif
 
+#ifdef DEBUG_OPCODE_COVERAGE
     cb_opcode_coverage[opcode]++;
+#endif
 
 	cycles_executed = cb_opcode_cycles[opcode];
 
@@ -1300,7 +1302,9 @@ unsigned int executeOpcode(void)
 
     //opRecord[opIndex++] = pcOffset;
 
+#ifdef DEBUG_OPCODE_COVERAGE
     opcode_coverage[opcode]++;
+#endif
 
 #ifdef GAMEBOY_DEBUG
 	if (REGS.w.PC == breakpoint)
@@ -1642,11 +1646,11 @@ unsigned int executeOpcode(void)
     case 0xC9: REGS.w.PC = popWordFromStack(); break;
 
     // RETI
-    case 0xD9: REGS.w.PC = popWordFromStack(); gbState.IME = 1; break;
+    case 0xD9: REGS.w.PC = popWordFromStack(); setInterruptMaster(1); break;
 
     // Interrupts
-    case 0xF3: gbState.IME = 0; break;  // DI
-    case 0xFB: gbState.IME = 1; break;  // EI
+    case 0xF3: setInterruptMaster(0); break;  // DI
+    case 0xFB: enableInterruptsDelayed(); break;  // EI
 
     // Restarts
     case 0xC7: cpuRST(0x00); break;
@@ -1659,10 +1663,10 @@ unsigned int executeOpcode(void)
     case 0xFF: cpuRST(0x38); break;
 
 	// HALT
-    case 0x76: gbState.cpuHalted = 1; break;
+    case 0x76: haltCpu(1); break;
 
 	// STOP (non-Z80)
-    case 0x10: gbState.cpuHalted = 2; break;
+    case 0x10: haltCpu(2); break;
 
 	// RLCA
 	case 0x07: REGS.b.A = cpuRLC(REGS.b.A); break;
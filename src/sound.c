@@ -0,0 +1,1018 @@
+/******************************************************************************
+DoGoBoy - Nintendo GameBoy Emulator
+*******************************************************************************
+Copyright (c) 2009-2013, Douglas Gore (doug@ssonic.co.uk)
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the Douglas Gore nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL DOUGLAS GORE BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*******************************************************************************
+Purpose:
+
+The sound processor. The four channels are synthesised with band-limited step
+insertion, every change of a channel's output level drops a windowed-sinc step
+into that channel's buffer at the exact cycle it happened, so the cost scales
+with the number of waveform edges rather than the number of output samples.
+Finished samples are mixed, resampled and handed to the SDL audio callback
+through a lock-free single-producer/single-consumer ring.
+******************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "SDL.h"
+
+#include "gameboy.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// Internal sample rate, one sample every 64 cycles (65536Hz)
+#define APU_SAMPLE_SHIFT	6
+#define APU_RATE			(CPU_CLOCK_HZ >> APU_SAMPLE_SHIFT)
+
+#define OUTPUT_RATE			48000
+#define OUTPUT_SAMPLES		256			// SDL callback size, ~5ms
+
+// Latency the frame pacing holds the output at, including the device's own
+// buffer, and how far the resampling ratio may be bent to get there
+#define SOUND_LATENCY_MS	20
+#define RATE_ADJUST_MAX		0.005
+#define RATE_ADJUST_GAIN	0.02
+
+// Band-limited step kernel, 16 taps with 32 sub-sample phases. The phase is
+// taken from the cycle offset within a sample (64 cycles / 32 phases).
+#define BLEP_TAPS			16
+#define BLEP_PHASES			32
+#define BLEP_PHASE_SHIFT	1
+#define BLEP_CUTOFF_HZ		20000.0
+
+// Samples collected before they are mixed and pushed to the ring
+#define SOUND_BLOCK_SAMPLES	1024
+#define SOUND_BUFFER_SAMPLES	(SOUND_BLOCK_SAMPLES + (2 * BLEP_TAPS))
+
+// Output frames the ring can hold, must be a power of two
+#define RING_FRAMES			8192
+#define RING_MASK			(RING_FRAMES - 1)
+
+// 4 channels x level 15 x master volume 8 fits comfortably in 16 bits
+#define MIX_SCALE			64.0f
+
+// The frame sequencer runs at 512Hz
+#define SEQUENCER_PERIOD	8192
+
+#define NUM_CHANNELS		4
+
+#define NR52_POWER			0x80
+
+typedef struct
+{
+    uint8_t enabled;				// Channel status bit in NR52
+    uint8_t dacOn;
+    uint8_t volume;					// Envelope volume (0-15)
+    uint8_t envelopeTimer;
+    uint8_t lengthEnabled;
+    uint16_t lengthCounter;
+    uint16_t frequency;				// 11-bit frequency from NRx3/NRx4
+    uint8_t position;				// Step through the duty cycle or wave RAM
+    uint8_t sample;					// Current wave RAM nibble
+    uint16_t lfsr;					// Noise shift register
+    int period;						// Cycles between waveform steps
+    uint64_t nextEdge;				// Cycle of the next waveform step
+    int level;						// Level last fed to the step buffer
+} soundChannel;
+
+static soundChannel channels[NUM_CHANNELS];
+
+// Steps for all four channels side by side, and where each one has
+// integrated up to
+static float stepBuffer[SOUND_BUFFER_SAMPLES][NUM_CHANNELS];
+static float integrators[NUM_CHANNELS];
+
+static uint8_t apuPower;
+static uint8_t sequencerStep;
+static uint64_t sequencerCycle;		// Cycle of the next frame sequencer tick
+static uint64_t apuCycle;			// Cycle synthesised up to
+static uint64_t bufferCycle;		// Cycle of the first sample in the buffers
+
+static uint16_t sweepShadow;
+static uint8_t sweepTimer;
+static uint8_t sweepEnabled;
+
+// Nothing is synthesised when there is nowhere for the samples to go
+static int soundOutput = 0;
+static int soundCapture = 0;
+static SDL_AudioDeviceID audioDevice = 0;
+
+static float blepKernel[BLEP_PHASES][BLEP_TAPS];
+
+// Mixed samples at the internal rate, with the end of the previous block
+// kept in front for the resampling filter
+static float mixLeft[RESAMPLE_HISTORY + SOUND_BLOCK_SAMPLES];
+static float mixRight[RESAMPLE_HISTORY + SOUND_BLOCK_SAMPLES];
+static uint32_t resamplePosition;	// 16.16 position into the mixed samples
+static uint32_t resampleStep;
+static uint32_t resampleBaseStep;
+
+// Ring fill just after each frame's samples are pushed, what it is aiming for
+// and its running average
+static int frameFrames;
+static int peakTarget;
+static double peakAverage;
+
+static int16_t ringBuffer[RING_FRAMES * 2];
+static SDL_atomic_t ringRead;
+static SDL_atomic_t ringWrite;
+
+static const uint8_t dutyCycles[4] = { 0x01, 0x81, 0x87, 0x7E };
+
+static const uint8_t noiseDivisors[8] = { 8, 16, 32, 48, 64, 80, 96, 112 };
+
+static const uint8_t waveShifts[4] = { 4, 0, 1, 2 };
+
+// Bits that always read back as one, indexed from NR10
+static const uint8_t readMasks[0x20] =
+{
+    0x80, 0x3F, 0x00, 0xFF, 0xBF,	// NR10-NR14
+    0xFF, 0x3F, 0x00, 0xFF, 0xBF,	// NR20-NR24
+    0x7F, 0xFF, 0x9F, 0xFF, 0xBF,	// NR30-NR34
+    0xFF, 0xFF, 0x00, 0x00, 0xBF,	// NR40-NR44
+    0x00, 0x00, 0x70,				// NR50-NR52
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+};
+
+#define SOUND_REG(address)	gbIO.regs[(address) - ADDR_IO_PORTS]
+
+// Build the windowed-sinc impulse for each sub-sample phase. Each phase sums
+// to one so a step of n raises the integrated output by exactly n.
+static void initBlepKernel(void)
+{
+    const double cutoff = (2.0 * BLEP_CUTOFF_HZ) / APU_RATE;
+    int phase, tap;
+
+    for (phase = 0; phase < BLEP_PHASES; phase++)
+    {
+        double offset = (phase + 0.5) / BLEP_PHASES;
+        double sum = 0;
+
+        for (tap = 0; tap < BLEP_TAPS; tap++)
+        {
+            double x = tap - ((BLEP_TAPS / 2) - 1) - offset;
+            double sinc = (0 == x) ? 1.0 : sin(M_PI * cutoff * x) / (M_PI * cutoff * x);
+            double window = 0.42 + (0.5 * cos(M_PI * x / (BLEP_TAPS / 2))) + (0.08 * cos(2.0 * M_PI * x / (BLEP_TAPS / 2)));
+
+            if (fabs(x) >= (BLEP_TAPS / 2))
+            {
+                window = 0;
+            }
+
+            blepKernel[phase][tap] = (float)(sinc * window);
+            sum += sinc * window;
+        }
+
+        for (tap = 0; tap < BLEP_TAPS; tap++)
+        {
+            blepKernel[phase][tap] = (float)(blepKernel[phase][tap] / sum);
+        }
+    }
+}
+
+// Change a channel's output level at the given cycle
+static void setLevel(soundChannel* chan, uint64_t cycle, int level)
+{
+    int delta = level - chan->level;
+
+    if (delta && soundOutput)
+    {
+        uint64_t offset = cycle - bufferCycle;
+        const float* kernel = blepKernel[(offset & ((1 << APU_SAMPLE_SHIFT) - 1)) >> BLEP_PHASE_SHIFT];
+        float* out = &stepBuffer[offset >> APU_SAMPLE_SHIFT][chan - channels];
+        int tap;
+
+        for (tap = 0; tap < BLEP_TAPS; tap++)
+        {
+            out[tap * NUM_CHANNELS] += kernel[tap] * delta;
+        }
+    }
+
+    chan->level = level;
+}
+
+// The level the channel is currently putting out
+static int channelOutput(int ch)
+{
+    soundChannel* chan = &channels[ch];
+
+    if (!chan->enabled || !chan->dacOn)
+    {
+        return 0;
+    }
+
+    switch (ch)
+    {
+    case 0:
+        return ((dutyCycles[gbIO.SNDREG11 >> 6] >> (7 - chan->position)) & 1) ? chan->volume : 0;
+    case 1:
+        return ((dutyCycles[gbIO.SNDREG21 >> 6] >> (7 - chan->position)) & 1) ? chan->volume : 0;
+    case 2:
+        return chan->sample >> waveShifts[(gbIO.SNDREG32 >> 5) & 0x03];
+    default:
+        return (chan->lfsr & 1) ? 0 : chan->volume;
+    }
+}
+
+static void refreshLevels(uint64_t cycle)
+{
+    int ch;
+
+    for (ch = 0; ch < NUM_CHANNELS; ch++)
+    {
+        setLevel(&channels[ch], cycle, channelOutput(ch));
+    }
+}
+
+// Cycles between waveform steps for the current frequency settings
+static void updatePeriod(int ch)
+{
+    soundChannel* chan = &channels[ch];
+
+    switch (ch)
+    {
+    case 0:
+    case 1:
+        chan->period = (2048 - chan->frequency) * 4;
+        break;
+    case 2:
+        chan->period = (2048 - chan->frequency) * 2;
+        break;
+    default:
+        chan->period = noiseDivisors[gbIO.SNDREG43 & 0x07] << (gbIO.SNDREG43 >> 4);
+        break;
+    }
+}
+
+// Each channel steps through all its waveform edges before the given cycle
+// in a loop of its own, keeping its state in locals and only touching the
+// step buffer when the output level actually changes. An enabled channel
+// always has its DAC on.
+static void runSquare(soundChannel* chan, uint8_t lengthDuty, uint64_t end)
+{
+    uint8_t duty = dutyCycles[lengthDuty >> 6];
+    uint64_t edge = chan->nextEdge;
+    uint8_t position = chan->position;
+    int period = chan->period;
+
+    while (edge < end)
+    {
+        int level;
+
+        position = (position + 1) & 0x07;
+        level = ((duty >> (7 - position)) & 1) ? chan->volume : 0;
+
+        if (level != chan->level)
+        {
+            setLevel(chan, edge, level);
+        }
+
+        edge += period;
+    }
+
+    chan->nextEdge = edge;
+    chan->position = position;
+}
+
+static void runWave(soundChannel* chan, uint64_t end)
+{
+    uint8_t shift = waveShifts[(gbIO.SNDREG32 >> 5) & 0x03];
+    uint64_t edge = chan->nextEdge;
+    uint8_t position = chan->position;
+    uint8_t sample = chan->sample;
+    int period = chan->period;
+
+    while (edge < end)
+    {
+        position = (position + 1) & 0x1F;
+        sample = (gbIO.WAVERAM[position >> 1] >> ((position & 1) ? 0 : 4)) & 0x0F;
+
+        if ((sample >> shift) != chan->level)
+        {
+            setLevel(chan, edge, sample >> shift);
+        }
+
+        edge += period;
+    }
+
+    chan->nextEdge = edge;
+    chan->position = position;
+    chan->sample = sample;
+}
+
+static void runNoise(soundChannel* chan, uint64_t end)
+{
+    uint16_t shortMask = (gbIO.SNDREG43 & 0x08) ? 0x40 : 0;
+    uint64_t edge = chan->nextEdge;
+    uint16_t lfsr = chan->lfsr;
+    int period = chan->period;
+
+    while (edge < end)
+    {
+        uint16_t feedback = (lfsr ^ (lfsr >> 1)) & 1;
+        int level;
+
+        lfsr = (lfsr >> 1) | (feedback << 14);
+        lfsr = (lfsr & ~shortMask) | (feedback ? shortMask : 0);
+        level = (lfsr & 1) ? 0 : chan->volume;
+
+        if (level != chan->level)
+        {
+            setLevel(chan, edge, level);
+        }
+
+        edge += period;
+    }
+
+    chan->nextEdge = edge;
+    chan->lfsr = lfsr;
+}
+
+// Work out the next frequency from the sweep shadow register, which turns
+// the channel off if it overflows
+static uint16_t sweepFrequency(void)
+{
+    uint16_t delta = sweepShadow >> (gbIO.SNDREG10 & 0x07);
+    uint16_t frequency = (gbIO.SNDREG10 & 0x08) ? (sweepShadow - delta) : (sweepShadow + delta);
+
+    if (frequency > 2047)
+    {
+        channels[0].enabled = 0;
+    }
+
+    return frequency;
+}
+
+static void clockSweep(void)
+{
+    uint8_t period = (gbIO.SNDREG10 >> 4) & 0x07;
+
+    if (--sweepTimer)
+    {
+        return;
+    }
+
+    sweepTimer = period ? period : 8;
+
+    if (sweepEnabled && period)
+    {
+        uint16_t frequency = sweepFrequency();
+
+        if ((frequency <= 2047) && (gbIO.SNDREG10 & 0x07))
+        {
+            sweepShadow = frequency;
+            channels[0].frequency = frequency;
+            gbIO.SNDREG13 = frequency & 0xFF;
+            gbIO.SNDREG14 = (gbIO.SNDREG14 & ~0x07) | (frequency >> 8);
+            updatePeriod(0);
+
+            sweepFrequency();
+        }
+    }
+}
+
+static void clockEnvelope(soundChannel* chan, uint8_t envelope)
+{
+    uint8_t period = envelope & 0x07;
+
+    if (0 == period)
+    {
+        return;
+    }
+
+    if (--chan->envelopeTimer)
+    {
+        return;
+    }
+
+    chan->envelopeTimer = period;
+
+    if ((envelope & 0x08) && (chan->volume < 15))
+    {
+        chan->volume++;
+    }
+    else if (!(envelope & 0x08) && (chan->volume > 0))
+    {
+        chan->volume--;
+    }
+}
+
+// Length at 256Hz, sweep at 128Hz and envelopes at 64Hz
+static void clockSequencer(uint64_t cycle)
+{
+    int ch;
+
+    if (0 == (sequencerStep & 1))
+    {
+        for (ch = 0; ch < NUM_CHANNELS; ch++)
+        {
+            soundChannel* chan = &channels[ch];
+
+            if (chan->lengthEnabled && chan->lengthCounter)
+            {
+                if (0 == --chan->lengthCounter)
+                {
+                    chan->enabled = 0;
+                }
+            }
+        }
+    }
+
+    if ((2 == sequencerStep) || (6 == sequencerStep))
+    {
+        clockSweep();
+    }
+
+    if (7 == sequencerStep)
+    {
+        clockEnvelope(&channels[0], gbIO.SNDREG12);
+        clockEnvelope(&channels[1], gbIO.SNDREG22);
+        clockEnvelope(&channels[3], gbIO.SNDREG42);
+    }
+
+    sequencerStep = (sequencerStep + 1) & 0x07;
+
+    refreshLevels(cycle);
+}
+
+// Push stereo frames into the ring, whatever doesn't fit is dropped so the
+// emulation never waits for the audio device
+static void pushFrames(const int16_t* frames, int count)
+{
+    int writePos = SDL_AtomicGet(&ringWrite);
+    int space = RING_FRAMES - (writePos - SDL_AtomicGet(&ringRead));
+    int ii;
+
+    if (count > space)
+    {
+        count = space;
+    }
+
+    for (ii = 0; ii < count; ii++)
+    {
+        ringBuffer[((writePos + ii) & RING_MASK) * 2] = frames[ii * 2];
+        ringBuffer[(((writePos + ii) & RING_MASK) * 2) + 1] = frames[(ii * 2) + 1];
+    }
+
+    // The samples have to be visible before the consumer sees the new index
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicSet(&ringWrite, writePos + count);
+}
+
+// Mix, resample and send off the samples before the synthesis point, then
+// move whatever is left of the step tails to the front of the buffer
+static void flushSamples(void)
+{
+    // Room for the block at the lowest resampling ratio
+    int16_t frames[((SOUND_BLOCK_SAMPLES * OUTPUT_RATE) / APU_RATE + 16) * 2];
+    int count = (int)((apuCycle - bufferCycle) >> APU_SAMPLE_SHIFT);
+    float leftVolume = (((gbIO.SNDREG50 >> 4) & 0x07) + 1) * MIX_SCALE;
+    float rightVolume = ((gbIO.SNDREG50 & 0x07) + 1) * MIX_SCALE;
+    float leftGains[NUM_CHANNELS];
+    float rightGains[NUM_CHANNELS];
+    int outCount;
+    int ch;
+
+    if (0 == count)
+    {
+        return;
+    }
+
+    // Without an output there's nothing in the buffer to mix
+    if (!soundOutput)
+    {
+        bufferCycle = apuCycle;
+        return;
+    }
+
+    for (ch = 0; ch < NUM_CHANNELS; ch++)
+    {
+        leftGains[ch] = ((gbIO.SNDREG51 >> (ch + 4)) & 1) ? leftVolume : 0;
+        rightGains[ch] = ((gbIO.SNDREG51 >> ch) & 1) ? rightVolume : 0;
+    }
+
+    mixSoundChannels(&stepBuffer[0][0], count, integrators, leftGains, rightGains, &mixLeft[RESAMPLE_HISTORY], &mixRight[RESAMPLE_HISTORY]);
+
+    memmove(stepBuffer, stepBuffer[count], (SOUND_BUFFER_SAMPLES - count) * sizeof(stepBuffer[0]));
+    memset(stepBuffer[SOUND_BUFFER_SAMPLES - count], 0, count * sizeof(stepBuffer[0]));
+
+    bufferCycle += (uint64_t)count << APU_SAMPLE_SHIFT;
+
+    outCount = resampleSound(mixLeft, mixRight, RESAMPLE_HISTORY + count, &resamplePosition, resampleStep, frames);
+
+    memmove(mixLeft, &mixLeft[count], RESAMPLE_HISTORY * sizeof(float));
+    memmove(mixRight, &mixRight[count], RESAMPLE_HISTORY * sizeof(float));
+    resamplePosition -= count << 16;
+
+    if (audioDevice)
+    {
+        pushFrames(frames, outCount);
+    }
+
+    if (soundCapture)
+    {
+        captureFrames(frames, outCount);
+    }
+}
+
+// Synthesise everything up to the given cycle. The work is split at frame
+// sequencer ticks, since those change volumes and lengths, and at the end of
+// each buffer block.
+static void runApu(uint64_t until)
+{
+    while (apuCycle < until)
+    {
+        uint64_t end = until;
+        uint64_t blockEnd = bufferCycle + ((uint64_t)SOUND_BLOCK_SAMPLES << APU_SAMPLE_SHIFT);
+
+        if (sequencerCycle < end)
+        {
+            end = sequencerCycle;
+        }
+
+        if (blockEnd < end)
+        {
+            end = blockEnd;
+        }
+
+        if (soundOutput)
+        {
+            if (channels[0].enabled)
+            {
+                runSquare(&channels[0], gbIO.SNDREG11, end);
+            }
+
+            if (channels[1].enabled)
+            {
+                runSquare(&channels[1], gbIO.SNDREG21, end);
+            }
+
+            if (channels[2].enabled)
+            {
+                runWave(&channels[2], end);
+            }
+
+            if (channels[3].enabled)
+            {
+                runNoise(&channels[3], end);
+            }
+        }
+
+        apuCycle = end;
+
+        if (apuCycle == sequencerCycle)
+        {
+            if (apuPower)
+            {
+                clockSequencer(apuCycle);
+            }
+
+            sequencerCycle += SEQUENCER_PERIOD;
+        }
+
+        if (apuCycle == blockEnd)
+        {
+            flushSamples();
+        }
+    }
+}
+
+// Channels that were silent may have fallen behind, start them from now
+static void triggerChannel(int ch)
+{
+    soundChannel* chan = &channels[ch];
+
+    chan->enabled = chan->dacOn;
+
+    if (0 == chan->lengthCounter)
+    {
+        chan->lengthCounter = (2 == ch) ? 256 : 64;
+    }
+
+    updatePeriod(ch);
+    chan->nextEdge = apuCycle + chan->period;
+
+    switch (ch)
+    {
+    case 0:
+        chan->volume = gbIO.SNDREG12 >> 4;
+        chan->envelopeTimer = gbIO.SNDREG12 & 0x07;
+
+        sweepShadow = chan->frequency;
+        sweepTimer = ((gbIO.SNDREG10 >> 4) & 0x07) ? ((gbIO.SNDREG10 >> 4) & 0x07) : 8;
+        sweepEnabled = (gbIO.SNDREG10 & 0x77) ? 1 : 0;
+
+        if (gbIO.SNDREG10 & 0x07)
+        {
+            sweepFrequency();
+        }
+        break;
+    case 1:
+        chan->volume = gbIO.SNDREG22 >> 4;
+        chan->envelopeTimer = gbIO.SNDREG22 & 0x07;
+        break;
+    case 2:
+        chan->position = 0;
+        break;
+    default:
+        chan->volume = gbIO.SNDREG42 >> 4;
+        chan->envelopeTimer = gbIO.SNDREG42 & 0x07;
+        chan->lfsr = 0x7FFF;
+        break;
+    }
+}
+
+// Writes to NRx3 and NRx4 both change the frequency
+static void writeFrequency(int ch, uint8_t low, uint8_t high)
+{
+    channels[ch].frequency = low | ((high & 0x07) << 8);
+    updatePeriod(ch);
+}
+
+// Write the frequency high bits, length enable and trigger
+static void writeControl(int ch, uint8_t low, uint8_t high)
+{
+    channels[ch].lengthEnabled = (high & 0x40) ? 1 : 0;
+    writeFrequency(ch, low, high);
+
+    if (high & 0x80)
+    {
+        triggerChannel(ch);
+    }
+}
+
+static void writeEnvelope(int ch, uint8_t value)
+{
+    // The DAC is off when the top five bits are clear, which also kills
+    // the channel
+    channels[ch].dacOn = (value & 0xF8) ? 1 : 0;
+
+    if (!channels[ch].dacOn)
+    {
+        channels[ch].enabled = 0;
+    }
+}
+
+static int ringFill(void)
+{
+    return SDL_AtomicGet(&ringWrite) - SDL_AtomicGet(&ringRead);
+}
+
+// Nudge the resampling ratio so the ring settles at its target. The ring is
+// sampled at the same point of every frame, just after the frame's samples
+// went in, and averaged so a single late callback doesn't move the pitch.
+static void adjustRate(void)
+{
+    double adjust;
+
+    peakAverage += (ringFill() - peakAverage) / 16.0;
+
+    adjust = RATE_ADJUST_GAIN * (peakAverage - peakTarget) / peakTarget;
+
+    if (adjust > RATE_ADJUST_MAX)
+    {
+        adjust = RATE_ADJUST_MAX;
+    }
+    else if (adjust < -RATE_ADJUST_MAX)
+    {
+        adjust = -RATE_ADJUST_MAX;
+    }
+
+    // A fuller ring takes bigger steps through the input, so fewer frames
+    // come out and the device catches up
+    resampleStep = (uint32_t)(resampleBaseStep * (1.0 + adjust));
+}
+
+// The sound only catches up when the CPU touches one of its registers and
+// at the end of each frame, in between it costs nothing. At the end of a
+// frame everything synthesised is sent to the device straight away.
+void updateSound(void)
+{
+    runApu(gbState.cycles);
+
+    if (soundOutput)
+    {
+        flushSamples();
+    }
+
+    // A capture on its own runs at a fixed ratio so it's repeatable
+    if (audioDevice)
+    {
+        adjustRate();
+    }
+}
+
+// How far the queued sound is ahead of where it should be when the next
+// frame starts, in milliseconds. Negative means the device is close to
+// running dry.
+double getSoundAhead(void)
+{
+    if (!audioDevice)
+    {
+        return 0;
+    }
+
+    return ((ringFill() - (peakTarget - frameFrames)) * 1000.0) / OUTPUT_RATE;
+}
+
+uint8_t readSoundRegister(uint16_t address)
+{
+    runApu(gbState.cycles);
+
+    if (address >= ADDR_WAVE_RAM)
+    {
+        return gbIO.WAVERAM[address - ADDR_WAVE_RAM];
+    }
+
+    if (0xFF26 == address)
+    {
+        uint8_t status = apuPower ? NR52_POWER : 0;
+        int ch;
+
+        for (ch = 0; ch < NUM_CHANNELS; ch++)
+        {
+            status |= channels[ch].enabled << ch;
+        }
+
+        return status | readMasks[address - ADDR_SOUND_REGS];
+    }
+
+    return SOUND_REG(address) | readMasks[address - ADDR_SOUND_REGS];
+}
+
+void writeSoundRegister(uint16_t address, uint8_t value)
+{
+    int ch;
+
+    runApu(gbState.cycles);
+
+    if (address >= ADDR_WAVE_RAM)
+    {
+        gbIO.WAVERAM[address - ADDR_WAVE_RAM] = value;
+        return;
+    }
+
+    // Unused gaps in the register block
+    if ((0xFF15 == address) || (0xFF1F == address) || (address > 0xFF26))
+    {
+        return;
+    }
+
+    // Only NR52 can be written while the sound is powered off
+    if (!apuPower && (0xFF26 != address))
+    {
+        return;
+    }
+
+    // Finish the samples mixed with the old panning and volume
+    if ((0xFF24 == address) || (0xFF25 == address))
+    {
+        flushSamples();
+    }
+
+    SOUND_REG(address) = value;
+
+    switch (address)
+    {
+    case 0xFF11: channels[0].lengthCounter = 64 - (value & 0x3F); break;
+    case 0xFF16: channels[1].lengthCounter = 64 - (value & 0x3F); break;
+    case 0xFF1B: channels[2].lengthCounter = 256 - value; break;
+    case 0xFF20: channels[3].lengthCounter = 64 - (value & 0x3F); break;
+
+    case 0xFF12: writeEnvelope(0, value); break;
+    case 0xFF17: writeEnvelope(1, value); break;
+    case 0xFF21: writeEnvelope(3, value); break;
+
+    case 0xFF1A:
+        channels[2].dacOn = (value & 0x80) ? 1 : 0;
+
+        if (!channels[2].dacOn)
+        {
+            channels[2].enabled = 0;
+        }
+        break;
+
+    case 0xFF13: writeFrequency(0, value, gbIO.SNDREG14); break;
+    case 0xFF18: writeFrequency(1, value, gbIO.SNDREG24); break;
+    case 0xFF1D: writeFrequency(2, value, gbIO.SNDREG34); break;
+
+    case 0xFF14: writeControl(0, gbIO.SNDREG13, value); break;
+    case 0xFF19: writeControl(1, gbIO.SNDREG23, value); break;
+    case 0xFF1E: writeControl(2, gbIO.SNDREG33, value); break;
+    case 0xFF23: writeControl(3, 0, value); break;
+
+    case 0xFF22: updatePeriod(3); break;
+
+    case 0xFF26:
+        if (!(value & NR52_POWER) && apuPower)
+        {
+            // Powering off clears every register except wave RAM
+            for (ch = 0xFF10; ch < 0xFF26; ch++)
+            {
+                SOUND_REG(ch) = 0;
+            }
+
+            for (ch = 0; ch < NUM_CHANNELS; ch++)
+            {
+                channels[ch].enabled = 0;
+                channels[ch].dacOn = 0;
+                channels[ch].lengthEnabled = 0;
+            }
+        }
+        else if ((value & NR52_POWER) && !apuPower)
+        {
+            sequencerStep = 0;
+        }
+
+        apuPower = value & NR52_POWER;
+        SOUND_REG(address) = apuPower;
+        break;
+
+    default:
+        break;
+    }
+
+    refreshLevels(apuCycle);
+}
+
+// Called from the SDL audio thread, only ever reads from the ring
+static void audioCallback(void* userdata, Uint8* stream, int len)
+{
+    static int16_t lastFrame[2] = { 0, 0 };
+    int16_t* out = (int16_t*)stream;
+    int wanted = len / (2 * sizeof(int16_t));
+    int readPos = SDL_AtomicGet(&ringRead);
+    int available = SDL_AtomicGet(&ringWrite) - readPos;
+    int ii;
+
+    SDL_MemoryBarrierAcquire();
+
+    if (available > wanted)
+    {
+        available = wanted;
+    }
+
+    for (ii = 0; ii < available; ii++)
+    {
+        out[ii * 2] = ringBuffer[((readPos + ii) & RING_MASK) * 2];
+        out[(ii * 2) + 1] = ringBuffer[(((readPos + ii) & RING_MASK) * 2) + 1];
+    }
+
+    if (available > 0)
+    {
+        lastFrame[0] = out[(available - 1) * 2];
+        lastFrame[1] = out[((available - 1) * 2) + 1];
+    }
+
+    // On an underrun hold the last sample rather than dropping to zero,
+    // which would click
+    for (; ii < wanted; ii++)
+    {
+        out[ii * 2] = lastFrame[0];
+        out[(ii * 2) + 1] = lastFrame[1];
+    }
+
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicSet(&ringRead, readPos + available);
+}
+
+// Put the sound hardware back to its power on state, from the current cycle
+void resetSound(void)
+{
+    int ch;
+
+    memset(channels, 0, sizeof(channels));
+
+    for (ch = 0; ch < NUM_CHANNELS; ch++)
+    {
+        channels[ch].nextEdge = CYCLE_NEVER;
+    }
+
+    channels[3].lfsr = 0x7FFF;
+
+    apuPower = NR52_POWER;
+    sequencerStep = 0;
+    apuCycle = gbState.cycles;
+    bufferCycle = gbState.cycles;
+    sequencerCycle = gbState.cycles + SEQUENCER_PERIOD;
+
+    memset(stepBuffer, 0, sizeof(stepBuffer));
+    memset(integrators, 0, sizeof(integrators));
+    memset(mixLeft, 0, sizeof(mixLeft));
+    memset(mixRight, 0, sizeof(mixRight));
+    resamplePosition = (RESAMPLE_TAPS / 2) << 16;
+    resampleBaseStep = (uint32_t)(((uint64_t)APU_RATE << 16) / OUTPUT_RATE);
+    resampleStep = resampleBaseStep;
+
+    // The ring drains to its low point just as the next frame is pushed, so
+    // aim for the average fill to be the latency less the device buffer
+    frameFrames = (int)(((uint64_t)OUTPUT_RATE * CYCLES_PER_FRAME) / CPU_CLOCK_HZ);
+    peakTarget = (((SOUND_LATENCY_MS * OUTPUT_RATE) / 1000) - OUTPUT_SAMPLES) + (frameFrames / 2);
+    peakAverage = peakTarget;
+
+    SDL_AtomicSet(&ringRead, 0);
+    SDL_AtomicSet(&ringWrite, 0);
+
+    initBlepKernel();
+}
+
+// Reset the sound hardware, start capturing if a file is given and open the
+// audio device. The sound registers still work when output is disabled or
+// no device could be opened. Returns whether sound is actually being played.
+int initSound(int output, const char* captureFile)
+{
+    SDL_AudioSpec wanted;
+    SDL_AudioSpec obtained;
+
+    resetSound();
+
+    soundOutput = 0;
+    soundCapture = 0;
+
+    if (captureFile && openCapture(captureFile, OUTPUT_RATE))
+    {
+        soundCapture = 1;
+        soundOutput = 1;
+    }
+
+    if (!output)
+    {
+        return 0;
+    }
+
+    if (SDL_InitSubSystem(SDL_INIT_AUDIO) != 0)
+    {
+        printf("Could not initialise audio, running without sound\n");
+        return 0;
+    }
+
+    SDL_zero(wanted);
+    wanted.freq = OUTPUT_RATE;
+    wanted.format = AUDIO_S16SYS;
+    wanted.channels = 2;
+    wanted.samples = OUTPUT_SAMPLES;
+    wanted.callback = audioCallback;
+
+    audioDevice = SDL_OpenAudioDevice(NULL, 0, &wanted, &obtained, 0);
+
+    if (0 == audioDevice)
+    {
+        printf("Could not open an audio device, running without sound\n");
+        return 0;
+    }
+
+    soundOutput = 1;
+
+    SDL_PauseAudioDevice(audioDevice, 0);
+
+    return 1;
+}
+
+void closeSound(void)
+{
+    // Everything up to now goes into the capture
+    if (soundCapture)
+    {
+        runApu(gbState.cycles);
+        flushSamples();
+        closeCapture();
+        soundCapture = 0;
+    }
+
+    if (audioDevice)
+    {
+        SDL_CloseAudioDevice(audioDevice);
+        audioDevice = 0;
+    }
+
+    soundOutput = 0;
+}
@@ -0,0 +1,199 @@
+/******************************************************************************
+DoGoBoy - Nintendo GameBoy Emulator
+*******************************************************************************
+Copyright (c) 2009-2013, Douglas Gore (doug@ssonic.co.uk)
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the Douglas Gore nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL DOUGLAS GORE BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*******************************************************************************
+Purpose:
+
+Instrumentation counters for seeing where an instance spends its time. The
+hot paths only count when built with GAMEBOY_STATS, the hardware updates are
+timed around each call in the main loop and the CPU is given whatever is
+left of the frame, so nothing is timed per instruction. The totals can be
+read through the API or dumped as a line of JSON every so many frames.
+******************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "SDL.h"
+
+#include "gameboy.h"
+
+emulatorStats gbStats;
+
+// Totals at the last periodic dump, so each dump covers just its interval
+static emulatorStats lastDump;
+static int dumpInterval = 0;
+
+static const char* regionNames[STATS_REGION_COUNT] =
+{
+    "rom0", "romx", "vram", "cart_ram", "wram", "echo", "oam", "io", "hram"
+};
+
+// Region for each 4KB page, FExx and FFxx are split further
+static const uint8_t pageRegions[16] =
+{
+    STATS_REGION_ROM0, STATS_REGION_ROM0, STATS_REGION_ROM0, STATS_REGION_ROM0,
+    STATS_REGION_ROMX, STATS_REGION_ROMX, STATS_REGION_ROMX, STATS_REGION_ROMX,
+    STATS_REGION_VRAM, STATS_REGION_VRAM, STATS_REGION_CART_RAM, STATS_REGION_CART_RAM,
+    STATS_REGION_WRAM, STATS_REGION_WRAM, STATS_REGION_ECHO, STATS_REGION_ECHO
+};
+
+// Whether this build keeps the counters at all
+int statsAvailable(void)
+{
+#ifdef GAMEBOY_STATS
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+void getEmulatorStats(emulatorStats* stats)
+{
+    *stats = gbStats;
+}
+
+void resetEmulatorStats(void)
+{
+    memset(&gbStats, 0, sizeof(gbStats));
+    memset(&lastDump, 0, sizeof(lastDump));
+}
+
+// Dump the counters for every interval of this many frames, 0 to stop
+void setStatsInterval(int frames)
+{
+    dumpInterval = frames;
+}
+
+void statsMemoryAccess(uint16_t address, int write)
+{
+    statsRegion region;
+
+    if (address < 0xFE00)
+    {
+        region = (statsRegion)pageRegions[address >> 12];
+    }
+    else if (address < 0xFF00)
+    {
+        region = STATS_REGION_OAM;
+    }
+    else if ((address < 0xFF80) || (address == 0xFFFF))
+    {
+        region = STATS_REGION_IO;
+    }
+    else
+    {
+        region = STATS_REGION_HRAM;
+    }
+
+    if (write)
+    {
+        gbStats.writes[region]++;
+    }
+    else
+    {
+        gbStats.reads[region]++;
+    }
+}
+
+static double ticksToMs(uint64_t ticks)
+{
+    return (ticks * 1000.0) / SDL_GetPerformanceFrequency();
+}
+
+static void printRegions(FILE* out, const char* name, const uint64_t* counts)
+{
+    int ii;
+
+    fprintf(out, "\"%s\":{", name);
+
+    for (ii = 0; ii < STATS_REGION_COUNT; ii++)
+    {
+        fprintf(out, "%s\"%s\":%llu", ii ? "," : "", regionNames[ii], (unsigned long long)counts[ii]);
+    }
+
+    fprintf(out, "}");
+}
+
+// Print the counters as one line of JSON. The PPU time doesn't include
+// drawFrame, and the CPU gets the frame time not spent in the hardware.
+void printEmulatorStats(FILE* out, const emulatorStats* stats)
+{
+    const uint64_t* ticks = stats->hostTicks;
+    uint64_t hardware = ticks[STATS_TIME_PPU] + ticks[STATS_TIME_TIMERS] + ticks[STATS_TIME_INTERRUPTS] +
+                        ticks[STATS_TIME_DMA] + ticks[STATS_TIME_SOUND];
+    uint64_t cpu = (ticks[STATS_TIME_FRAME] > hardware) ? (ticks[STATS_TIME_FRAME] - hardware) : 0;
+    uint64_t ppu = (ticks[STATS_TIME_PPU] > ticks[STATS_TIME_DRAW]) ? (ticks[STATS_TIME_PPU] - ticks[STATS_TIME_DRAW]) : 0;
+
+    fprintf(out, "{\"frames\":%llu,", (unsigned long long)stats->framesEmulated);
+    fprintf(out, "\"host_ms\":{\"total\":%.3f,\"cpu\":%.3f,\"ppu\":%.3f,\"draw\":%.3f,\"timers\":%.3f,\"interrupts\":%.3f,\"dma\":%.3f,\"sound\":%.3f},",
+            ticksToMs(ticks[STATS_TIME_FRAME]), ticksToMs(cpu), ticksToMs(ppu), ticksToMs(ticks[STATS_TIME_DRAW]),
+            ticksToMs(ticks[STATS_TIME_TIMERS]), ticksToMs(ticks[STATS_TIME_INTERRUPTS]),
+            ticksToMs(ticks[STATS_TIME_DMA]), ticksToMs(ticks[STATS_TIME_SOUND]));
+    fprintf(out, "\"instructions\":%llu,\"halted_cycles\":%llu,\"idle_skipped_cycles\":%llu,",
+            (unsigned long long)stats->instructions, (unsigned long long)stats->haltedCycles,
+            (unsigned long long)stats->idleSkippedCycles);
+    printRegions(out, "reads", stats->reads);
+    fprintf(out, ",");
+    printRegions(out, "writes", stats->writes);
+    fprintf(out, ",\"bank_switches\":%llu,\"bank_switches_per_frame\":%.2f,",
+            (unsigned long long)stats->bankSwitches,
+            stats->framesEmulated ? ((double)stats->bankSwitches / stats->framesEmulated) : 0.0);
+    fprintf(out, "\"frames_rendered\":%llu,\"frames_skipped\":%llu}\n",
+            (unsigned long long)stats->framesRendered, (unsigned long long)stats->framesSkipped);
+    fflush(out);
+}
+
+// Called by the main loop with the host time the frame took, and dumps what
+// happened since the last dump once the interval is up
+void statsEndFrame(uint64_t frameTicks)
+{
+    emulatorStats interval;
+    uint64_t* now = (uint64_t*)&gbStats;
+    uint64_t* last = (uint64_t*)&lastDump;
+    uint64_t* delta = (uint64_t*)&interval;
+    unsigned int ii;
+
+    gbStats.hostTicks[STATS_TIME_FRAME] += frameTicks;
+    gbStats.framesEmulated++;
+
+    if ((0 == dumpInterval) || (gbStats.framesEmulated - lastDump.framesEmulated) < (uint64_t)dumpInterval)
+    {
+        return;
+    }
+
+    // Every field is a counter, so the interval is a plain difference
+    for (ii = 0; ii < (sizeof(emulatorStats) / sizeof(uint64_t)); ii++)
+    {
+        delta[ii] = now[ii] - last[ii];
+    }
+
+    printEmulatorStats(stderr, &interval);
+
+    lastDump = gbStats;
+}